@@ -0,0 +1,755 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Storage engine microbenchmarks.
+ *
+ * Every module of libgibson the engine is built on is exercised directly,
+ * without a server or a socket in the way:
+ *
+ *  trie  : insert, lookup hit / miss and prefix count over a dense key set
+ *          of the given fan-out and depth and over object:id:field keys.
+ *  opool : LIFO, FIFO and random churn of gbItem sized objects, against
+ *          plain zmalloc / zfree doing the same.
+ *  llist : the append and reset cycle of the multi key operations.
+ *  lzf   : compression of every level and decompression of typical values.
+ *
+ * Each case is repeated and the median is printed, as ns per operation and
+ * hardware cache misses per operation when perf events are available.
+ *
+ * Usage: engine-benchmark [-n keys] [-f fan-out] [-d depth] [-r repeats] [module ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
+#include "zmem.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+#define MAX_REPEATS 31
+
+typedef void (*bench_fn)( void *ctx, size_t n );
+
+typedef struct
+{
+    trie_t         tree;
+    unsigned char *keys;
+    size_t         keylen;
+    size_t         nkeys;
+    // lookup order, a permutation of the key indexes
+    size_t        *order;
+    unsigned char *misses;
+    size_t         plen;
+    unsigned long  bytes;
+}
+trie_ctx_t;
+
+typedef struct
+{
+    opool_t  pool;
+    void   **live;
+    size_t   nlive;
+    size_t  *order;
+    int      use_pool;
+}
+pool_ctx_t;
+
+typedef struct
+{
+    llist_t *list;
+    size_t   batch;
+}
+list_ctx_t;
+
+typedef struct
+{
+    unsigned char *in;
+    unsigned char *out;
+    unsigned char *plain;
+    unsigned int   size;
+    unsigned int   comprlen;
+    int            level;
+}
+lzf_ctx_t;
+
+static int repeats = 5, perf_fd = -1;
+static uint64_t rng = 0x2545F4914F6CDD1DULL;
+
+static uint64_t next_random()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return rng;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perf_open()
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset( &attr, 0, sizeof(attr) );
+
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    perf_fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+#endif
+}
+
+static void perf_start()
+{
+#ifdef __linux__
+    if( perf_fd >= 0 )
+    {
+        ioctl( perf_fd, PERF_EVENT_IOC_RESET, 0 );
+        ioctl( perf_fd, PERF_EVENT_IOC_ENABLE, 0 );
+    }
+#endif
+}
+
+static uint64_t perf_stop()
+{
+    uint64_t count = 0;
+#ifdef __linux__
+    if( perf_fd >= 0 )
+    {
+        ioctl( perf_fd, PERF_EVENT_IOC_DISABLE, 0 );
+        if( read( perf_fd, &count, sizeof(count) ) != sizeof(count) )
+            count = 0;
+    }
+#endif
+    return count;
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return ( x > y ) - ( x < y );
+}
+
+static void shuffle( size_t *v, size_t n )
+{
+    size_t i;
+
+    for( i = 0; i < n; ++i )
+        v[i] = i;
+
+    for( i = n; i > 1; --i )
+    {
+        size_t j = next_random() % i, t = v[i - 1];
+
+        v[i - 1] = v[j];
+        v[j]     = t;
+    }
+}
+
+/*
+ * Run 'fn' over 'n' operations 'repeats' times, calling 'setup' before
+ * and 'teardown' after each run outside of the measure, and print the
+ * median cost of an operation.
+ */
+static void measure( const char *module, const char *name, const char *extra, bench_fn fn, bench_fn setup, bench_fn teardown, void *ctx, size_t n )
+{
+    double ns[MAX_REPEATS], misses[MAX_REPEATS];
+    char smisses[32] = "-";
+    int i;
+
+    for( i = 0; i < repeats; ++i )
+    {
+        uint64_t start;
+
+        if( setup )
+            setup( ctx, n );
+
+        perf_start();
+        start = now_ns();
+
+        fn( ctx, n );
+
+        ns[i]     = (double)( now_ns() - start ) / n;
+        misses[i] = (double)perf_stop() / n;
+
+        if( teardown )
+            teardown( ctx, n );
+    }
+
+    qsort( ns, repeats, sizeof(double), cmp_double );
+    qsort( misses, repeats, sizeof(double), cmp_double );
+
+    if( perf_fd >= 0 )
+        snprintf( smisses, sizeof(smisses), "%.2f", misses[repeats / 2] );
+
+    printf( "%-6s %-26s %10.1f %10.2f %10s  %s\n", module, name, ns[repeats / 2], 1e3 / ns[repeats / 2], smisses, extra ? extra : "" );
+}
+
+// trie
+
+#define trie_key( c, i ) ( (c)->keys + (i) * (c)->keylen )
+
+// every string of 'depth' symbols out of 'fanout', up to 'n' of them, spread over the key space
+static void trie_dense_keys( trie_ctx_t *c, size_t n, int fanout, int depth )
+{
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ!#$%&()*+,-./;<=>?@[]^_{|}~";
+    double space = 1;
+    size_t i, stride;
+    int d;
+
+    for( d = 0; d < depth; ++d )
+        space *= fanout;
+
+    n      = space < n ? (size_t)space : n;
+    stride = (size_t)( space / n );
+
+    c->keylen = depth;
+    c->nkeys  = n;
+    c->keys   = malloc( n * depth );
+    c->misses = malloc( n * depth );
+
+    for( i = 0; i < n; ++i )
+    {
+        uint64_t v = i * stride;
+
+        for( d = depth - 1; d >= 0; --d, v /= fanout )
+        {
+            trie_key( c, i )[d] = alphabet[ v % fanout ];
+            // same prefix, last symbol out of the alphabet
+            c->misses[ i * depth + d ] = d == depth - 1 ? '\'' : trie_key( c, i )[d];
+        }
+    }
+}
+
+// object:id:field keys, long shared prefixes and a small fan-out at the end
+static void trie_object_keys( trie_ctx_t *c, size_t n )
+{
+    static const char *fields[] = { "name", "mail", "info", "hits" };
+    size_t i;
+
+    c->keylen = 19;
+    c->nkeys  = n;
+    c->keys   = malloc( n * c->keylen );
+    c->misses = malloc( n * c->keylen );
+
+    for( i = 0; i < n; ++i )
+    {
+        char key[32];
+
+        snprintf( key, sizeof(key), "user:%09zu:%s", i / 4, fields[ i % 4 ] );
+
+        memcpy( trie_key( c, i ), key, c->keylen );
+        memcpy( c->misses + i * c->keylen, key, c->keylen );
+
+        c->misses[ i * c->keylen + c->keylen - 1 ] = 'x';
+    }
+}
+
+static void trie_reset( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+
+    tr_init_tree( c->tree );
+}
+
+static void trie_free( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+
+    tr_free( &c->tree );
+}
+
+static void trie_insert( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+    size_t i, before = zmem_used();
+
+    for( i = 0; i < n; ++i )
+        tr_insert( &c->tree, trie_key( c, c->order[i] ), c->keylen, (void *)1 );
+
+    c->bytes = zmem_used() - before;
+}
+
+static void trie_find( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+    size_t i, found = 0;
+
+    for( i = 0; i < n; ++i )
+        found += tr_find( &c->tree, trie_key( c, c->order[i] ), c->keylen ) != NULL;
+
+    if( found != n )
+        fprintf( stderr, "trie: %zu keys out of %zu found\n", found, n );
+}
+
+static void trie_find_miss( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+    size_t i, found = 0;
+
+    for( i = 0; i < n; ++i )
+        found += tr_find( &c->tree, c->misses + c->order[i] * c->keylen, c->keylen ) != NULL;
+
+    if( found )
+        fprintf( stderr, "trie: %zu missing keys found\n", found );
+}
+
+// same lookups as trie_find, GB_ENGINE_BATCH_SIZE keys at a time through tr_find_nodes
+static void trie_find_batch( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+    unsigned char *keys[GB_ENGINE_BATCH_SIZE];
+    size_t lens[GB_ENGINE_BATCH_SIZE];
+    tnode_t *nodes[GB_ENGINE_BATCH_SIZE];
+    size_t i, j, b, found = 0;
+
+    for( i = 0; i < n; i += b )
+    {
+        b = n - i < GB_ENGINE_BATCH_SIZE ? n - i : GB_ENGINE_BATCH_SIZE;
+
+        for( j = 0; j < b; ++j )
+        {
+            keys[j] = trie_key( c, c->order[i + j] );
+            lens[j] = c->keylen;
+        }
+
+        tr_find_nodes( &c->tree, keys, lens, b, nodes );
+
+        for( j = 0; j < b; ++j )
+            found += nodes[j] && nodes[j]->data;
+    }
+
+    if( found != n )
+        fprintf( stderr, "trie: %zu keys out of %zu found\n", found, n );
+}
+
+static int trie_count_cb( void *ctx, tnode_t *node, unsigned char *key, size_t keylen )
+{
+    return 1;
+}
+
+static void trie_count( void *ctx, size_t n )
+{
+    trie_ctx_t *c = ctx;
+    size_t i;
+
+    for( i = 0; i < n; ++i )
+        tr_count( &c->tree, trie_key( c, c->order[i] ), c->plen, -1, c->keylen + 1, trie_count_cb, NULL );
+}
+
+static void bench_trie_set( const char *name, trie_ctx_t *c )
+{
+    char label[64], extra[64];
+
+    c->order = malloc( c->nkeys * sizeof(size_t) );
+    shuffle( c->order, c->nkeys );
+
+    snprintf( label, sizeof(label), "%s insert", name );
+    measure( "trie", label, NULL, trie_insert, trie_reset, trie_free, c, c->nkeys );
+
+    // keep a tree around for the lookups
+    trie_reset( c, 0 );
+    trie_insert( c, c->nkeys );
+
+    snprintf( extra, sizeof(extra), "%zu keys, %.1f bytes/key", c->nkeys, (double)c->bytes / c->nkeys );
+
+    snprintf( label, sizeof(label), "%s find hit", name );
+    measure( "trie", label, extra, trie_find, NULL, NULL, c, c->nkeys );
+
+    snprintf( label, sizeof(label), "%s find batch", name );
+    measure( "trie", label, NULL, trie_find_batch, NULL, NULL, c, c->nkeys );
+
+    snprintf( label, sizeof(label), "%s find miss", name );
+    measure( "trie", label, NULL, trie_find_miss, NULL, NULL, c, c->nkeys );
+
+    // prefixes matching a handful of keys
+    c->plen = c->keylen > 2 ? c->keylen - 1 : 1;
+
+    snprintf( label, sizeof(label), "%s count prefix", name );
+    measure( "trie", label, NULL, trie_count, NULL, NULL, c, c->nkeys / 16 ? c->nkeys / 16 : 1 );
+
+    trie_free( c, 0 );
+    free( c->order );
+    free( c->keys );
+    free( c->misses );
+}
+
+static void bench_trie( size_t n, int fanout, int depth )
+{
+    trie_ctx_t c;
+    char name[32];
+
+    memset( &c, 0, sizeof(c) );
+    trie_dense_keys( &c, n, fanout, depth );
+    snprintf( name, sizeof(name), "f%d/d%d", fanout, depth );
+    bench_trie_set( name, &c );
+
+    memset( &c, 0, sizeof(c) );
+    trie_object_keys( &c, n );
+    bench_trie_set( "object", &c );
+}
+
+// object pool
+
+static void pool_setup( void *ctx, size_t n )
+{
+    pool_ctx_t *c = ctx;
+
+    if( c->use_pool )
+        opool_create( &c->pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+}
+
+static void pool_teardown( void *ctx, size_t n )
+{
+    pool_ctx_t *c = ctx;
+    size_t i;
+
+    if( c->use_pool )
+        opool_destroy( &c->pool );
+    else
+    {
+        for( i = 0; i < c->nlive; ++i )
+            if( c->live[i] )
+                zfree( c->live[i] );
+    }
+
+    memset( c->live, 0, c->nlive * sizeof(void *) );
+}
+
+static __inline__ void *pool_alloc( pool_ctx_t *c )
+{
+    return c->use_pool ? opool_alloc_object( &c->pool ) : zmalloc( sizeof(gbItem) );
+}
+
+static __inline__ void pool_free( pool_ctx_t *c, void *obj )
+{
+    if( c->use_pool )
+        opool_free_object( &c->pool, obj );
+    else
+        zfree( obj );
+}
+
+// allocate everything, then free in reverse order, n operations are n / 2 objects
+static void pool_lifo( void *ctx, size_t n )
+{
+    pool_ctx_t *c = ctx;
+    size_t i, half = n / 2;
+
+    for( i = 0; i < half; ++i )
+        c->live[i] = pool_alloc( c );
+
+    while( i-- )
+    {
+        pool_free( c, c->live[i] );
+        c->live[i] = NULL;
+    }
+}
+
+// allocate everything, then free in allocation order
+static void pool_fifo( void *ctx, size_t n )
+{
+    pool_ctx_t *c = ctx;
+    size_t i, half = n / 2;
+
+    for( i = 0; i < half; ++i )
+        c->live[i] = pool_alloc( c );
+
+    for( i = 0; i < half; ++i )
+    {
+        pool_free( c, c->live[i] );
+        c->live[i] = NULL;
+    }
+}
+
+// a steady population where random items are replaced, like sets overwriting keys
+static void pool_churn( void *ctx, size_t n )
+{
+    pool_ctx_t *c = ctx;
+    size_t i, half = n / 2;
+
+    for( i = 0; i < c->nlive; ++i )
+        c->live[i] = pool_alloc( c );
+
+    for( i = 0; i < half; ++i )
+    {
+        size_t slot = c->order[ i % c->nlive ];
+
+        pool_free( c, c->live[slot] );
+        c->live[slot] = pool_alloc( c );
+    }
+}
+
+static void bench_pool( size_t n )
+{
+    pool_ctx_t c;
+    int i;
+
+    memset( &c, 0, sizeof(c) );
+
+    c.nlive = n;
+    c.live  = calloc( n, sizeof(void *) );
+    c.order = malloc( n * sizeof(size_t) );
+
+    shuffle( c.order, n );
+
+    for( i = 1; i >= 0; --i )
+    {
+        c.use_pool = i;
+
+        measure( "opool", i ? "pool lifo" : "zmalloc lifo", NULL, pool_lifo, pool_setup, pool_teardown, &c, n * 2 );
+        measure( "opool", i ? "pool fifo" : "zmalloc fifo", NULL, pool_fifo, pool_setup, pool_teardown, &c, n * 2 );
+        measure( "opool", i ? "pool random churn" : "zmalloc random churn", NULL, pool_churn, pool_setup, pool_teardown, &c, n * 2 );
+    }
+
+    free( c.live );
+    free( c.order );
+}
+
+// linked list
+
+static void list_cycle( void *ctx, size_t n )
+{
+    list_ctx_t *c = ctx;
+    size_t i, j;
+
+    for( i = 0; i < n; i += c->batch )
+    {
+        for( j = 0; j < c->batch; ++j )
+            ll_append( c->list, (void *)( j + 1 ) );
+
+        ll_reset( c->list );
+    }
+}
+
+static void list_walk( void *ctx, size_t n )
+{
+    list_ctx_t *c = ctx;
+    volatile size_t sum = 0;
+    size_t i;
+
+    for( i = 0; i < n; i += c->batch )
+    {
+        ll_foreach( c->list, item )
+            sum += (size_t)item->data;
+    }
+}
+
+static void list_fill( void *ctx, size_t n )
+{
+    list_ctx_t *c = ctx;
+    size_t j;
+
+    ll_reset( c->list );
+    for( j = 0; j < c->batch; ++j )
+        ll_append( c->list, (void *)( j + 1 ) );
+}
+
+static void bench_list( size_t n )
+{
+    static const size_t batches[] = { 16, 255, 4096 };
+    list_ctx_t c;
+    char label[64];
+    size_t i;
+
+    for( i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i )
+    {
+        c.batch = batches[i];
+        c.list  = ll_prealloc( 255 );
+
+        snprintf( label, sizeof(label), "append+reset %zu", c.batch );
+        measure( "llist", label, NULL, list_cycle, NULL, NULL, &c, ( n / c.batch + 1 ) * c.batch );
+
+        list_fill( &c, 0 );
+        snprintf( label, sizeof(label), "walk %zu", c.batch );
+        measure( "llist", label, NULL, list_walk, NULL, NULL, &c, ( n / c.batch + 1 ) * c.batch );
+
+        ll_destroy( c.list );
+    }
+}
+
+// lzf
+
+static void lzf_json_value( unsigned char *p, unsigned int size )
+{
+    unsigned int i = 0, len = 0;
+    char rec[0xFF];
+
+    while( len < size )
+    {
+        int r = snprintf( rec, sizeof(rec), "{\"id\":%u,\"user\":\"user_%u\",\"score\":%u,\"active\":%s},",
+                          i, (unsigned)( next_random() % 1000 ), (unsigned)( next_random() % 10000 ), i % 3 ? "true" : "false" );
+
+        r = r > (int)( size - len ) ? (int)( size - len ) : r;
+        memcpy( p + len, rec, r );
+        len += r;
+        ++i;
+    }
+}
+
+static void lzf_compress_n( void *ctx, size_t n )
+{
+    lzf_ctx_t *c = ctx;
+    size_t i;
+
+    for( i = 0; i < n; ++i )
+        c->comprlen = lzf_compress_level( c->level, c->in, c->size, c->out, c->size );
+}
+
+static void lzf_decompress_n( void *ctx, size_t n )
+{
+    lzf_ctx_t *c = ctx;
+    size_t i;
+
+    for( i = 0; i < n; ++i )
+    {
+        if( lzf_decompress( c->out, c->comprlen, c->plain, c->size ) != c->size )
+        {
+            fprintf( stderr, "lzf: decompression failed\n" );
+            exit( 1 );
+        }
+    }
+}
+
+static void bench_lzf( size_t n )
+{
+    static const unsigned int sizes[] = { 256, 4096, 65536 };
+    lzf_ctx_t c;
+    char label[64], extra[64];
+    size_t i, iterations;
+
+    for( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i )
+    {
+        c.size  = sizes[i];
+        c.in    = malloc( c.size );
+        c.out   = malloc( c.size );
+        c.plain = malloc( c.size );
+
+        lzf_json_value( c.in, c.size );
+
+        // about the same amount of bytes for every size
+        iterations = ( n * 64 ) / c.size + 1;
+
+        for( c.level = 0; c.level < LZF_LEVELS; ++c.level )
+        {
+            lzf_compress_n( &c, 1 );
+
+            snprintf( label, sizeof(label), "compress %s %u", lzf_level_name( c.level ), c.size );
+            snprintf( extra, sizeof(extra), "ratio %.2f", c.comprlen ? (double)c.size / c.comprlen : 0.0 );
+            measure( "lzf", label, extra, lzf_compress_n, NULL, NULL, &c, iterations );
+        }
+
+        c.level = LZF_LEVEL_FAST;
+        lzf_compress_n( &c, 1 );
+
+        if( c.comprlen )
+        {
+            snprintf( label, sizeof(label), "decompress %u", c.size );
+            measure( "lzf", label, NULL, lzf_decompress_n, NULL, NULL, &c, iterations );
+        }
+
+        free( c.in );
+        free( c.out );
+        free( c.plain );
+    }
+}
+
+static int selected( int argc, char **argv, const char *module )
+{
+    int i;
+
+    if( optind >= argc )
+        return 1;
+
+    for( i = optind; i < argc; ++i )
+        if( strcmp( argv[i], module ) == 0 )
+            return 1;
+
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    size_t n = 200000;
+    int fanout = 16, depth = 5, c;
+
+    while( ( c = getopt( argc, argv, "n:f:d:r:h" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'n': n = strtoul( optarg, NULL, 10 ); break;
+            case 'f': fanout = atoi( optarg ); break;
+            case 'd': depth = atoi( optarg ); break;
+            case 'r': repeats = atoi( optarg ); break;
+            default :
+                printf( "Usage: %s [-n keys] [-f fan-out] [-d depth] [-r repeats] [trie] [opool] [llist] [lzf]\n", argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if( n < 16 || fanout < 2 || fanout > 90 || depth < 1 || depth > 64 || repeats < 1 || repeats > MAX_REPEATS )
+    {
+        fprintf( stderr, "Invalid arguments.\n" );
+        return 1;
+    }
+
+    perf_open();
+
+    printf( "%-6s %-26s %10s %10s %10s\n", "module", "case", "ns/op", "Mops/s", "misses/op" );
+
+    if( selected( argc, argv, "trie" ) )
+        bench_trie( n, fanout, depth );
+    if( selected( argc, argv, "opool" ) )
+        bench_pool( n );
+    if( selected( argc, argv, "llist" ) )
+        bench_list( n );
+    if( selected( argc, argv, "lzf" ) )
+        bench_lzf( n );
+
+    return 0;
+}
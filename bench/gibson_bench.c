@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Load generator.
+ *
+ * Opens a number of connections to a running server and keeps each of them
+ * busy with a pipeline of requests drawn from a weighted mix of SET, GET,
+ * MGET, MDEL and INC, then prints the throughput and the latency
+ * distribution of every operation.
+ *
+ * Usage: gibson-benchmark [options]
+ *
+ *  -H host       tcp address ( default 127.0.0.1 )
+ *  -p port       tcp port ( default 10128 )
+ *  -s socket     use this unix socket instead of tcp
+ *  -c clients    number of connections ( default 50 )
+ *  -n requests   total number of requests ( default 100000 )
+ *  -P depth      requests in flight on each connection ( default 1 )
+ *  -m mix        operations weights, e.g. set:1,get:9,mget:1,mdel:0,inc:0
+ *  -r keys       size of the keyspace ( default 10000 )
+ *  -l length     key length, prefix included ( default 16 )
+ *  -K shape      num: shared prefix and zero padded number, hash: hex digits
+ *                spreading keys on every level of the trie ( default num )
+ *  -a access     seq or random walk of the keyspace ( default random )
+ *  -w width      number of trailing characters dropped from a key to get
+ *                the MGET / MDEL prefix ( default 2 )
+ *  -d size       value size ( default 64 )
+ *  -t ttl        ttl of the stored values ( default 0 )
+ *  -S            skip storing the keyspace before the run
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "query.h"
+
+#define REPLY_HEADER_SIZE ( sizeof(short) + 1 + sizeof(uint32_t) )
+#define REQUEST_HEADER_SIZE ( sizeof(uint32_t) + sizeof(short) )
+
+// latency histogram, 16 linear sub buckets for each power of two of nanoseconds
+#define HIST_SUB_BITS 4
+#define HIST_SUB      ( 1 << HIST_SUB_BITS )
+#define HIST_BUCKETS  ( 64 * HIST_SUB )
+
+enum { B_SET = 0, B_GET, B_MGET, B_MDEL, B_INC, B_OPS };
+
+typedef struct
+{
+    const char *name;
+    short       opcode;
+    unsigned    weight;
+    // completed requests, replies with an error code and not found replies
+    unsigned long done;
+    unsigned long errors;
+    unsigned long misses;
+    uint64_t    hist[HIST_BUCKETS];
+}
+op_t;
+
+typedef struct
+{
+    int       fd;
+    // requests written or waiting to be, in order, and their start time
+    int      *ops;
+    uint64_t *started;
+    unsigned  head;
+    unsigned  inflight;
+    // output buffer and number of bytes already written
+    uint8_t  *wbuf;
+    size_t    wsize;
+    size_t    wlen;
+    size_t    wpos;
+    // input buffer
+    uint8_t  *rbuf;
+    size_t    rsize;
+    size_t    rlen;
+}
+conn_t;
+
+static op_t ops[B_OPS] =
+{
+    { "SET",  OP_SET,  1 },
+    { "GET",  OP_GET,  9 },
+    { "MGET", OP_MGET, 0 },
+    { "MDEL", OP_MDEL, 0 },
+    { "INC",  OP_INC,  0 },
+};
+
+static const char *host = "127.0.0.1",
+                  *sock = NULL;
+static int port = 10128,
+           nconns = 50,
+           depth = 1,
+           keylen = 16,
+           hashed = 0,
+           sequential = 0,
+           width = 2,
+           ttl = 0,
+           preload = 1;
+static unsigned long nrequests = 100000,
+                     keyspace = 10000,
+                     cursor = 0;
+static size_t valuesize = 64;
+static uint8_t *value = NULL;
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static void die( const char *what )
+{
+    perror( what );
+    exit( 1 );
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return rng;
+}
+
+static unsigned hist_index( uint64_t v )
+{
+    unsigned msb;
+
+    if( v < HIST_SUB )
+        return v;
+
+    msb = 63 - __builtin_clzll( v );
+
+    return ( msb - HIST_SUB_BITS + 1 ) * HIST_SUB + ( ( v >> ( msb - HIST_SUB_BITS ) ) & ( HIST_SUB - 1 ) );
+}
+
+// lowest value falling in the bucket
+static uint64_t hist_value( unsigned i )
+{
+    unsigned shift;
+
+    if( i < HIST_SUB )
+        return i;
+
+    shift = i / HIST_SUB - 1;
+
+    return (uint64_t)( HIST_SUB + i % HIST_SUB ) << shift;
+}
+
+static uint64_t hist_percentile( const uint64_t *hist, unsigned long total, double p )
+{
+    unsigned long rank = (unsigned long)( total * p ), seen = 0;
+    unsigned i;
+
+    for( i = 0; i < HIST_BUCKETS; ++i )
+    {
+        seen += hist[i];
+        if( seen > rank )
+            return hist_value( i );
+    }
+
+    return hist_value( HIST_BUCKETS - 1 );
+}
+
+// write the key with index n in 'key' and return its length
+static size_t make_key( char *key, unsigned long n )
+{
+    if( hashed )
+    {
+        uint64_t h = 0;
+        size_t i;
+
+        for( i = 0; i < (size_t)keylen; ++i, h >>= 4 )
+        {
+            // splitmix64 finalizer, a bijection so the first 16 digits are unique
+            if( ( i & 15 ) == 0 )
+            {
+                h = ( n ^ ( (uint64_t)i << 48 ) ) + 0x9E3779B97F4A7C15ULL;
+                h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+                h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBULL;
+                h = h ^ ( h >> 31 );
+            }
+
+            key[i] = "0123456789abcdef"[ h & 0xF ];
+        }
+    }
+    else
+        snprintf( key, keylen + 1, "key:%0*lu", keylen - 4, n );
+
+    return keylen;
+}
+
+static unsigned long next_key_index()
+{
+    if( sequential )
+        return cursor++ % keyspace;
+
+    return next_random() % keyspace;
+}
+
+static int pick_op()
+{
+    unsigned total = 0, r, i;
+
+    for( i = 0; i < B_OPS; ++i )
+        total += ops[i].weight;
+
+    r = next_random() % total;
+
+    for( i = 0; i < B_OPS; ++i )
+    {
+        if( r < ops[i].weight )
+            return i;
+
+        r -= ops[i].weight;
+    }
+
+    return B_GET;
+}
+
+static void conn_reserve( conn_t *c, size_t more )
+{
+    if( c->wlen + more > c->wsize )
+    {
+        c->wsize = ( c->wlen + more ) * 2;
+        c->wbuf  = realloc( c->wbuf, c->wsize );
+        if( c->wbuf == NULL )
+            die( "realloc" );
+    }
+}
+
+static void conn_append_request( conn_t *c, int op )
+{
+    char key[0xFFF], payload[0xFFF];
+    size_t klen = make_key( key, next_key_index() ), plen = 0;
+    uint32_t size;
+    short opcode = ops[op].opcode;
+    uint8_t *p;
+
+    switch( op )
+    {
+        case B_SET:
+            plen = snprintf( payload, sizeof(payload), "%d %.*s ", ttl, (int)klen, key );
+            break;
+
+        case B_INC:
+            // counters live in their own namespace, values stored by SET are not numbers
+            memcpy( key, "inc:", 4 );
+            memcpy( payload, key, klen );
+            plen = klen;
+            break;
+
+        case B_MGET:
+        case B_MDEL:
+            klen = klen > (size_t)width ? klen - width : 1;
+            // fall through
+        default:
+            memcpy( payload, key, klen );
+            plen = klen;
+    }
+
+    size = sizeof(short) + plen + ( op == B_SET ? valuesize : 0 );
+
+    conn_reserve( c, sizeof(uint32_t) + size );
+
+    p = c->wbuf + c->wlen;
+
+    memcpy( p, &size, sizeof(uint32_t) );
+    p += sizeof(uint32_t);
+    memcpy( p, &opcode, sizeof(short) );
+    p += sizeof(short);
+    memcpy( p, payload, plen );
+    p += plen;
+
+    if( op == B_SET )
+    {
+        memcpy( p, value, valuesize );
+        p += valuesize;
+    }
+
+    c->wlen = p - c->wbuf;
+}
+
+static void conn_open( conn_t *c )
+{
+    memset( c, 0, sizeof(conn_t) );
+
+    if( sock )
+    {
+        struct sockaddr_un sa;
+
+        memset( &sa, 0, sizeof(sa) );
+        sa.sun_family = AF_UNIX;
+        strncpy( sa.sun_path, sock, sizeof(sa.sun_path) - 1 );
+
+        if( ( c->fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) < 0 )
+            die( "socket" );
+        if( connect( c->fd, (struct sockaddr *)&sa, sizeof(sa) ) != 0 )
+            die( sock );
+    }
+    else
+    {
+        struct addrinfo hints, *res;
+        char service[16];
+        int yes = 1;
+
+        memset( &hints, 0, sizeof(hints) );
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        snprintf( service, sizeof(service), "%d", port );
+
+        if( getaddrinfo( host, service, &hints, &res ) != 0 )
+        {
+            fprintf( stderr, "Unable to resolve %s\n", host );
+            exit( 1 );
+        }
+
+        if( ( c->fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol ) ) < 0 )
+            die( "socket" );
+        if( connect( c->fd, res->ai_addr, res->ai_addrlen ) != 0 )
+            die( host );
+
+        setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes) );
+        freeaddrinfo( res );
+    }
+
+    fcntl( c->fd, F_SETFL, fcntl( c->fd, F_GETFL ) | O_NONBLOCK );
+
+    c->ops     = calloc( depth, sizeof(int) );
+    c->started = calloc( depth, sizeof(uint64_t) );
+    c->rsize   = 64 * 1024;
+    c->rbuf    = malloc( c->rsize );
+}
+
+// queue requests until the pipeline is full or every request has been issued
+static void conn_fill( conn_t *c, unsigned long *issued, int fixed_op )
+{
+    uint64_t now = now_ns();
+
+    while( c->inflight < (unsigned)depth && *issued < nrequests )
+    {
+        unsigned slot = ( c->head + c->inflight ) % depth;
+        int op = fixed_op >= 0 ? fixed_op : pick_op();
+
+        c->ops[slot]     = op;
+        c->started[slot] = now;
+
+        conn_append_request( c, op );
+
+        ++c->inflight;
+        ++*issued;
+    }
+}
+
+static void conn_flush( conn_t *c )
+{
+    while( c->wpos < c->wlen )
+    {
+        ssize_t n = write( c->fd, c->wbuf + c->wpos, c->wlen - c->wpos );
+
+        if( n < 0 )
+        {
+            if( errno == EAGAIN || errno == EINTR )
+                return;
+            die( "write" );
+        }
+
+        c->wpos += n;
+    }
+
+    c->wpos = c->wlen = 0;
+}
+
+// consume complete replies and return how many
+static unsigned long conn_read( conn_t *c, int record )
+{
+    unsigned long completed = 0;
+    size_t pos = 0;
+    uint64_t now;
+    ssize_t n;
+
+    n = read( c->fd, c->rbuf + c->rlen, c->rsize - c->rlen );
+    if( n == 0 )
+    {
+        fprintf( stderr, "Connection closed by the server.\n" );
+        exit( 1 );
+    }
+    else if( n < 0 )
+    {
+        if( errno == EAGAIN || errno == EINTR )
+            return 0;
+        die( "read" );
+    }
+
+    c->rlen += n;
+    now = now_ns();
+
+    while( c->rlen - pos >= REPLY_HEADER_SIZE )
+    {
+        short code;
+        uint32_t size;
+        op_t *op;
+
+        memcpy( &code, c->rbuf + pos, sizeof(short) );
+        memcpy( &size, c->rbuf + pos + sizeof(short) + 1, sizeof(uint32_t) );
+
+        if( c->rlen - pos < REPLY_HEADER_SIZE + size )
+        {
+            // make room for the rest of a big reply
+            if( REPLY_HEADER_SIZE + size > c->rsize )
+            {
+                c->rsize = REPLY_HEADER_SIZE + size;
+                c->rbuf  = realloc( c->rbuf, c->rsize );
+                if( c->rbuf == NULL )
+                    die( "realloc" );
+            }
+            break;
+        }
+
+        if( c->inflight == 0 )
+        {
+            fprintf( stderr, "Unexpected reply.\n" );
+            exit( 1 );
+        }
+
+        op = &ops[ c->ops[c->head] ];
+
+        if( record )
+        {
+            ++op->done;
+            ++op->hist[ hist_index( now - c->started[c->head] ) ];
+
+            if( code == REPL_ERR_NOT_FOUND )
+                ++op->misses;
+            else if( code < REPL_OK )
+                ++op->errors;
+        }
+
+        c->head = ( c->head + 1 ) % depth;
+        --c->inflight;
+        ++completed;
+
+        pos += REPLY_HEADER_SIZE + size;
+    }
+
+    memmove( c->rbuf, c->rbuf + pos, c->rlen - pos );
+    c->rlen -= pos;
+
+    return completed;
+}
+
+/*
+ * Issue 'total' requests spread on every connection, if 'fixed_op' is not
+ * negative only that operation is used and latencies are not recorded.
+ */
+static double run( conn_t *conns, unsigned long total, int fixed_op )
+{
+    struct pollfd *pfds = calloc( nconns, sizeof(struct pollfd) );
+    unsigned long issued = 0, completed = 0, saved = nrequests;
+    uint64_t start = now_ns();
+    int i;
+
+    nrequests = total;
+
+    for( i = 0; i < nconns; ++i )
+    {
+        conn_fill( &conns[i], &issued, fixed_op );
+        conn_flush( &conns[i] );
+    }
+
+    while( completed < total )
+    {
+        for( i = 0; i < nconns; ++i )
+        {
+            pfds[i].fd      = conns[i].fd;
+            pfds[i].events  = ( conns[i].inflight ? POLLIN : 0 ) | ( conns[i].wpos < conns[i].wlen ? POLLOUT : 0 );
+            pfds[i].revents = 0;
+        }
+
+        if( poll( pfds, nconns, 1000 ) < 0 && errno != EINTR )
+            die( "poll" );
+
+        for( i = 0; i < nconns; ++i )
+        {
+            conn_t *c = &conns[i];
+
+            if( pfds[i].revents & ( POLLIN | POLLHUP | POLLERR ) )
+                completed += conn_read( c, fixed_op < 0 );
+
+            conn_fill( c, &issued, fixed_op );
+
+            if( c->wpos < c->wlen )
+                conn_flush( c );
+        }
+    }
+
+    free( pfds );
+
+    nrequests = saved;
+
+    return ( now_ns() - start ) / 1e9;
+}
+
+static void parse_mix( char *mix )
+{
+    char *tok, *save = NULL;
+    unsigned i, total = 0;
+
+    for( i = 0; i < B_OPS; ++i )
+        ops[i].weight = 0;
+
+    for( tok = strtok_r( mix, ",", &save ); tok; tok = strtok_r( NULL, ",", &save ) )
+    {
+        char *sep = strchr( tok, ':' );
+
+        for( i = 0; i < B_OPS; ++i )
+        {
+            if( sep && strncasecmp( tok, ops[i].name, sep - tok ) == 0 && strlen( ops[i].name ) == (size_t)( sep - tok ) )
+                break;
+        }
+
+        if( i == B_OPS )
+        {
+            fprintf( stderr, "Invalid mix entry '%s'.\n", tok );
+            exit( 1 );
+        }
+
+        ops[i].weight = atoi( sep + 1 );
+        total += ops[i].weight;
+    }
+
+    if( total == 0 )
+    {
+        fprintf( stderr, "The mix has no operation.\n" );
+        exit( 1 );
+    }
+}
+
+static void usage( const char *name )
+{
+    printf( "Usage: %s [-H host] [-p port] [-s socket] [-c clients] [-n requests] [-P depth]\n"
+            "       [-m set:1,get:9,mget:0,mdel:0,inc:0] [-r keys] [-l key length] [-K num|hash]\n"
+            "       [-a seq|random] [-w prefix width] [-d value size] [-t ttl] [-S]\n", name );
+}
+
+int main( int argc, char **argv )
+{
+    conn_t *conns;
+    double elapsed;
+    unsigned long total_done = 0, i;
+    int c;
+
+    while( ( c = getopt( argc, argv, "H:p:s:c:n:P:m:r:l:K:a:w:d:t:Sh" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi( optarg ); break;
+            case 's': sock = optarg; break;
+            case 'c': nconns = atoi( optarg ); break;
+            case 'n': nrequests = strtoul( optarg, NULL, 10 ); break;
+            case 'P': depth = atoi( optarg ); break;
+            case 'm': parse_mix( optarg ); break;
+            case 'r': keyspace = strtoul( optarg, NULL, 10 ); break;
+            case 'l': keylen = atoi( optarg ); break;
+            case 'K': hashed = strcmp( optarg, "hash" ) == 0; break;
+            case 'a': sequential = strcmp( optarg, "seq" ) == 0; break;
+            case 'w': width = atoi( optarg ); break;
+            case 'd': valuesize = strtoul( optarg, NULL, 10 ); break;
+            case 't': ttl = atoi( optarg ); break;
+            case 'S': preload = 0; break;
+            default :
+                usage( argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if( nconns < 1 || depth < 1 || keyspace < 1 || valuesize < 1 || keylen < 5 || keylen > 0xFF ||
+        ( !hashed && snprintf( NULL, 0, "%lu", keyspace - 1 ) > keylen - 4 ) )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    value = malloc( valuesize );
+    for( i = 0; i < valuesize; ++i )
+        value[i] = 'a' + next_random() % 26;
+
+    conns = calloc( nconns, sizeof(conn_t) );
+    for( c = 0; c < nconns; ++c )
+        conn_open( &conns[c] );
+
+    if( preload )
+    {
+        int access = sequential;
+
+        sequential = 1;
+        elapsed    = run( conns, keyspace, B_SET );
+        sequential = access;
+        cursor     = 0;
+
+        printf( "Stored %lu keys in %.2fs.\n\n", keyspace, elapsed );
+    }
+
+    elapsed = run( conns, nrequests, -1 );
+
+    printf( "%lu requests, %d connections, depth %d, %lu keys of %d bytes, %zu bytes values.\n\n",
+            nrequests, nconns, depth, keyspace, keylen, valuesize );
+    printf( "%-6s %10s %12s %10s %10s %10s %10s %8s %8s\n", "op", "requests", "ops/s", "p50 us", "p99 us", "p999 us", "max us", "misses", "errors" );
+
+    for( c = 0; c < B_OPS; ++c )
+    {
+        op_t *op = &ops[c];
+        unsigned b;
+
+        if( op->done == 0 )
+            continue;
+
+        for( b = HIST_BUCKETS - 1; b > 0 && op->hist[b] == 0; --b );
+
+        printf( "%-6s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f %8lu %8lu\n",
+                op->name,
+                op->done,
+                op->done / elapsed,
+                hist_percentile( op->hist, op->done, 0.50 ) / 1e3,
+                hist_percentile( op->hist, op->done, 0.99 ) / 1e3,
+                hist_percentile( op->hist, op->done, 0.999 ) / 1e3,
+                hist_value( b ) / 1e3,
+                op->misses,
+                op->errors );
+
+        total_done += op->done;
+    }
+
+    if( total_done )
+    {
+        uint64_t all[HIST_BUCKETS] = {0};
+        unsigned b;
+
+        for( c = 0; c < B_OPS; ++c )
+            for( b = 0; b < HIST_BUCKETS; ++b )
+                all[b] += ops[c].hist[b];
+
+        for( b = HIST_BUCKETS - 1; b > 0 && all[b] == 0; --b );
+
+        printf( "%-6s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+                "ALL",
+                total_done,
+                total_done / elapsed,
+                hist_percentile( all, total_done, 0.50 ) / 1e3,
+                hist_percentile( all, total_done, 0.99 ) / 1e3,
+                hist_percentile( all, total_done, 0.999 ) / 1e3,
+                hist_value( b ) / 1e3 );
+    }
+
+    for( c = 0; c < nconns; ++c )
+        close( conns[c].fd );
+
+    return 0;
+}
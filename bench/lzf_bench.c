@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * LZF decoder microbenchmark.
+ *
+ * Every corpus is compressed with lzf_compress and then decompressed over and
+ * over with both the reference byte-by-byte decoder and lzf_decompress, the
+ * output of the two is compared and the throughput of each is printed.
+ *
+ * Usage: lzf-benchmark [-n iterations] [file ...]
+ *
+ * Files given on the command line are added to the builtin corpus.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "lzf.h"
+
+#define CORPUS_ITEM_SIZE ( 64 * 1024 )
+
+typedef struct
+{
+    const char    *name;
+    unsigned char *data;
+    unsigned int   size;
+}
+corpus_t;
+
+// original liblzf decoder, used as baseline and to verify the output
+static unsigned int ref_decompress( const void *const in_data, unsigned int in_len, void *out_data, unsigned int out_len )
+{
+    const unsigned char *ip = (const unsigned char *)in_data;
+    unsigned char *op = (unsigned char *)out_data;
+    const unsigned char *const in_end  = ip + in_len;
+    unsigned char *const out_end = op + out_len;
+
+    do
+    {
+        unsigned int ctrl = *ip++;
+
+        if( ctrl < (1 << 5) )
+        {
+            ctrl++;
+
+            if( op + ctrl > out_end || ip + ctrl > in_end )
+                return 0;
+
+            do
+                *op++ = *ip++;
+            while( --ctrl );
+        }
+        else
+        {
+            unsigned int len = ctrl >> 5;
+            unsigned char *ref = op - ((ctrl & 0x1f) << 8) - 1;
+
+            if( ip >= in_end )
+                return 0;
+
+            if( len == 7 )
+            {
+                len += *ip++;
+                if( ip >= in_end )
+                    return 0;
+            }
+
+            ref -= *ip++;
+
+            if( op + len + 2 > out_end || ref < (unsigned char *)out_data )
+                return 0;
+
+            *op++ = *ref++;
+            *op++ = *ref++;
+
+            do
+                *op++ = *ref++;
+            while( --len );
+        }
+    }
+    while( ip < in_end );
+
+    return op - (unsigned char *)out_data;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char *corpus_alloc( corpus_t *c, const char *name )
+{
+    c->name = name;
+    c->size = CORPUS_ITEM_SIZE;
+    c->data = malloc( c->size );
+
+    return c->data;
+}
+
+// serialized objects, the most common payload we cache
+static void corpus_json( corpus_t *c )
+{
+    unsigned char *p = corpus_alloc( c, "json" ), *end = p + c->size;
+    unsigned int i = 0;
+    char rec[0xFF];
+
+    while( p < end )
+    {
+        int n = snprintf( rec, sizeof(rec),
+                          "{\"id\":%u,\"user\":\"user_%u\",\"email\":\"user_%u@example.com\",\"score\":%u.%02u,\"active\":%s},",
+                          i, i * 7 % 1000, i * 7 % 1000, i * 31 % 10000, i % 100, i % 3 ? "true" : "false" );
+
+        n = n > end - p ? end - p : n;
+        memcpy( p, rec, n );
+        p += n;
+        ++i;
+    }
+}
+
+// rendered page fragments
+static void corpus_html( corpus_t *c )
+{
+    static const char *tags[] = { "<div class=\"row\">", "<span class=\"label\">", "<a href=\"/item/", "</span>", "</div>\n", "<li>", "</li>" };
+    unsigned char *p = corpus_alloc( c, "html" ), *end = p + c->size;
+    unsigned int i = 0;
+    char rec[0xFF];
+
+    while( p < end )
+    {
+        int n = snprintf( rec, sizeof(rec), "%s%s%u\">Item %u</a>%s", tags[i % 7], tags[(i / 7) % 7], i, i * 13, tags[(i + 3) % 7] );
+
+        n = n > end - p ? end - p : n;
+        memcpy( p, rec, n );
+        p += n;
+        ++i;
+    }
+}
+
+// short repeating patterns, stress the overlapping back references
+static void corpus_runs( corpus_t *c )
+{
+    unsigned char *p = corpus_alloc( c, "runs" ), *end = p + c->size;
+    unsigned int seed = 1;
+
+    while( p < end )
+    {
+        unsigned int period = 1 + ( seed % 7 ), len = 16 + ( seed % 200 ), i;
+
+        for( i = 0; i < len && p < end; ++i, ++p )
+            *p = 'a' + ( i % period ) + ( seed & 3 );
+
+        seed = seed * 1103515245 + 12345;
+    }
+}
+
+// mostly incompressible data with sparse repetitions
+static void corpus_binary( corpus_t *c )
+{
+    unsigned char *p = corpus_alloc( c, "binary" ), *start = p, *end = p + c->size;
+    unsigned int seed = 42;
+
+    while( p < end )
+    {
+        seed = seed * 1103515245 + 12345;
+
+        if( ( seed >> 16 ) % 4 == 0 && p - start > 512 )
+        {
+            unsigned int len = 8 + ( seed % 64 ), off = 1 + ( seed >> 8 ) % 512;
+
+            while( len-- && p < end )
+            {
+                *p = *( p - off );
+                ++p;
+            }
+        }
+        else
+            *p++ = seed >> 24;
+    }
+}
+
+static int corpus_file( corpus_t *c, const char *filename )
+{
+    FILE *fp = fopen( filename, "rb" );
+    long size;
+
+    if( fp == NULL )
+    {
+        perror( filename );
+        return 0;
+    }
+
+    fseek( fp, 0, SEEK_END );
+    size = ftell( fp );
+    fseek( fp, 0, SEEK_SET );
+
+    c->name = filename;
+    c->size = size;
+    c->data = malloc( size > 0 ? size : 1 );
+
+    if( size <= 0 || fread( c->data, 1, size, fp ) != (size_t)size )
+    {
+        fprintf( stderr, "%s: empty or unreadable\n", filename );
+        fclose( fp );
+        free( c->data );
+        return 0;
+    }
+
+    fclose( fp );
+
+    return 1;
+}
+
+static double bench_decoder( unsigned int (*decoder)(const void *const, unsigned int, void *, unsigned int),
+                             unsigned char *compr, unsigned int comprlen, unsigned char *out, unsigned int size, long iterations )
+{
+    double start = now_seconds();
+    long i;
+
+    for( i = 0; i < iterations; ++i )
+    {
+        if( decoder( compr, comprlen, out, size ) != size )
+        {
+            fprintf( stderr, "decoder failed\n" );
+            exit( 1 );
+        }
+    }
+
+    return ( (double)size * iterations ) / ( now_seconds() - start ) / ( 1024.0 * 1024.0 );
+}
+
+int main( int argc, char **argv )
+{
+    corpus_t corpus[64];
+    size_t ncorpus = 0, i;
+    long iterations = 2000;
+    int c, failed = 0;
+
+    while( ( c = getopt( argc, argv, "n:h" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'n': iterations = atol( optarg ); break;
+            default :
+                printf( "Usage: %s [-n iterations] [file ...]\n", argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    corpus_json( &corpus[ncorpus++] );
+    corpus_html( &corpus[ncorpus++] );
+    corpus_runs( &corpus[ncorpus++] );
+    corpus_binary( &corpus[ncorpus++] );
+
+    for( ; optind < argc && ncorpus < 64; ++optind )
+    {
+        if( corpus_file( &corpus[ncorpus], argv[optind] ) )
+            ++ncorpus;
+    }
+
+    printf( "%-16s %10s %10s %12s %12s %8s\n", "corpus", "size", "compr", "ref MB/s", "lzf MB/s", "speedup" );
+
+    for( i = 0; i < ncorpus; ++i )
+    {
+        corpus_t *cp = &corpus[i];
+        unsigned char *compr = malloc( cp->size + cp->size / 16 + 64 ),
+                      *out_ref = malloc( cp->size ),
+                      *out_lzf = malloc( cp->size );
+        unsigned int comprlen = lzf_compress( cp->data, cp->size, compr, cp->size + cp->size / 16 + 64 );
+        long n = iterations * CORPUS_ITEM_SIZE / cp->size;
+        double ref, lzf;
+
+        n = n > 0 ? n : 1;
+
+        if( comprlen == 0 )
+        {
+            printf( "%-16s %10u %10s\n", cp->name, cp->size, "-" );
+            continue;
+        }
+
+        ref = bench_decoder( ref_decompress, compr, comprlen, out_ref, cp->size, n );
+        lzf = bench_decoder( lzf_decompress, compr, comprlen, out_lzf, cp->size, n );
+
+        if( memcmp( out_ref, cp->data, cp->size ) != 0 || memcmp( out_lzf, cp->data, cp->size ) != 0 )
+        {
+            printf( "%-16s output mismatch!\n", cp->name );
+            failed = 1;
+        }
+        else
+            printf( "%-16s %10u %10u %12.1f %12.1f %7.2fx\n", cp->name, cp->size, comprlen, ref, lzf, lzf / ref );
+
+        free( compr );
+        free( out_ref );
+        free( out_lzf );
+        free( cp->data );
+    }
+
+    return failed;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Request parsing microbenchmark, protocol v1 against protocol v2.
+ *
+ * For every workload a batch of SET payloads ( ttl, key and value ) is
+ * encoded with both framings and parsed over and over with the same
+ * gbParseTtlKeyValue the server uses, the parsed arguments of the two
+ * framings are compared and the throughput of each one is printed.
+ *
+ * Usage: proto-benchmark [-n iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "proto.h"
+
+#define BATCH_SIZE 1024
+
+typedef struct
+{
+    const char *name;
+    size_t      keysize;
+    size_t      valuesize;
+}
+workload_t;
+
+typedef struct
+{
+    byte_t *data;
+    size_t  size;
+}
+payload_t;
+
+static workload_t workloads[] =
+{
+    { "tiny",    8,    16 },
+    { "small",   24,   128 },
+    { "medium",  48,   1024 },
+    { "large",   96,   16384 },
+    { "huge",    200,  262144 }
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill( byte_t *p, size_t size, unsigned int seed )
+{
+    size_t i;
+
+    // printable, never a space so v1 can carry it
+    for( i = 0; i < size; ++i )
+    {
+        seed = seed * 1103515245 + 12345;
+        p[i] = '!' + ( seed >> 16 ) % 90;
+    }
+}
+
+static void encode( payload_t *v1, payload_t *v2, workload_t *w, unsigned int seed )
+{
+    char ttl[16];
+    size_t ttllen = snprintf( ttl, sizeof(ttl), "%u", seed % 3600 );
+    byte_t *key = malloc( w->keysize ), *value = malloc( w->valuesize ), *p;
+
+    fill( key, w->keysize, seed );
+    fill( value, w->valuesize, ~seed );
+
+    // v1 : "ttl key value"
+    v1->size = ttllen + 1 + w->keysize + 1 + w->valuesize;
+    v1->data = p = malloc( v1->size );
+
+    memcpy( p, ttl, ttllen );         p += ttllen;    *p++ = ' ';
+    memcpy( p, key, w->keysize );     p += w->keysize; *p++ = ' ';
+    memcpy( p, value, w->valuesize );
+
+    // v2 : varint sizes in front of every argument
+    v2->data = p = malloc( v1->size + 3 * GB_PROTO_VARINT_MAX );
+
+    p += gbProtoWriteVarint( p, ttllen );       memcpy( p, ttl, ttllen );         p += ttllen;
+    p += gbProtoWriteVarint( p, w->keysize );   memcpy( p, key, w->keysize );     p += w->keysize;
+    p += gbProtoWriteVarint( p, w->valuesize ); memcpy( p, value, w->valuesize ); p += w->valuesize;
+
+    v2->size = p - v2->data;
+
+    free( key );
+    free( value );
+}
+
+static double bench_parser( gbClient *client, payload_t *batch, long iterations, size_t *checksum )
+{
+    double start = now_seconds();
+    byte_t *t, *k, *v;
+    size_t ttllen, klen, vlen, sum = 0;
+    long i, j;
+
+    for( i = 0; i < iterations; ++i )
+    {
+        for( j = 0; j < BATCH_SIZE; ++j )
+        {
+            if( gbParseTtlKeyValue( client, batch[j].data, batch[j].size, &t, &k, &v, &ttllen, &klen, &vlen ) == 0 )
+            {
+                fprintf( stderr, "v%d parser failed\n", client->proto );
+                exit( 1 );
+            }
+
+            sum += ttllen + klen + vlen + ( t[0] ^ k[klen - 1] ^ v[vlen - 1] );
+        }
+    }
+
+    *checksum = sum;
+
+    return ( (double)BATCH_SIZE * iterations ) / ( now_seconds() - start );
+}
+
+int main( int argc, char **argv )
+{
+    static gbServer server;
+    gbClient client;
+    payload_t v1[BATCH_SIZE], v2[BATCH_SIZE];
+    long iterations = 2000;
+    size_t i, j, sum1, sum2;
+    int c, failed = 0;
+
+    while( ( c = getopt( argc, argv, "n:h" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'n': iterations = atol( optarg ); break;
+            default :
+                printf( "Usage: %s [-n iterations]\n", argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    memset( &client, 0, sizeof(client) );
+
+    // values of the bigger workloads are above the default limit
+    server.engine.limits.maxkeysize   = GB_DEFAULT_MAX_QUERY_KEY_SIZE;
+    server.engine.limits.maxvaluesize = GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE;
+    client.server = &server;
+
+    printf( "%-10s %8s %8s %14s %14s %8s\n", "workload", "key", "value", "v1 req/s", "v2 req/s", "speedup" );
+
+    for( i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i )
+    {
+        workload_t *w = &workloads[i];
+        // keep the amount of parsed bytes roughly constant among workloads
+        long n = iterations * 64 / ( w->keysize + 64 );
+        double r1, r2;
+
+        n = n > 0 ? n : 1;
+
+        for( j = 0; j < BATCH_SIZE; ++j )
+            encode( &v1[j], &v2[j], w, j + 1 );
+
+        client.proto = GB_PROTO_V1;
+        r1 = bench_parser( &client, v1, n, &sum1 );
+
+        client.proto = GB_PROTO_V2;
+        r2 = bench_parser( &client, v2, n, &sum2 );
+
+        if( sum1 != sum2 )
+        {
+            printf( "%-10s parsed arguments mismatch!\n", w->name );
+            failed = 1;
+        }
+        else
+            printf( "%-10s %8zu %8zu %14.0f %14.0f %7.2fx\n", w->name, w->keysize, w->valuesize, r1, r2, r2 / r1 );
+
+        for( j = 0; j < BATCH_SIZE; ++j )
+        {
+            free( v1[j].data );
+            free( v2[j].data );
+        }
+    }
+
+    return failed;
+}
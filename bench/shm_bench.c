@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory transport benchmark.
+ *
+ * Connects to the unix socket of a running server, stores a set of keys and
+ * then reads them back with GET requests, first over the socket and then
+ * over the shared memory rings obtained with OP_SHM, printing the throughput
+ * and the average round trip of each transport.
+ *
+ * Usage: shm-benchmark [-s socket] [-n requests] [-d depth] [-k keys] [-v value size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "query.h"
+#include "shm.h"
+
+#define REPLY_HEADER_SIZE ( sizeof(short) + 1 + sizeof(uint32_t) )
+
+typedef struct transport
+{
+    const char *name;
+    int fd;
+    // shared memory, NULL when using the socket
+    gbShmHeader *shm;
+    int server_efd;
+    int client_efd;
+}
+transport_t;
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die( const char *what )
+{
+    perror( what );
+    exit( 1 );
+}
+
+static void efd_signal( int fd )
+{
+    uint64_t one = 1;
+
+    if( write( fd, &one, sizeof(one) ) != sizeof(one) )
+        die( "eventfd write" );
+}
+
+static void efd_wait( int fd )
+{
+    uint64_t value;
+
+    if( read( fd, &value, sizeof(value) ) != sizeof(value) )
+        die( "eventfd read" );
+}
+
+static void transport_write( transport_t *t, const uint8_t *buf, size_t len )
+{
+    if( t->shm == NULL )
+    {
+        while( len > 0 )
+        {
+            ssize_t n = write( t->fd, buf, len );
+            if( n <= 0 )
+                die( "write" );
+            buf += n;
+            len -= n;
+        }
+        return;
+    }
+
+    while( len > 0 )
+    {
+        size_t n = gbShmRingWrite( &t->shm->requests, gbShmRequestsData(t->shm), t->shm->ring_size, buf, len );
+
+        buf += n;
+        len -= n;
+
+        if( len > 0 )
+        {
+            // ring full, let the server drain it and wait for some room
+            efd_signal( t->server_efd );
+            gbShmSetWaiting( &t->shm->requests.producer_waiting, 1 );
+            if( t->shm->requests.head - __atomic_load_n( &t->shm->requests.tail, __ATOMIC_ACQUIRE ) == t->shm->ring_size )
+                efd_wait( t->client_efd );
+            gbShmSetWaiting( &t->shm->requests.producer_waiting, 0 );
+        }
+    }
+
+    efd_signal( t->server_efd );
+}
+
+static void transport_read( transport_t *t, uint8_t *buf, size_t len )
+{
+    int spins = 0;
+
+    if( t->shm == NULL )
+    {
+        while( len > 0 )
+        {
+            ssize_t n = read( t->fd, buf, len );
+            if( n <= 0 )
+                die( "read" );
+            buf += n;
+            len -= n;
+        }
+        return;
+    }
+
+    while( len > 0 )
+    {
+        size_t n = gbShmRingRead( &t->shm->replies, gbShmRepliesData( t->shm, t->shm->ring_size ), t->shm->ring_size, buf, len );
+
+        buf += n;
+        len -= n;
+
+        // the server could be waiting for room to write the rest
+        if( n > 0 && gbShmIsWaiting( &t->shm->replies.producer_waiting ) )
+        {
+            t->shm->replies.producer_waiting = 0;
+            efd_signal( t->server_efd );
+        }
+
+        if( len > 0 && n == 0 && ++spins > 1000 )
+        {
+            // nothing for a while, go to sleep
+            gbShmSetWaiting( &t->shm->replies.consumer_waiting, 1 );
+            if( t->shm->replies.head == __atomic_load_n( &t->shm->replies.tail, __ATOMIC_ACQUIRE ) )
+                efd_wait( t->client_efd );
+            gbShmSetWaiting( &t->shm->replies.consumer_waiting, 0 );
+            spins = 0;
+        }
+    }
+}
+
+// read a reply and return its code, data is discarded
+static short read_reply( transport_t *t, uint8_t *data, size_t size )
+{
+    uint8_t header[REPLY_HEADER_SIZE];
+    uint32_t len;
+    short code;
+
+    transport_read( t, header, sizeof(header) );
+
+    memcpy( &code, header, sizeof(short) );
+    memcpy( &len, header + sizeof(short) + 1, sizeof(uint32_t) );
+
+    if( len > size )
+    {
+        fprintf( stderr, "reply of %u bytes too big\n", len );
+        exit( 1 );
+    }
+
+    transport_read( t, data, len );
+
+    return code;
+}
+
+static size_t encode_request( uint8_t *p, short op, const char *payload, size_t len )
+{
+    uint32_t size = sizeof(short) + len;
+
+    memcpy( p, &size, sizeof(uint32_t) );
+    memcpy( p + sizeof(uint32_t), &op, sizeof(short) );
+    memcpy( p + sizeof(uint32_t) + sizeof(short), payload, len );
+
+    return sizeof(uint32_t) + size;
+}
+
+static int connect_unix( const char *path )
+{
+    struct sockaddr_un sa;
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+    if( fd == -1 )
+        die( "socket" );
+
+    memset( &sa, 0, sizeof(sa) );
+    sa.sun_family = AF_UNIX;
+    strncpy( sa.sun_path, path, sizeof(sa.sun_path) - 1 );
+
+    if( connect( fd, (struct sockaddr *)&sa, sizeof(sa) ) == -1 )
+        die( path );
+
+    return fd;
+}
+
+// ask the server to switch this connection to shared memory
+static void switch_to_shm( transport_t *t )
+{
+    uint8_t request[16], reply[64];
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int fds[3];
+    short code;
+
+    transport_write( t, request, encode_request( request, OP_SHM, "", 0 ) );
+
+    memset( &msg, 0, sizeof(msg) );
+    iov.iov_base       = reply;
+    iov.iov_len        = REPLY_HEADER_SIZE + 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    if( recvmsg( t->fd, &msg, MSG_WAITALL ) != REPLY_HEADER_SIZE + 1 )
+        die( "recvmsg" );
+
+    memcpy( &code, reply, sizeof(short) );
+    cmsg = CMSG_FIRSTHDR( &msg );
+
+    if( code != REPL_OK || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3) )
+    {
+        fprintf( stderr, "server refused the shared memory transport\n" );
+        exit( 1 );
+    }
+
+    memcpy( fds, CMSG_DATA(cmsg), sizeof(fds) );
+
+    if( fstat( fds[0], &st ) == -1 )
+        die( "fstat" );
+
+    t->shm = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0 );
+    if( t->shm == MAP_FAILED )
+        die( "mmap" );
+
+    close( fds[0] );
+
+    if( t->shm->magic != GB_SHM_MAGIC || t->shm->version != GB_SHM_VERSION )
+    {
+        fprintf( stderr, "unknown shared memory layout\n" );
+        exit( 1 );
+    }
+
+    t->name       = "shm";
+    t->server_efd = fds[1];
+    t->client_efd = fds[2];
+}
+
+static void bench( transport_t *t, long requests, int depth, int keys, size_t valuesize )
+{
+    size_t maxreq = 64 + valuesize, len;
+    uint8_t *batch = malloc( maxreq * depth ), *data = malloc( valuesize + 64 ), *p;
+    char *value = malloc( valuesize + 1 ), payload[0xFF];
+    double start, elapsed;
+    long i, done;
+    int j, n;
+
+    memset( value, 'x', valuesize );
+    value[valuesize] = 0x00;
+
+    // store every key first
+    for( i = 0; i < keys; ++i )
+    {
+        char *set = malloc( valuesize + 64 );
+
+        n = sprintf( set, "0 key:%ld %s", i, value );
+        p = batch;
+        len = encode_request( p, OP_SET, set, n );
+
+        transport_write( t, batch, len );
+        if( read_reply( t, data, valuesize + 64 ) != REPL_VAL )
+        {
+            fprintf( stderr, "SET failed\n" );
+            exit( 1 );
+        }
+
+        free( set );
+    }
+
+    start = now_seconds();
+
+    for( done = 0; done < requests; done += depth )
+    {
+        for( j = 0, p = batch; j < depth; ++j )
+        {
+            n = sprintf( payload, "key:%ld", ( done + j ) % keys );
+            p += encode_request( p, OP_GET, payload, n );
+        }
+
+        transport_write( t, batch, p - batch );
+
+        for( j = 0; j < depth; ++j )
+        {
+            if( read_reply( t, data, valuesize + 64 ) != REPL_VAL )
+            {
+                fprintf( stderr, "GET failed\n" );
+                exit( 1 );
+            }
+        }
+    }
+
+    elapsed = now_seconds() - start;
+
+    printf( "%-8s %12.0f %12.2f\n", t->name, done / elapsed, elapsed * 1e6 / ( done / depth ) );
+
+    free( batch );
+    free( data );
+    free( value );
+}
+
+int main( int argc, char **argv )
+{
+    const char *path = GB_DEFAULT_UNIX_SOCKET;
+    long requests = 200000;
+    int depth = 1, keys = 1000, c;
+    size_t valuesize = 32;
+    transport_t t;
+
+    while( ( c = getopt( argc, argv, "s:n:d:k:v:h" ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 's': path = optarg; break;
+            case 'n': requests = atol( optarg ); break;
+            case 'd': depth = atoi( optarg ); break;
+            case 'k': keys = atoi( optarg ); break;
+            case 'v': valuesize = atol( optarg ); break;
+            default :
+                printf( "Usage: %s [-s socket] [-n requests] [-d depth] [-k keys] [-v value size]\n", argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    depth = depth > 0 ? depth : 1;
+    keys  = keys > 0 ? keys : 1;
+
+    printf( "%-8s %12s %12s\n", "", "req/s", "usec/batch" );
+
+    memset( &t, 0, sizeof(t) );
+    t.name = "unix";
+    t.fd   = connect_unix( path );
+
+    bench( &t, requests, depth, keys, valuesize );
+
+    switch_to_shm( &t );
+
+    bench( &t, requests, depth, keys, valuesize );
+
+    close( t.fd );
+
+    return 0;
+}
@@ -31,6 +31,22 @@
 #include <time.h>
 #include "config.h"
 
+// directives that can be repeated, their values are joined with a comma
+static const char *gbConfigMultiKeys[] = { "listen", NULL };
+
+static int gbConfigIsMulti( const char *key )
+{
+    const char **k;
+
+    for( k = gbConfigMultiKeys; *k; ++k )
+    {
+        if( strcmp( *k, key ) == 0 )
+            return 1;
+    }
+
+    return 0;
+}
+
 void gbConfigLoad( trie_t *config, char *filename )
 {
     assert( config != NULL );
@@ -89,7 +105,19 @@ void gbConfigLoad( trie_t *config, char *filename )
                 pd = &value[0];
                 while( !isspace( *p ) && *p ) *pd++ = *p++;
 
-                tr_insert( config, (unsigned char *)key, strlen(key), zstrdup( value ) );
+                char *old = tr_find( config, (unsigned char *)key, strlen(key) );
+
+                if( old && gbConfigIsMulti( key ) )
+                {
+                    char *joined = zmalloc( strlen(old) + strlen(value) + 2 );
+
+                    sprintf( joined, "%s,%s", old, value );
+
+                    tr_insert( config, (unsigned char *)key, strlen(key), joined );
+                    zfree( old );
+                }
+                else
+                    tr_insert( config, (unsigned char *)key, strlen(key), zstrdup( value ) );
             }
         }
 
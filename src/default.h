@@ -43,7 +43,12 @@
 
 #define GBNET_DEFAULT_MAX_CLIENTS			  1024
 #define GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE 4096 * 1024
+#define GBNET_DEFAULT_INPUT_BUFFER_SIZE		  ( 16 * 1024 )
 #define GBNET_DEFAULT_MAX_IDLE_TIME			  1
+// the kernel rounds it up to the next power of two, giving 512 entries
+#define GBNET_DEFAULT_LISTEN_BACKLOG		  511
+#define GBNET_MAX_ACCEPTS_PER_CALL			  1000
+#define GBNET_DEFAULT_SHM_RING_SIZE			  ( 1024 * 1024 )
 
 #define GB_DEFAULT_MAX_ITEM_TTL 			  2592000
 
@@ -54,13 +59,20 @@
 
 #define GB_DEFAULT_GC_RATIO                   900
 #define GB_DEFAULT_COMPRESSION				  40960
+#define GB_DEFAULT_COMPRESSION_LEVEL		  "fast"
+#define GB_DEFAULT_COMPRESSION_LARGE		  0
 
 #define GB_DEFAULT_CRON_PERIOD 				  100
 
 #define GB_DEFAULT_MAX_MEM_CRON               15
 #define GB_DEFAULT_EXPIRED_CRON               5
 
+#define GB_DEFAULT_SLOWLOG_THRESHOLD          10000
+#define GB_DEFAULT_SLOWLOG_SIZE               128
+#define GB_DEFAULT_LOOP_LAG_THRESHOLD         100
+
 #define GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY  512
 #define GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE    ( 1024 * 128 )
+#define GB_DEFAULT_CLIENT_POOL_INITIAL_CAPACITY 64
 
 #endif
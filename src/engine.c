@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "engine.h"
+#include "zmem.h"
+#include <assert.h>
+
+#define min(a,b) ( a < b ? a : b )
+
+void gbEngineInit( gbEngine *engine )
+{
+    assert( engine != NULL );
+
+    memset( engine, 0x00, sizeof(gbEngine) );
+
+    engine->time                    = time(NULL);
+    engine->compression             = GB_DEFAULT_COMPRESSION;
+    engine->compression_level       = lzf_level_parse( GB_DEFAULT_COMPRESSION_LEVEL );
+    engine->compression_large       = GB_DEFAULT_COMPRESSION_LARGE;
+    engine->compression_level_large = engine->compression_level;
+    engine->m_keys                  = ll_prealloc( 255 );
+    engine->m_values                = ll_prealloc( 255 );
+
+    engine->limits.maxitemttl   = GB_DEFAULT_MAX_ITEM_TTL;
+    engine->limits.maxkeysize   = GB_DEFAULT_MAX_QUERY_KEY_SIZE;
+    engine->limits.maxvaluesize = GB_DEFAULT_MAX_QUERY_VALUE_SIZE;
+    engine->limits.maxmem       = GB_DEFAULT_MAX_MEMORY;
+
+    engine->stats.mempeak =
+    engine->stats.memused = zmem_used();
+
+    opool_create( &engine->item_pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+
+    tr_init_tree( engine->tree );
+}
+
+static void gbEngineDestroyHandler( tnode_t *node, size_t level, void *data )
+{
+    assert( node != NULL );
+
+    gbItem *item = node->data;
+    if( item )
+        gbDestroyItem( data, item );
+}
+
+void gbEngineDestroy( gbEngine *engine )
+{
+    assert( engine != NULL );
+    assert( engine->m_keys != NULL );
+    assert( engine->m_values != NULL );
+
+    tr_recurse( &engine->tree, gbEngineDestroyHandler, engine, 0 );
+
+    ll_destroy( engine->m_keys );
+    ll_destroy( engine->m_values );
+
+    while( engine->m_blocks )
+    {
+        gbKeyBlock *next = engine->m_blocks->next;
+
+        zfree( engine->m_blocks );
+        engine->m_blocks = next;
+    }
+
+    if( engine->lzf_buffer )
+        zfree( engine->lzf_buffer );
+
+    opool_destroy( &engine->item_pool );
+
+    tr_free( &engine->tree );
+}
+
+gbItem *gbCreateItem( gbEngine *engine, void *data, size_t size, gbItemEncoding encoding, int ttl )
+{
+    assert( engine != NULL );
+    assert( size == 0 || data != NULL );
+
+    gbItem *item = ( gbItem * )opool_alloc_object( &engine->item_pool );
+
+    assert( item != NULL );
+
+    item->data 	           = data;
+    item->size 	           = size;
+    item->encoding         = encoding;
+    item->time             =
+    item->last_access_time = engine->time;
+    item->ttl	           = ttl;
+    item->lock	           = 0;
+
+    if( encoding == GB_ENC_LZF )
+    {
+        ++engine->stats.ncompressed;
+    }
+
+    if( engine->stats.firstin == 0 )
+        engine->stats.firstin = engine->time;
+
+    engine->stats.lastin  = engine->time;
+    engine->stats.memused = zmem_used();
+    engine->stats.sizeavg = engine->stats.memused / ++engine->stats.nitems;
+
+    if( engine->stats.memused > engine->stats.mempeak )
+        engine->stats.mempeak = engine->stats.memused;
+
+    return item;
+}
+
+void gbDestroyItem( gbEngine *engine, gbItem *item )
+{
+    assert( engine != NULL );
+    assert( item != NULL );
+
+    if( item->encoding == GB_ENC_LZF )
+    {
+        --engine->stats.ncompressed;
+    }
+
+    if( item->encoding != GB_ENC_NUMBER && item->data != NULL )
+    {
+        zfree( item->data );
+        item->data = NULL;
+    }
+
+    opool_free_object( &engine->item_pool, item );
+
+    engine->stats.memused = zmem_used();
+    engine->stats.nitems -= 1;
+    engine->stats.sizeavg = engine->stats.nitems == 0 ? 0 : engine->stats.memused / engine->stats.nitems;
+}
+
+// create the item for a value, compressing it if needed
+static gbItem *gbEncodeItem( byte_t *v, size_t vlen, gbEngine *engine )
+{
+    assert( v != NULL );
+    assert( vlen > 0 );
+    assert( engine != NULL );
+
+    gbItemEncoding encoding = GB_ENC_PLAIN;
+    void *data = v;
+    size_t comprlen = vlen, needcompr = 0;
+    gbCompressionStats *cstats;
+    int level;
+
+    // should we compress ? the value must be big enough to save 4 bytes besides the lzf header
+    if( vlen > engine->compression && vlen > 4 + GB_LZF_HEADER_SIZE )
+    {
+        needcompr = vlen - 4 - GB_LZF_HEADER_SIZE;
+        level  = ( engine->compression_large && vlen > engine->compression_large ) ? engine->compression_level_large : engine->compression_level;
+        cstats = &engine->stats.compression[level];
+
+        // header and compressed stream are always smaller than the plain value
+        assert( GB_LZF_HEADER_SIZE + needcompr < vlen );
+
+        if( engine->lzf_buffer_size < vlen )
+        {
+            engine->lzf_buffer_size = vlen;
+            engine->lzf_buffer      = zrealloc( engine->lzf_buffer, engine->lzf_buffer_size );
+        }
+
+        comprlen = lzf_compress_level( level, v, vlen, engine->lzf_buffer + GB_LZF_HEADER_SIZE, needcompr );
+
+        ++cstats->calls;
+        cstats->bytes_in += vlen;
+
+        // not enough compression
+        if( comprlen == 0 )
+        {
+            ++cstats->failed;
+
+            encoding = GB_ENC_PLAIN;
+            data	 = zmemdup( v, vlen );
+        }
+        // succesfully compressed
+        else {
+            double rate = 100.0 - ( ( comprlen * 100.0 ) / vlen );
+
+            cstats->bytes_out += comprlen;
+
+            if( engine->stats.compravg == 0 )
+                engine->stats.compravg = rate;
+            else
+                engine->stats.compravg = ( engine->stats.compravg + rate ) / 2.0;
+
+            // store the uncompressed size so readers can decompress straight
+            // into their final buffer
+            *(uint32_t *)engine->lzf_buffer = vlen;
+
+            encoding = GB_ENC_LZF;
+            vlen 	 = GB_LZF_HEADER_SIZE + comprlen;
+            data 	 = zmemdup( engine->lzf_buffer, vlen );
+        }
+    }
+    else {
+        encoding = GB_ENC_PLAIN;
+        data = zmemdup( v, vlen );
+    }
+
+    return gbCreateItem( engine, data, vlen, encoding, -1 );
+}
+
+gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbEngine *engine )
+{
+    assert( k != NULL );
+    assert( klen > 0 );
+
+    gbItem *item = gbEncodeItem( v, vlen, engine ),
+           *old  = tr_insert( &engine->tree, k, klen, item );
+
+    if( old )
+    {
+        gbDestroyItem( engine, old );
+    }
+
+    return item;
+}
+
+gbItem *gbNodeSet( byte_t *v, size_t vlen, tnode_t *node, gbEngine *engine )
+{
+    assert( node != NULL );
+
+    gbItem *item = gbEncodeItem( v, vlen, engine ),
+           *old  = node->data;
+
+    node->data = item;
+    if( old )
+    {
+        gbDestroyItem( engine, old );
+    }
+
+    return item;
+}
+
+size_t gbItemCopyValue( gbItem *item, byte_t *buffer )
+{
+    assert( item != NULL );
+    assert( buffer != NULL );
+
+    if( item->encoding == GB_ENC_LZF )
+    {
+        size_t declen = lzf_decompress( gbItemLzfStream(item), gbItemLzfStreamSize(item), buffer, gbItemLzfPlainSize(item) );
+
+        // corrupted stream
+        if( declen != gbItemLzfPlainSize(item) )
+            return 0;
+
+        return declen;
+    }
+    else if( item->encoding == GB_ENC_NUMBER )
+    {
+        long num = (long)item->data;
+
+        memcpy( buffer, &num, sizeof(long) );
+
+        return sizeof(long);
+    }
+
+    memcpy( buffer, item->data, item->size );
+
+    return item->size;
+}
+
+int gbEngineSet( gbEngine *engine, byte_t *key, size_t klen, byte_t *value, size_t vlen, long ttl, gbItem **item )
+{
+    assert( engine != NULL );
+    assert( item != NULL );
+
+    gbItem *old = NULL;
+
+    if( engine->stats.memused > engine->limits.maxmem )
+        return GB_ENGINE_ERR_MEM;
+
+    old = tr_find( &engine->tree, key, klen );
+    if( old && gbItemIsLocked( old, engine, 0 ) )
+        return GB_ENGINE_ERR_LOCKED;
+
+    *item = gbSingleSet( value, vlen, key, klen, engine );
+    if( ttl > 0 )
+    {
+        (*item)->time = engine->time;
+        (*item)->ttl  = min( engine->limits.maxitemttl, ttl );
+    }
+
+    return GB_ENGINE_OK;
+}
+
+int gbEngineGet( gbEngine *engine, byte_t *key, size_t klen, gbItem **item )
+{
+    assert( engine != NULL );
+    assert( item != NULL );
+
+    tnode_t *node = tr_find_node( &engine->tree, key, klen );
+
+    if( node &&                                             // key exists
+        node->data &&                                       // value exists
+        gbIsNodeStillValid( node, node->data, engine, 1 ) ) // item is not expired
+    {
+        *item = node->data;
+        (*item)->last_access_time = engine->time;
+
+        return GB_ENGINE_OK;
+    }
+
+    return GB_ENGINE_ERR_NOT_FOUND;
+}
+
+int gbEngineTtl( gbEngine *engine, byte_t *key, size_t klen, long ttl )
+{
+    assert( engine != NULL );
+
+    tnode_t *node = tr_find_node( &engine->tree, key, klen );
+    gbItem *item = node ? node->data : NULL;
+
+    if( item && gbIsNodeStillValid( node, item, engine, 1 ) )
+    {
+        item->last_access_time =
+        item->time = engine->time;
+        item->ttl  = min( engine->limits.maxitemttl, ttl );
+
+        return GB_ENGINE_OK;
+    }
+
+    return GB_ENGINE_ERR_NOT_FOUND;
+}
+
+int gbEngineDel( gbEngine *engine, byte_t *key, size_t klen )
+{
+    assert( engine != NULL );
+
+    tnode_t *node = tr_find_node( &engine->tree, key, klen );
+    gbItem *item = NULL;
+
+    if( node && node->data )
+    {
+        item = node->data;
+
+        if( gbItemIsLocked( item, engine, 0 ) )
+            return GB_ENGINE_ERR_LOCKED;
+
+        else if( gbIsNodeStillValid( node, item, engine, 1 ) )
+        {
+            gbDestroyItem( engine, item );
+
+            // Remove item from tree
+            node->data = NULL;
+
+            return GB_ENGINE_OK;
+        }
+    }
+
+    return GB_ENGINE_ERR_NOT_FOUND;
+}
+
+size_t gbEngineBGet( gbEngine *engine, byte_t **keys, size_t *klens, size_t nkeys )
+{
+    assert( engine != NULL );
+    assert( keys != NULL );
+    assert( klens != NULL );
+
+    tnode_t *nodes[GB_ENGINE_BATCH_SIZE], *node = NULL;
+    gbItem *item = NULL;
+    size_t i, j, n, found = 0;
+
+    // the trie walks of a chunk of keys are interleaved, see tr_find_nodes
+    for( i = 0; i < nkeys; i += n )
+    {
+        n = min( nkeys - i, GB_ENGINE_BATCH_SIZE );
+
+        tr_find_nodes( &engine->tree, keys + i, klens + i, n, nodes );
+
+        for( j = 0; j < n; ++j )
+        {
+            node = nodes[j];
+            if( node == NULL || node->data == NULL || gbIsNodeStillValid( node, node->data, engine, 1 ) == 0 )
+                continue;
+
+            item = node->data;
+            item->last_access_time = engine->time;
+
+            ll_append( engine->m_keys, gbEngineResultKey( engine, keys[i + j], klens[i + j] ) );
+            ll_append( engine->m_values, item );
+
+            ++found;
+        }
+    }
+
+    return found;
+}
+
+char *gbEngineResultKey( gbEngine *engine, byte_t *key, size_t klen )
+{
+    assert( engine != NULL );
+    assert( key != NULL );
+
+    gbKeyBlock *block = engine->m_blocks;
+    size_t need = sizeof(uint32_t) + klen + 1;
+    uint32_t size32 = klen;
+    char *copy = NULL;
+
+    if( block == NULL || block->size - block->used < need )
+    {
+        size_t size = need > GB_KEY_BLOCK_SIZE ? need : GB_KEY_BLOCK_SIZE;
+
+        block = zmalloc( sizeof(gbKeyBlock) + size );
+        block->next = engine->m_blocks;
+        block->size = size;
+        block->used = 0;
+
+        engine->m_blocks = block;
+    }
+
+    // keys may contain any byte, the size goes right before them
+    copy = block->data + block->used;
+    memcpy( copy, &size32, sizeof(uint32_t) );
+    copy += sizeof(uint32_t);
+    memcpy( copy, key, klen );
+    copy[klen] = 0x00;
+
+    block->used += need;
+
+    return copy;
+}
+
+static int gbMultiGetCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
+    assert( ctx != NULL );
+    assert( node != NULL );
+    assert( key != NULL );
+
+    gbEngine *engine = (gbEngine *)ctx;
+    gbItem *item = (gbItem *)node->data;
+
+    if( gbIsNodeStillValid( node, item, engine, 1 ) == 0 ){
+        return 0;
+    }
+
+    item->last_access_time = engine->time;
+
+    ll_append( engine->m_keys, gbEngineResultKey( engine, key, keylen ) );
+    ll_append( engine->m_values, item );
+
+    return 1;
+}
+
+size_t gbEngineMGet( gbEngine *engine, byte_t *prefix, size_t plen, long limit )
+{
+    assert( engine != NULL );
+
+    return tr_search_callback( &engine->tree, prefix, plen, limit, engine->limits.maxkeysize, gbMultiGetCallback, engine );
+}
+
+void gbEngineReleaseResults( gbEngine *engine )
+{
+    assert( engine != NULL );
+
+    gbKeyBlock *block = engine->m_blocks, *next = NULL;
+
+    // keep the most recent block around for the next results
+    if( block )
+    {
+        for( next = block->next; next; next = block->next )
+        {
+            block->next = next->next;
+            zfree( next );
+        }
+
+        block->used = 0;
+    }
+
+    ll_reset( engine->m_keys );
+    ll_reset( engine->m_values );
+}
+
+static int gbMultiDelCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
+    assert( ctx != NULL );
+    assert( node != NULL );
+    assert( key != NULL );
+
+    gbEngine *engine = (gbEngine *)ctx;
+    gbItem *item = (gbItem *)node->data;
+
+    // locked item
+    if( !item || gbItemIsLocked( item, engine, 0 ) ){
+        return 0;
+    }
+    else if( gbIsNodeStillValid( node, item, engine, 1 ) ){
+        node->data = NULL;
+        gbDestroyItem( engine, item );
+
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t gbEngineMDel( gbEngine *engine, byte_t *prefix, size_t plen )
+{
+    assert( engine != NULL );
+
+    return tr_search_callback( &engine->tree, prefix, plen, -1, engine->limits.maxkeysize, gbMultiDelCallback, engine );
+}
+
+static int gbCountCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
+    assert( ctx != NULL );
+    assert( node != NULL );
+
+    gbEngine *engine = (gbEngine *)ctx;
+    gbItem *item = (gbItem *)node->data;
+
+    if( !item || !gbIsNodeStillValid( node, item, engine, 1 ) ){
+        return 0;
+    }
+
+    item->last_access_time = engine->time;
+
+    return 1;
+}
+
+size_t gbEngineCount( gbEngine *engine, byte_t *prefix, size_t plen )
+{
+    assert( engine != NULL );
+
+    return tr_count( &engine->tree, prefix, plen, -1, engine->limits.maxkeysize, gbCountCallback, engine );
+}
+
+typedef struct {
+    gbEngine *engine;
+    time_t gc_ratio;
+    size_t freed;
+}
+sweep_ctx_t;
+
+static void gbExpireHandler( tnode_t *node, size_t level, void *data )
+{
+    assert( node != NULL );
+    assert( data != NULL );
+
+    sweep_ctx_t *ctx = data;
+    gbItem *item = node->data;
+
+    // item is older enough to be deleted
+    if( item && item->ttl > 0 && ctx->engine->time - item->time >= item->ttl )
+    {
+        node->data = NULL;
+        gbDestroyItem( ctx->engine, item );
+        ++ctx->freed;
+    }
+}
+
+size_t gbEngineExpire( gbEngine *engine )
+{
+    assert( engine != NULL );
+
+    sweep_ctx_t ctx = { engine, 0, 0 };
+
+    tr_recurse( &engine->tree, gbExpireHandler, &ctx, 0 );
+
+    return ctx.freed;
+}
+
+static void gbCollectHandler( tnode_t *node, size_t level, void *data )
+{
+    assert( node != NULL );
+    assert( data != NULL );
+
+    sweep_ctx_t *ctx = data;
+    gbItem *item = node->data;
+    time_t eta = item ? ( ctx->engine->time - item->last_access_time ) : 0;
+
+    // item is older enough to be deleted
+    if( eta && eta >= ctx->gc_ratio )
+    {
+        node->data = NULL;
+        gbDestroyItem( ctx->engine, item );
+        ++ctx->freed;
+    }
+}
+
+size_t gbEngineCollect( gbEngine *engine, time_t gc_ratio )
+{
+    assert( engine != NULL );
+
+    sweep_ctx_t ctx = { engine, gc_ratio, 0 };
+
+    tr_recurse( &engine->tree, gbCollectHandler, &ctx, 0 );
+
+    return ctx.freed;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "obpool.h"
+#include "trie.h"
+#include "llist.h"
+#include "lzf.h"
+#include "default.h"
+
+/*
+ * The gibson storage engine: the keyspace trie, its items, their ttl and
+ * locks, compression and memory accounting. It knows nothing about clients
+ * or sockets, so it can be linked as libgibson and used in process by any
+ * program, the server is just one of its users.
+ *
+ * An engine is single threaded, its clock is the 'time' field which the
+ * host has to keep updated ( the server does it once per cron loop ),
+ * ttls and locks are measured against it.
+ */
+
+typedef unsigned char byte_t;
+
+// results of the engine operations, errors have the same values of the REPL_ERR_* protocol codes
+#define GB_ENGINE_OK            0
+#define GB_ENGINE_ERR_NOT_FOUND 1
+#define GB_ENGINE_ERR_NAN       2
+#define GB_ENGINE_ERR_MEM       3
+#define GB_ENGINE_ERR_LOCKED    4
+
+// number of keys gbEngineBGet looks up in a single tr_find_nodes call
+#define GB_ENGINE_BATCH_SIZE 64
+
+typedef unsigned char gbItemEncoding;
+
+// the item is in plain encoding and data points to its buffer
+#define	GB_ENC_PLAIN  0x00
+// PLAIN but compressed data with lzf
+#define GB_ENC_LZF    0x01
+// the item contains a number and data pointer is actually that number
+#define GB_ENC_NUMBER 0x02
+
+// GB_ENC_LZF items buffer starts with the uncompressed data size, followed by the lzf stream
+#define GB_LZF_HEADER_SIZE sizeof(uint32_t)
+// uncompressed size of a GB_ENC_LZF item
+#define gbItemLzfPlainSize(item)  (*(uint32_t *)(item)->data)
+// lzf stream of a GB_ENC_LZF item and its size
+#define gbItemLzfStream(item)     ((byte_t *)(item)->data + GB_LZF_HEADER_SIZE)
+#define gbItemLzfStreamSize(item) ((item)->size - GB_LZF_HEADER_SIZE)
+// size of the item value once decompressed
+#define gbItemPlainSize(item)     ( (item)->encoding == GB_ENC_LZF ? gbItemLzfPlainSize(item) : (item)->size )
+
+typedef struct
+{
+	// the item buffer
+	void  		  *data;
+	// the item buffer size
+	uint32_t 	   size;
+	// the item encoding
+	gbItemEncoding encoding;
+	// time the item was last accessed
+	time_t	       last_access_time;
+	// time the item was created
+	time_t		   time;
+	// TTL of this item
+	short		   ttl;
+	// flag to lock the item
+	time_t		   lock;
+}
+__attribute__((packed)) gbItem;
+
+typedef struct
+{
+	// maximum number of seconds of an item TTL
+	size_t   maxitemttl;
+	// maximum size of an item key
+	unsigned long maxkeysize;
+	// maximum size of an item value
+	unsigned long maxvaluesize;
+	// maximum size of used memory
+	unsigned long maxmem;
+}
+gbEngineLimits;
+
+typedef struct
+{
+	// number of values compressed with this level
+	unsigned long calls;
+	// number of values that did not compress enough and were stored plain
+	unsigned long failed;
+	// total uncompressed bytes given to the compressor
+	unsigned long long bytes_in;
+	// total compressed bytes produced
+	unsigned long long bytes_out;
+}
+gbCompressionStats;
+
+typedef struct
+{
+	// time of the first created object
+	time_t   firstin;
+	// time of the last created object
+	time_t	 lastin;
+	// number total of items stored in the container
+	unsigned int nitems;
+	// number of compressed items
+	unsigned int ncompressed;
+	// currently used memory
+	unsigned long memused;
+	// maximum memory peak
+	unsigned long mempeak;
+	// average object size
+	double sizeavg;
+    // average compression rate
+    double compravg;
+    // compression statistics for each lzf level
+    gbCompressionStats compression[LZF_LEVELS];
+}
+gbEngineStats;
+
+// size of the blocks the keys of multi key results are copied to
+#define GB_KEY_BLOCK_SIZE 65536
+
+typedef struct gbKeyBlock
+{
+	// previously filled block
+	struct gbKeyBlock *next;
+	// bytes available and in use in data
+	size_t size;
+	size_t used;
+	char   data[];
+}
+gbKeyBlock;
+
+typedef struct gbEngine
+{
+	// the main object container
+	trie_t   tree;
+    // gbItem object pool allocator
+    opool_t  item_pool;
+	// engine clock, updated by the host
+	time_t   time;
+	// data bigger then this is going to be compressed
+	unsigned long compression;
+	// lzf level used to compress data
+	int      compression_level;
+	// data bigger then this is going to be compressed with compression_level_large ( 0 to disable )
+	unsigned long compression_large;
+	// lzf level used to compress data bigger than compression_large
+	int      compression_level_large;
+	// buffer used for lzf compression, grown to the biggest compressed value
+	byte_t  *lzf_buffer;
+	size_t   lzf_buffer_size;
+	// static lists used for multi-* operands
+	llist_t *m_keys;
+	llist_t *m_values;
+	// blocks holding the keys of m_keys, see gbEngineResultKey
+	gbKeyBlock *m_blocks;
+
+	gbEngineLimits limits;
+	gbEngineStats  stats;
+}
+gbEngine;
+
+// initialize the engine with default limits and compression settings, which may be changed before the first item is stored
+void    gbEngineInit( gbEngine *engine );
+// free every item and the engine buffers
+void    gbEngineDestroy( gbEngine *engine );
+
+gbItem *gbCreateItem( gbEngine *engine, void *data, size_t size, gbItemEncoding encoding, int ttl );
+void    gbDestroyItem( gbEngine *engine, gbItem *item );
+// store a copy of the value, compressed if big enough, and return the new item
+gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbEngine *engine );
+// same as gbSingleSet for a node that is already known
+gbItem *gbNodeSet( byte_t *v, size_t vlen, tnode_t *node, gbEngine *engine );
+// copy the value of the item into 'buffer', which must hold gbItemPlainSize(item) bytes, and return its size or 0 if it could not be decompressed
+size_t  gbItemCopyValue( gbItem *item, byte_t *buffer );
+
+static __inline__ int gbItemIsLocked( gbItem *item, gbEngine *engine, time_t eta )
+{
+    eta = eta == 0 ? engine->time - item->time : eta;
+    return ( item->lock == -1 || eta < item->lock );
+}
+
+// return 0 and destroy the item if its ttl expired, if 'remove' is set the node is emptied as well
+static __inline__ int gbIsNodeStillValid( tnode_t *node, gbItem *item, gbEngine *engine, int remove )
+{
+    if( item->ttl > 0 && engine->time - item->time >= item->ttl )
+    {
+        if( remove )
+            node->data = NULL;
+
+        gbDestroyItem( engine, item );
+
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * In process API, every function returns GB_ENGINE_OK or one of the
+ * GB_ENGINE_ERR_* codes, or the number of items involved for the ones
+ * working on a key prefix. Returned items belong to the engine and are
+ * valid until the next call which stores or deletes something.
+ */
+int     gbEngineSet( gbEngine *engine, byte_t *key, size_t klen, byte_t *value, size_t vlen, long ttl, gbItem **item );
+int     gbEngineGet( gbEngine *engine, byte_t *key, size_t klen, gbItem **item );
+int     gbEngineTtl( gbEngine *engine, byte_t *key, size_t klen, long ttl );
+int     gbEngineDel( gbEngine *engine, byte_t *key, size_t klen );
+// copy a key of the results to the engine key blocks, valid until gbEngineReleaseResults.
+// Every key in engine->m_keys must come from here so its size can be read back.
+char   *gbEngineResultKey( gbEngine *engine, byte_t *key, size_t klen );
+// size of a key returned by gbEngineResultKey
+static __inline__ uint32_t gbEngineResultKeySize( const char *key )
+{
+    uint32_t size;
+
+    memcpy( &size, key - sizeof(uint32_t), sizeof(uint32_t) );
+
+    return size;
+}
+// items of the given keys are appended to engine->m_keys and engine->m_values, missing keys are skipped,
+// keys are copied with gbEngineResultKey so they may contain any byte
+size_t  gbEngineBGet( gbEngine *engine, byte_t **keys, size_t *klens, size_t nkeys );
+// matching keys and live items are appended to engine->m_keys and engine->m_values
+size_t  gbEngineMGet( gbEngine *engine, byte_t *prefix, size_t plen, long limit );
+// release the keys of the last results and empty the lists
+void    gbEngineReleaseResults( gbEngine *engine );
+size_t  gbEngineMDel( gbEngine *engine, byte_t *prefix, size_t plen );
+size_t  gbEngineCount( gbEngine *engine, byte_t *prefix, size_t plen );
+
+// delete expired items and return how many
+size_t  gbEngineExpire( gbEngine *engine );
+// delete items not accessed in the last 'gc_ratio' seconds and return how many
+size_t  gbEngineCollect( gbEngine *engine, time_t gc_ratio );
+
+#endif
@@ -37,9 +37,13 @@ static struct option long_options[] =
     { "logfile", required_argument, 0, 0x00 },
     { "loglevel", required_argument, 0, 0x00 },
     { "logflushrate", required_argument, 0, 0x00 },
+    { "listen", required_argument, 0, 0x00 },
     { "unix_socket", required_argument, 0, 0x00 },
     { "address", required_argument, 0, 0x00 },
     { "port", required_argument, 0, 0x00 },
+    { "listen_backlog", required_argument, 0, 0x00 },
+    { "tcp_defer_accept", required_argument, 0, 0x00 },
+    { "shm_ring_size", required_argument, 0, 0x00 },
     { "max_idletime", required_argument, 0, 0x00 },
     { "max_clients", required_argument, 0, 0x00 },
     { "max_request_size", required_argument, 0, 0x00 },
@@ -49,12 +53,18 @@ static struct option long_options[] =
     { "max_value_size", required_argument, 0, 0x00 },
     { "max_response_size", required_argument, 0, 0x00 },
     { "compression", required_argument, 0, 0x00 },
+    { "compression_level", required_argument, 0, 0x00 },
+    { "compression_large", required_argument, 0, 0x00 },
+    { "compression_level_large", required_argument, 0, 0x00 },
     { "daemonize", required_argument, 0, 0x00 },
     { "cron_period", required_argument, 0, 0x00 },
     { "pidfile", required_argument, 0, 0x00 },
     { "gc_ratio", required_argument, 0, 0x00 },
     { "max_mem_cron", required_argument, 0, 0x00 },
     { "expired_cron", required_argument, 0, 0x00 },
+    { "slowlog_threshold", required_argument, 0, 0x00 },
+    { "slowlog_size", required_argument, 0, 0x00 },
+    { "loop_lag_threshold", required_argument, 0, 0x00 },
 
     {0, 0, 0, 0}
 };
@@ -65,10 +75,14 @@ static char *descriptions[] = {
     "The log file path, or /dev/stdout to log on the terminal output.",
     "Integer number representing the verbosity of the log manager.",
     "How often to flush logfile, where 1 stands for 'flush the log file every new line'.",
+    "Comma separated endpoints to listen on, 'address:port' for TCP or 'unix:path' for UNIX sockets, the directive can be repeated in the configuration file and overrides unix_socket, address and port.",
     "The UNIX socket path to use if Gibson will run in a local environment, use the directives address and port to create a TCP server instead.",
     "Address to bind the TCP server to.",
     "TCP port to use for server listening.",
-    "Maximum time in seconds a client can be idle ( without read or write operations ), after this period the client connection will be closed.",
+    "Size of the queue of pending connections of the server socket ( capped by the system somaxconn ).",
+    "If greater than 0, wake up the server for a new TCP connection only once the client sent its first request or after this many seconds.",
+    "Size of the requests and replies rings of unix socket clients switching to the shared memory transport, rounded up to a power of two.",
+    "Maximum time in seconds a client can be idle ( without read or write operations ), after this period the client connection will be closed ( 0 to disable ).",
     "Maximum number of clients Gibson can hadle concurrently.",
     "Maximum size of a client request.",
     "Maximum time-to-live an object can have.",
@@ -77,17 +91,106 @@ static char *descriptions[] = {
     "Maximum size of the value for a Gibson object.",
     "Maximum Gibson response size, used to limit I/O when a M* operator is used.",
     "Objects above this size will be compressed in memory.",
+    "LZF compression level: ultra ( fastest ), fast or best ( highest ratio, several times slower ).",
+    "Objects above this size will be compressed with compression_level_large instead, 0 to disable.",
+    "LZF compression level to use for objects above compression_large.",
     "If 1 the process server will be daemonized ( put on background ), otherwise will run synchronously with the caller process.",
     "Number of milliseconds between each cron schedule, do not put a value higher than 1000.",
     "File to be used to save the current Gibson process id.",
     "If max_memory is reached, data that is not being accessed in this amount of time ( i.e. gc_ratio 1h = data that is not being accessed in the last hour ) get deleted to release memory for the server.",
     "Check if max memory usage is reached every 'max_mem_cron' seconds.",
-    "Check for expired items every 'expired_cron' seconds."
+    "Check for expired items every 'expired_cron' seconds.",
+    "Requests taking at least this many microseconds to be processed are recorded in the slow operations log.",
+    "Number of entries of the slow operations log, the oldest ones are overwritten, 0 to disable it.",
+    "Event loop iterations and cron phases taking longer than this many milliseconds are logged, 0 to disable."
 };
 
 // the global server instance
 gbServer server;
 
+static gbListener *gbServerNewListener( gbServerType type, const char *address, int port ){
+	gbListener *listener = NULL;
+
+	if( server.nlisteners >= GB_MAX_LISTENERS ){
+		gbLog( ERROR, "Too many listen directives, at most %d are allowed.", GB_MAX_LISTENERS );
+		exit(1);
+	}
+
+	listener = &server.listeners[ server.nlisteners++ ];
+
+	listener->type   = type;
+	listener->port   = port;
+	listener->server = &server;
+
+	strncpy( listener->address, address, 0xFE );
+
+	return listener;
+}
+
+static void gbServerListenUnix( const char *path, int backlog ){
+	gbListener *listener = gbServerNewListener( UNIX, path, 0 );
+
+	gbLog( INFO, "Creating unix server socket on %s ...", path );
+
+	unlink( listener->address );
+
+	listener->fd = gbNetUnixServer( server.error, listener->address, 0777, backlog );
+	if( listener->fd == GBNET_ERR ){
+		gbLog( ERROR, "Error creating server : %s", server.error );
+		exit(1);
+	}
+
+	// new connections are accepted in batches until the backlog is empty
+	gbNetNonBlock( NULL, listener->fd );
+}
+
+static void gbServerListenTcp( const char *address, int port, int backlog, int defer ){
+	gbListener *listener = gbServerNewListener( TCP, address, port );
+
+	gbLog( INFO, "Creating tcp server socket on %s:%d ...", address, port );
+
+	listener->fd = gbNetTcpServer( server.error, port, listener->address, backlog );
+	if( listener->fd == GBNET_ERR ){
+		gbLog( ERROR, "Error creating server : %s", server.error );
+		exit(1);
+	}
+
+	gbNetNonBlock( NULL, listener->fd );
+
+	// on Linux accepted sockets inherit these from the server one
+	gbNetEnableTcpNoDelay( NULL, listener->fd );
+	gbNetKeepAlive( NULL, listener->fd, server.limits.maxidletime );
+
+	if( defer > 0 && gbNetDeferAccept( server.error, listener->fd, defer ) == GBNET_ERR )
+		gbLog( WARNING, "Could not enable deferred accept: %s", server.error );
+}
+
+// endpoints are 'unix:path', an absolute unix socket path, 'address:port' or just a tcp port
+static void gbServerListen( char *endpoint, int backlog, int defer ){
+	char *colon = strrchr( endpoint, ':' ), *p = NULL;
+	long port = 0;
+
+	if( strncmp( endpoint, "unix:", 5 ) == 0 ){
+		gbServerListenUnix( endpoint + 5, backlog );
+		return;
+	}
+	else if( *endpoint == '/' ){
+		gbServerListenUnix( endpoint, backlog );
+		return;
+	}
+
+	port = strtol( colon ? colon + 1 : endpoint, &p, 10 );
+	if( *p != 0x00 || port <= 0 || port > 65535 ){
+		gbLog( ERROR, "Invalid listen endpoint '%s'.", endpoint );
+		exit(1);
+	}
+
+	if( colon )
+		*colon = 0x00;
+
+	gbServerListenTcp( colon ? endpoint : GB_DEFAULT_ADDRESS, port, backlog, defer );
+}
+
 void gbHelpMenu( char **argv, int exitcode ){
     size_t i = 0;
     struct option *popt = &long_options[0];
@@ -167,89 +270,98 @@ int main( int argc, char **argv)
 	  gbConfigReadInt( &server.config, "logflushrate", GB_DEFAULT_LOG_FLUSH_LEVEL )
 	);
 
-	const char *sock = gbConfigReadString( &server.config, "unix_socket", NULL );
-	if( sock != NULL ){
-		gbLog( INFO, "Creating unix server socket on %s ...", sock );
+	gbEngineInit( &server.engine );
 
-		strncpy( server.address, sock, 0xFE );
-		unlink( server.address );
+	// read server limit values from config
+	server.limits.maxidletime     = gbConfigReadInt( &server.config, "max_idletime",       GBNET_DEFAULT_MAX_IDLE_TIME );
+	server.limits.maxclients      = gbConfigReadInt( &server.config, "max_clients",        GBNET_DEFAULT_MAX_CLIENTS );
+	server.limits.maxrequestsize  = gbConfigReadSize( &server.config, "max_request_size",  GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE );
+	server.limits.maxresponsesize = gbConfigReadSize( &server.config, "max_response_size", GB_DEFAULT_MAX_RESPONSE_SIZE );
 
-		server.type	= UNIX;
-		server.fd   = gbNetUnixServer( server.error, server.address, 0777 );
-	}
-	else {
-		const char *address = gbConfigReadString( &server.config, "address", GB_DEFAULT_ADDRESS );
-		int port = gbConfigReadInt( &server.config, "port", GB_DEFAULT_PORT );
+	server.engine.limits.maxitemttl	  = gbConfigReadInt( &server.config, "max_item_ttl",       GB_DEFAULT_MAX_ITEM_TTL );
+	server.engine.limits.maxmem		  = gbConfigReadSize( &server.config, "max_memory",        GB_DEFAULT_MAX_MEMORY );
+	server.engine.limits.maxkeysize	  = gbConfigReadSize( &server.config, "max_key_size",      GB_DEFAULT_MAX_QUERY_KEY_SIZE );
+	server.engine.limits.maxvaluesize = gbConfigReadSize( &server.config, "max_value_size",    GB_DEFAULT_MAX_QUERY_VALUE_SIZE );
 
-		gbLog( INFO, "Creating tcp server socket on %s:%d ...", address, port );
+	const char *endpoints = gbConfigReadString( &server.config, "listen", NULL ),
+			   *sock = gbConfigReadString( &server.config, "unix_socket", NULL );
+	int backlog = gbConfigReadInt( &server.config, "listen_backlog", GBNET_DEFAULT_LISTEN_BACKLOG ),
+		defer   = gbConfigReadInt( &server.config, "tcp_defer_accept", 0 );
 
-		strncpy( server.address, address, 0xFE );
+	if( endpoints != NULL ){
+		char *list = zstrdup( endpoints ), *endpoint = NULL, *save = NULL;
 
-		server.type	= TCP;
-		server.port	= port;
-		server.fd   = gbNetTcpServer( server.error, server.port, server.address );
-	}
+		for( endpoint = strtok_r( list, ",", &save ); endpoint; endpoint = strtok_r( NULL, ",", &save ) ){
+			gbServerListen( endpoint, backlog, defer );
+		}
 
-	if( server.fd == GBNET_ERR ){
-		gbLog( ERROR, "Error creating server : %s", server.error );
-		exit(1);
+		zfree( list );
+	}
+	else if( sock != NULL ){
+		gbServerListenUnix( sock, backlog );
+	}
+	else {
+		gbServerListenTcp
+		(
+		  gbConfigReadString( &server.config, "address", GB_DEFAULT_ADDRESS ),
+		  gbConfigReadInt( &server.config, "port", GB_DEFAULT_PORT ),
+		  backlog,
+		  defer
+		);
 	}
-
-	// read server limit values from config
-	server.limits.maxidletime     = gbConfigReadInt( &server.config, "max_idletime",       GBNET_DEFAULT_MAX_IDLE_TIME );
-	server.limits.maxclients      = gbConfigReadInt( &server.config, "max_clients",        GBNET_DEFAULT_MAX_CLIENTS );
-	server.limits.maxrequestsize  = gbConfigReadSize( &server.config, "max_request_size",  GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE );
-	server.limits.maxitemttl	  = gbConfigReadInt( &server.config, "max_item_ttl",       GB_DEFAULT_MAX_ITEM_TTL );
-	server.limits.maxmem		  = gbConfigReadSize( &server.config, "max_memory",        GB_DEFAULT_MAX_MEMORY );
-	server.limits.maxkeysize	  = gbConfigReadSize( &server.config, "max_key_size",      GB_DEFAULT_MAX_QUERY_KEY_SIZE );
-	server.limits.maxvaluesize	  = gbConfigReadSize( &server.config, "max_value_size",    GB_DEFAULT_MAX_QUERY_VALUE_SIZE );
-	server.limits.maxresponsesize = gbConfigReadSize( &server.config, "max_response_size", GB_DEFAULT_MAX_RESPONSE_SIZE );
 
 	// initialize server statistics
 	server.stats.started     =
-	server.stats.time	     = time(NULL);
-	server.stats.firstin     =
-	server.stats.lastin      =
+	server.stats.ops_since   =
+	server.stats.time	     = server.engine.time;
 	server.stats.crondone    =
 	server.stats.nclients    =
-	server.stats.nitems	     =
-	server.stats.ncompressed =
     server.stats.requests    =
-    server.stats.connections =
-	server.stats.sizeavg	 =
-    server.stats.compravg    = 0;
-    server.stats.mempeak     =
-    server.stats.memused     = zmem_used();
+    server.stats.connections = 0;
 	server.stats.memavail    = zmem_available();
 
-	if( server.limits.maxmem > server.stats.memavail ){
+	if( server.engine.limits.maxmem > server.stats.memavail ){
 		char drop[0xFF] = {0};
 
 		gbMemFormat( server.stats.memavail / 2, drop, 0xFF );
 
 		gbLog( WARNING, "max_memory setting is higher than total available memory, dropping to %s.", drop );
 
-		server.limits.maxmem = server.stats.memavail / 2;
+		server.engine.limits.maxmem = server.stats.memavail / 2;
 	}
 
-	server.compression = gbConfigReadSize( &server.config, "compression",	 GB_DEFAULT_COMPRESSION );
+	server.engine.compression = gbConfigReadSize( &server.config, "compression",	 GB_DEFAULT_COMPRESSION );
+	server.engine.compression_large = gbConfigReadSize( &server.config, "compression_large", GB_DEFAULT_COMPRESSION_LARGE );
+	server.engine.compression_level = lzf_level_parse( gbConfigReadString( &server.config, "compression_level", GB_DEFAULT_COMPRESSION_LEVEL ) );
+	server.engine.compression_level_large = lzf_level_parse( gbConfigReadString( &server.config, "compression_level_large", lzf_level_name( server.engine.compression_level ) ) );
+
+	if( server.engine.compression_level < 0 || server.engine.compression_level_large < 0 ){
+		gbLog( ERROR, "Invalid compression level, valid levels are 'ultra', 'fast' and 'best'." );
+		exit(1);
+	}
 	server.daemon	   = gbConfigReadInt( &server.config, "daemonize", 		 0 );
 	server.cronperiod  = gbConfigReadInt( &server.config, "cron_period", 	 GB_DEFAULT_CRON_PERIOD );
 	server.pidfile	   = gbConfigReadString( &server.config, "pidfile",      GB_DEFAULT_PID_FILE );
     server.gc_ratio    = gbConfigReadTime( &server.config, "gc_ratio",       GB_DEFAULT_GC_RATIO );
     server.max_mem_cron = gbConfigReadTime( &server.config, "max_mem_cron",  GB_DEFAULT_MAX_MEM_CRON ) * 1000;
     server.expired_cron = gbConfigReadTime( &server.config, "expired_cron",  GB_DEFAULT_EXPIRED_CRON ) * 1000;
-	server.clients 	   = ll_prealloc( server.limits.maxclients );
-	server.m_keys	   = ll_prealloc( 255 );
-	server.m_values	   = ll_prealloc( 255 );
-	server.idlecron	   = server.limits.maxidletime * 1000;
-	server.lzf_buffer  = zcalloc( server.limits.maxrequestsize );
-	server.m_buffer	   = zcalloc( server.limits.maxresponsesize );
+	server.clients 	   = NULL;
+	server.idle_slots  = server.limits.maxidletime > 0 ? server.limits.maxidletime + 1 : 0;
+	server.idle_slots  = server.idle_slots > GB_IDLE_WHEEL_MAX_SLOTS ? GB_IDLE_WHEEL_MAX_SLOTS : server.idle_slots;
+	server.idle_wheel  = server.idle_slots ? zcalloc( sizeof(gbClient *) * server.idle_slots ) : NULL;
+	server.idle_sweep  = server.stats.time;
+	server.shm_ring_size = 4096;
+
+	unsigned long ringsize = gbConfigReadSize( &server.config, "shm_ring_size", GBNET_DEFAULT_SHM_RING_SIZE );
+	while( server.shm_ring_size < ringsize && server.shm_ring_size < 0x40000000 )
+		server.shm_ring_size <<= 1;
 	server.shutdown	   = 0;
 
-    opool_create( &server.item_pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+	gbSlowLogInit( &server.slowlog,
+				   gbConfigReadInt( &server.config, "slowlog_size", GB_DEFAULT_SLOWLOG_SIZE ),
+				   (uint64_t)gbConfigReadInt( &server.config, "slowlog_threshold", GB_DEFAULT_SLOWLOG_THRESHOLD ) * 1000 );
 
-	tr_init_tree( server.tree );
+    opool_create( &server.client_pool, sizeof(gbClient), GB_DEFAULT_CLIENT_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
 
 	char reqsize[0xFF] = {0},
 		 maxmem[0xFF] = {0},
@@ -261,12 +373,12 @@ int main( int argc, char **argv)
          allocator[0xFF] = {0};
 
 	gbMemFormat( server.limits.maxrequestsize, reqsize, 0xFF );
-	gbMemFormat( server.limits.maxmem, maxmem, 0xFF );
+	gbMemFormat( server.engine.limits.maxmem, maxmem, 0xFF );
     gbMemFormat( server.stats.memavail, sysmem, 0xFF );
-	gbMemFormat( server.limits.maxkeysize, maxkey, 0xFF );
-	gbMemFormat( server.limits.maxvaluesize, maxvalue, 0xFF );
+	gbMemFormat( server.engine.limits.maxkeysize, maxkey, 0xFF );
+	gbMemFormat( server.engine.limits.maxvaluesize, maxvalue, 0xFF );
 	gbMemFormat( server.limits.maxresponsesize, maxrespsize, 0xFF );
-	gbMemFormat( server.compression, compr, 0xFF );
+	gbMemFormat( server.engine.compression, compr, 0xFF );
 
     zmem_allocator( allocator, 0xFF );
 
@@ -283,7 +395,11 @@ int main( int argc, char **argv)
 	gbLog( INFO, "Max key size     : %s", maxkey );
 	gbLog( INFO, "Max value size   : %s", maxvalue );
 	gbLog( INFO, "Max resp. size   : %s", maxrespsize );
-	gbLog( INFO, "Data LZF compr.  : %s", compr );
+	gbLog( INFO, "Data LZF compr.  : %s ( %s )", compr, lzf_level_name( server.engine.compression_level ) );
+	if( server.engine.compression_large ){
+		gbMemFormat( server.engine.compression_large, compr, 0xFF );
+		gbLog( INFO, "Data LZF large   : %s ( %s )", compr, lzf_level_name( server.engine.compression_level_large ) );
+	}
 	gbLog( INFO, "Cron period      : %dms", server.cronperiod );
 
 	gbProcessInit();
@@ -295,7 +411,14 @@ int main( int argc, char **argv)
 	server.events  = gbCreateEventLoop( server.limits.maxclients + 1024 );
 	server.cron_id = gbCreateTimeEvent( server.events, 1, gbServerCronHandler, &server, NULL );
 
-	gbCreateFileEvent( server.events, server.fd, GB_READABLE, gbAcceptHandler, &server );
+	int lag_threshold = gbConfigReadInt( &server.config, "loop_lag_threshold", GB_DEFAULT_LOOP_LAG_THRESHOLD );
+	server.events->lag_threshold = lag_threshold > 0 ? lag_threshold * 1000000ULL : 0;
+
+	for( option_index = 0; option_index < server.nlisteners; ++option_index ){
+		gbListener *listener = &server.listeners[option_index];
+
+		gbCreateFileEvent( server.events, listener->fd, GB_READABLE, gbAcceptHandler, listener );
+	}
 
 	gbEventLoopMain( server.events );
 	gbDeleteEventLoop( server.events );
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "hist.h"
+#include <assert.h>
+
+// upper bound of the values falling in the given bucket
+static uint64_t gbHistogramBucketValue( unsigned int i )
+{
+    unsigned int shift;
+
+    if( i < GB_HIST_SUB )
+        return i;
+
+    shift = i / GB_HIST_SUB - 1;
+
+    return ( ( (uint64_t)( GB_HIST_SUB + i % GB_HIST_SUB + 1 ) ) << shift ) - 1;
+}
+
+uint64_t gbHistogramPercentile( gbHistogram *hist, double p )
+{
+    assert( hist != NULL );
+    assert( p >= 0.0 && p <= 1.0 );
+
+    unsigned long rank = (unsigned long)( hist->count * p ), seen = 0;
+    unsigned int i;
+
+    if( hist->count == 0 )
+        return 0;
+
+    for( i = 0; i < GB_HIST_BUCKETS; ++i )
+    {
+        seen += hist->buckets[i];
+        if( seen > rank )
+            break;
+    }
+
+    // the bucket bound can't be worse than the real maximum
+    return i < GB_HIST_BUCKETS && gbHistogramBucketValue( i ) < hist->max ? gbHistogramBucketValue( i ) : hist->max;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram: values below GB_HIST_SUB nanoseconds have
+ * a bucket each, every following power of two is split in GB_HIST_SUB
+ * linear buckets, so the error on any percentile is below 1/GB_HIST_SUB.
+ * Values of GB_HIST_MAX_BITS bits and more all fall in the last bucket.
+ */
+#define GB_HIST_SUB_BITS 4
+#define GB_HIST_SUB      ( 1 << GB_HIST_SUB_BITS )
+#define GB_HIST_MAX_BITS 40
+#define GB_HIST_BUCKETS  ( ( GB_HIST_MAX_BITS - GB_HIST_SUB_BITS + 1 ) * GB_HIST_SUB )
+
+typedef struct
+{
+    // number of samples
+    unsigned long count;
+    // sum of all the samples, in nanoseconds
+    uint64_t      sum;
+    // highest sample, in nanoseconds
+    uint64_t      max;
+    unsigned long buckets[GB_HIST_BUCKETS];
+}
+gbHistogram;
+
+// monotonic clock in nanoseconds, used to time what goes in a histogram
+static __inline__ uint64_t gbHistogramClock()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __inline__ unsigned int gbHistogramIndex( uint64_t ns )
+{
+    unsigned int msb;
+
+    if( ns < GB_HIST_SUB )
+        return ns;
+
+    msb = 63 - __builtin_clzll( ns );
+    if( msb >= GB_HIST_MAX_BITS )
+        return GB_HIST_BUCKETS - 1;
+
+    return ( msb - GB_HIST_SUB_BITS + 1 ) * GB_HIST_SUB + ( ( ns >> ( msb - GB_HIST_SUB_BITS ) ) & ( GB_HIST_SUB - 1 ) );
+}
+
+static __inline__ void gbHistogramAdd( gbHistogram *hist, uint64_t ns )
+{
+    ++hist->count;
+    ++hist->buckets[ gbHistogramIndex( ns ) ];
+
+    hist->sum += ns;
+    if( ns > hist->max )
+        hist->max = ns;
+}
+
+static __inline__ void gbHistogramReset( gbHistogram *hist )
+{
+    memset( hist, 0x00, sizeof(gbHistogram) );
+}
+
+// value in nanoseconds below which the fraction 'p' of the samples falls, 0 if there are none
+uint64_t gbHistogramPercentile( gbHistogram *hist, double p );
+
+#endif
@@ -33,16 +33,203 @@
 #include <time.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Lines are formatted by the caller into a single producer, single consumer
+ * ring, a writer thread adds the timestamp, writes and flushes them so the
+ * event loop never blocks on the log file. When the ring is full new lines
+ * are dropped and counted, the writer reports how many were lost.
+ * The writer is started with the first line and stopped before any fork, so
+ * daemonizing doesn't leave the child process without it.
+ */
+#define GB_LOG_RING_SIZE 4096
+#define GB_LOG_LINE_SIZE 0xFF
+
+typedef struct
+{
+    time_t     time;
+    gbLogLevel level;
+    char       line[GB_LOG_LINE_SIZE];
+}
+gbLogRecord;
 
 static FILE 	  *__log_fp       = NULL;
 static gbLogLevel __log_level     = DEBUG;
 static int		  __log_flushrate = 1;
 static int		  __log_counter   = 0;
 
+static gbLogRecord     __log_ring[GB_LOG_RING_SIZE];
+// records ever pushed by gbLog and ever written by the writer
+static unsigned long   __log_head    = 0;
+static unsigned long   __log_tail    = 0;
+static unsigned long   __log_dropped = 0;
+// records written and flushed to the file by the writer
+static unsigned long   __log_flushed = 0;
+// the writer is sleeping and has to be signaled
+static int             __log_waiting = 0;
+static int             __log_running = 0;
+static int             __log_stop    = 0;
+static pthread_t       __log_thread;
+static pthread_mutex_t __log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  __log_cond = PTHREAD_COND_INITIALIZER;
+
+// only used by whoever writes the file, the writer or gbLog when it is not running
+static time_t __log_last_time = 0;
+static char   __log_timestamp[0xFF] = {0};
+// utc offset of the last timestamp, signal handlers can't call localtime
+static long   __log_gmtoff = 0;
+
+static const char *gbLogLevelName( gbLogLevel level )
+{
+    switch( level )
+    {
+        case DEBUG    : return "DBG";
+        case WARNING  : return "WAR";
+        case INFO     : return "INF";
+        case ERROR    : return "ERR";
+        case CRITICAL : return "CRT";
+    }
+
+    return "???";
+}
+
+static void gbLogWrite( gbLogRecord *record )
+{
+    struct tm timeinfo;
+
+    // localtime and strftime only once per second
+    if( record->time != __log_last_time )
+    {
+        localtime_r( &record->time, &timeinfo );
+        strftime( __log_timestamp, 0xFF, "%m/%d/%Y %X", &timeinfo );
+
+        __log_last_time = record->time;
+        __atomic_store_n( &__log_gmtoff, timeinfo.tm_gmtoff, __ATOMIC_RELAXED );
+    }
+
+    fprintf( __log_fp, "[%s] [%s] %s\n", __log_timestamp, gbLogLevelName(record->level), record->line );
+
+    if( ( ++__log_counter % __log_flushrate ) == 0 )
+        fflush(__log_fp);
+}
+
+// write every pending record, returns 1 if something was written
+static int gbLogDrain( unsigned long *reported )
+{
+    unsigned long head = __atomic_load_n( &__log_head, __ATOMIC_SEQ_CST ),
+                  tail = __log_tail,
+                  dropped = __atomic_load_n( &__log_dropped, __ATOMIC_RELAXED );
+    gbLogRecord record;
+
+    if( tail == head && dropped == *reported )
+        return 0;
+
+    for( ; tail != head; ++tail )
+    {
+        gbLogWrite( &__log_ring[ tail % GB_LOG_RING_SIZE ] );
+        // free the slot as soon as possible
+        __atomic_store_n( &__log_tail, tail + 1, __ATOMIC_RELEASE );
+    }
+
+    if( dropped != *reported )
+    {
+        record.time  = time(NULL);
+        record.level = WARNING;
+        snprintf( record.line, GB_LOG_LINE_SIZE, "Log ring full, %lu lines dropped.", dropped - *reported );
+
+        gbLogWrite( &record );
+
+        *reported = dropped;
+    }
+
+    fflush(__log_fp);
+
+    __atomic_store_n( &__log_flushed, tail, __ATOMIC_RELEASE );
+
+    return 1;
+}
+
+static void *gbLogWriter( void *arg )
+{
+    unsigned long reported = __atomic_load_n( &__log_dropped, __ATOMIC_RELAXED );
+    struct timespec deadline;
+
+    while( 1 )
+    {
+        if( gbLogDrain( &reported ) )
+            continue;
+
+        pthread_mutex_lock( &__log_lock );
+
+        if( __log_stop )
+        {
+            pthread_mutex_unlock( &__log_lock );
+            // gbLog is not called while stopping, nothing can be pushed after this
+            gbLogDrain( &reported );
+            break;
+        }
+
+        __atomic_store_n( &__log_waiting, 1, __ATOMIC_SEQ_CST );
+
+        // check again before sleeping, a record could have been pushed meanwhile
+        if( __atomic_load_n( &__log_head, __ATOMIC_SEQ_CST ) == __log_tail )
+        {
+            clock_gettime( CLOCK_REALTIME, &deadline );
+            deadline.tv_sec += 1;
+
+            pthread_cond_timedwait( &__log_cond, &__log_lock, &deadline );
+        }
+
+        __atomic_store_n( &__log_waiting, 0, __ATOMIC_SEQ_CST );
+
+        pthread_mutex_unlock( &__log_lock );
+    }
+
+    return NULL;
+}
+
+static void gbLogStart()
+{
+    __log_stop = 0;
+
+    if( pthread_create( &__log_thread, NULL, gbLogWriter, NULL ) == 0 )
+        __log_running = 1;
+}
+
+static void gbLogStop()
+{
+    unsigned long reported = __atomic_load_n( &__log_dropped, __ATOMIC_RELAXED );
+
+    if( __log_running == 0 )
+        return;
+
+    __log_running = 0;
+
+    // crashed inside the writer itself, write what's left from here
+    if( pthread_equal( pthread_self(), __log_thread ) )
+    {
+        gbLogDrain( &reported );
+        return;
+    }
+
+    pthread_mutex_lock( &__log_lock );
+    __log_stop = 1;
+    pthread_cond_signal( &__log_cond );
+    pthread_mutex_unlock( &__log_lock );
+
+    pthread_join( __log_thread, NULL );
+}
+
 void gbLogInit( const char *filename, gbLogLevel level, unsigned int flushrate ) 
 {
     assert( filename != NULL );
-    
+
+    struct tm timeinfo;
+    time_t now;
+
 	__log_fp = fopen( filename, "a+t" );
 	if( __log_fp == NULL ){
 		printf( "ERROR: Unable to open logfile %s!\n", filename );
@@ -51,48 +238,124 @@ void gbLogInit( const char *filename, gbLogLevel level, unsigned int flushrate )
 
 	__log_level = level;
 	__log_flushrate = flushrate;
-}
 
+	now = time(NULL);
+	localtime_r( &now, &timeinfo );
+	__log_gmtoff = timeinfo.tm_gmtoff;
+
+	// the writer thread would not survive the fork, it is restarted by the next line
+	pthread_atfork( gbLogStop, NULL, NULL );
+}
 
 void gbLog( gbLogLevel level, const char *format, ... )
 {
     assert( format != NULL );
     assert( __log_fp != NULL );
 
-	char 	buffer[0xFF] 	= {0},
-			timestamp[0xFF] = {0},
-		   *slevel = "???";
+    unsigned long head = __log_head;
+    gbLogRecord *record = NULL, sync;
 	va_list ap;
-	time_t 		rawtime  = 0;
-  	struct tm * timeinfo = NULL;
 
-	if( level >= __log_level )
+	if( level < __log_level )
+        return;
+
+    if( __log_running == 0 )
+        gbLogStart();
+
+    // no writer, write the line right away
+    if( __log_running == 0 )
+        record = &sync;
+
+    else if( head - __atomic_load_n( &__log_tail, __ATOMIC_ACQUIRE ) >= GB_LOG_RING_SIZE )
     {
-		va_start( ap, format );
-			vsnprintf( buffer, 0xFF, format, ap );
-		va_end(ap);
-
-		time( &rawtime );
-  		timeinfo = localtime( &rawtime );
-
-  		strftime( timestamp, 0xFF, "%m/%d/%Y %X", timeinfo );
-
-		switch( level )
-		{
-			case DEBUG    : slevel = "DBG"; break;
-			case WARNING  : slevel = "WAR"; break;
-			case INFO     : slevel = "INF"; break;
-			case ERROR    : slevel = "ERR"; break;
-			case CRITICAL : slevel = "CRT"; break;
-		}
+        __atomic_add_fetch( &__log_dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    else
+        record = &__log_ring[ head % GB_LOG_RING_SIZE ];
 
-		fprintf( __log_fp, "[%s] [%s] %s\n", timestamp, slevel, buffer );
+    va_start( ap, format );
+        vsnprintf( record->line, GB_LOG_LINE_SIZE, format, ap );
+    va_end(ap);
 
-		if( ( ++__log_counter % __log_flushrate ) == 0 )
-			fflush(__log_fp);
+    record->time  = time(NULL);
+    record->level = level;
+
+    if( record == &sync )
+    {
+        gbLogWrite( record );
+        return;
+    }
+
+    __atomic_store_n( &__log_head, head + 1, __ATOMIC_SEQ_CST );
+
+    // only wake the writer up if it is sleeping
+    if( __atomic_load_n( &__log_waiting, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &__log_lock );
+        pthread_cond_signal( &__log_cond );
+        pthread_mutex_unlock( &__log_lock );
     }
 }
 
+void gbLogSignal( gbLogLevel level, const char *format, ... )
+{
+    static int waited = 0;
+    char line[GB_LOG_LINE_SIZE],
+         timestamp[0xFF] = {0},
+         buffer[GB_LOG_LINE_SIZE + 0xFF];
+    struct timespec pause = { 0, 1000000 };
+    struct tm timeinfo;
+    time_t now;
+    va_list ap;
+    int i, size, saved_errno = errno;
+
+    if( level < __log_level || __log_fp == NULL )
+        return;
+
+    // give the writer up to a second to flush what was logged before the signal,
+    // unless the signal was raised by the writer itself
+    if( waited == 0 )
+    {
+        waited = 1;
+
+        if( __log_running && pthread_equal( pthread_self(), __log_thread ) == 0 )
+        {
+            for( i = 0; i < 1000; ++i )
+            {
+                if( __atomic_load_n( &__log_flushed, __ATOMIC_ACQUIRE ) == __atomic_load_n( &__log_head, __ATOMIC_SEQ_CST ) )
+                    break;
+
+                nanosleep( &pause, NULL );
+            }
+        }
+    }
+
+    va_start( ap, format );
+        vsnprintf( line, GB_LOG_LINE_SIZE, format, ap );
+    va_end(ap);
+
+    // gmtime_r doesn't take the timezone lock localtime_r needs
+    now = time(NULL) + __atomic_load_n( &__log_gmtoff, __ATOMIC_RELAXED );
+    gmtime_r( &now, &timeinfo );
+    strftime( timestamp, 0xFF, "%m/%d/%Y %X", &timeinfo );
+
+    size = snprintf( buffer, sizeof(buffer), "[%s] [%s] %s\n", timestamp, gbLogLevelName(level), line );
+    if( size > (int)sizeof(buffer) - 1 )
+        size = sizeof(buffer) - 1;
+
+    // no ring, no lock and no stdio buffer, straight to the file
+    if( size > 0 )
+        while( write( fileno(__log_fp), buffer, size ) < 0 && errno == EINTR );
+
+    errno = saved_errno;
+}
+
+unsigned long gbLogDropped()
+{
+    return __atomic_load_n( &__log_dropped, __ATOMIC_RELAXED );
+}
+
 void gbLogDumpBuffer( gbLogLevel level, unsigned char *buffer, unsigned int size )
 {
     assert( buffer != NULL );
@@ -126,6 +389,8 @@ void gbLogDumpBuffer( gbLogLevel level, unsigned char *buffer, unsigned int size
 
 void gbLogFinalize()
 {
+	gbLogStop();
+
 	if( __log_fp ){
 		fflush(__log_fp);
 		fclose(__log_fp);
@@ -41,6 +41,10 @@ gbLogLevel;
 
 void gbLogInit( const char *filename, gbLogLevel level, unsigned int flushrate );
 void gbLog( gbLogLevel level, const char *format, ... );
+// for signal handlers, bypasses the ring and the writer and writes the line to the log file with write(2)
+void gbLogSignal( gbLogLevel level, const char *format, ... );
+// number of lines dropped because the writer thread could not keep up
+unsigned long gbLogDropped();
 void gbLogDumpBuffer( gbLogLevel level, unsigned char *buffer, unsigned int size );
 void gbLogFinalize();
 
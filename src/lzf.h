@@ -77,6 +77,41 @@ unsigned int
 lzf_compress (const void *const in_data,  unsigned int in_len,
               void             *out_data, unsigned int out_len);
 
+/*
+ * Compression levels, each one is a separate specialization of the
+ * compressor with its own hash table size and match finder:
+ *
+ *   LZF_LEVEL_ULTRA : HLOG 14, ULTRA_FAST, fastest, lowest ratio.
+ *   LZF_LEVEL_FAST  : HLOG 16, VERY_FAST, the one lzf_compress uses.
+ *   LZF_LEVEL_BEST  : HLOG 15, hash chains, the longest of up to 16
+ *                     matches is used, best ratio and several times slower.
+ *
+ * Every level produces a stream lzf_decompress can handle.
+ */
+#define LZF_LEVEL_ULTRA 0
+#define LZF_LEVEL_FAST  1
+#define LZF_LEVEL_BEST  2
+#define LZF_LEVELS      3
+
+/*
+ * Same as lzf_compress, but using the compressor of the given level,
+ * unknown levels fall back to LZF_LEVEL_FAST.
+ */
+unsigned int
+lzf_compress_level (int level,
+                    const void *const in_data,  unsigned int in_len,
+                    void             *out_data, unsigned int out_len);
+
+/*
+ * Level name ( "ultra", "fast" or "best" ) and the level for a given
+ * name, or -1 if the name is unknown.
+ */
+const char *
+lzf_level_name (int level);
+
+int
+lzf_level_parse (const char *name);
+
 /*
  * Decompress data compressed with some version of the lzf_compress
  * function and stored at location in_data and length in_len. The result
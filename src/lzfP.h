@@ -44,6 +44,9 @@
 #endif
 
 /*
+ * NOTE: HLOG, VERY_FAST and ULTRA_FAST below are only the defaults, lzf_c.c
+ * redefines them to build one compressor per LZF_LEVEL_* ( see lzf.h ).
+ *
  * Size of hashtable is (1 << HLOG) * sizeof (char *)
  * decompression is independent of the hash table size
  * the difference between 15 and 14 is very small
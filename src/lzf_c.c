@@ -35,41 +35,8 @@
  */
 
 #include "lzfP.h"
-
-#define HSIZE (1 << (HLOG))
-
-/*
- * don't play with this unless you benchmark!
- * decompression is not dependent on the hash function
- * the hashing function might seem strange, just believe me
- * it works ;)
- */
-#ifndef FRST
-# define FRST(p) (((p[0]) << 8) | p[1])
-# define NEXT(v,p) (((v) << 8) | p[2])
-# if ULTRA_FAST
-#  define IDX(h) ((( h             >> (3*8 - HLOG)) - h  ) & (HSIZE - 1))
-# elif VERY_FAST
-#  define IDX(h) ((( h             >> (3*8 - HLOG)) - h*5) & (HSIZE - 1))
-# else
-#  define IDX(h) ((((h ^ (h << 5)) >> (3*8 - HLOG)) - h*5) & (HSIZE - 1))
-# endif
-#endif
-/*
- * IDX works because it is very similar to a multiplicative hash, e.g.
- * ((h * 57321 >> (3*8 - HLOG)) & (HSIZE - 1))
- * the latter is also quite fast on newer CPUs, and compresses similarly.
- *
- * the next one is also quite good, albeit slow ;)
- * (int)(cos(h & 0xffffff) * 1e6)
- */
-
-#if 0
-/* original lzv-like hash function, much worse and thus slower */
-# define FRST(p) (p[0] << 5) ^ p[1]
-# define NEXT(v,p) ((v) << 5) ^ p[2]
-# define IDX(h) ((h) & (HSIZE - 1))
-#endif
+#include "lzf.h"
+#include <string.h>
 
 #define        MAX_LIT        (1 <<  5)
 #define        MAX_OFF        (1 << 13)
@@ -86,210 +53,86 @@
 #define expect_false(expr) expect ((expr) != 0, 0)
 #define expect_true(expr)  expect ((expr) != 0, 1)
 
-/*
- * compressed format
- *
- * 000LLLLL <L+1>    ; literal
- * LLLooooo oooooooo ; backref L
- * 111ooooo LLLLLLLL oooooooo ; backref L+7
- *
- */
+#undef HLOG
+#undef VERY_FAST
+#undef ULTRA_FAST
+#undef CHAIN
+
+/* LZF_LEVEL_ULTRA: small hash table, fastest hashing, worst ratio */
+#define LZF_FN     lzf_compress_ultra
+#define HLOG       14
+#define VERY_FAST  0
+#define ULTRA_FAST 1
+#define CHAIN      0
+#include "lzf_c_template.h"
+#undef LZF_FN
+#undef HLOG
+#undef VERY_FAST
+#undef ULTRA_FAST
+#undef CHAIN
+
+/* LZF_LEVEL_FAST: the liblzf preferred mode, this is what lzf_compress uses */
+#define LZF_FN     lzf_compress_fast
+#define HLOG       16
+#define VERY_FAST  1
+#define ULTRA_FAST 0
+#define CHAIN      0
+#include "lzf_c_template.h"
+#undef LZF_FN
+#undef HLOG
+#undef VERY_FAST
+#undef ULTRA_FAST
+#undef CHAIN
+
+/* LZF_LEVEL_BEST: every position is chained, the longest of 16 candidates wins */
+#define LZF_FN     lzf_compress_best
+#define HLOG       15
+#define VERY_FAST  0
+#define ULTRA_FAST 0
+#define CHAIN      16
+#include "lzf_c_template.h"
+#undef LZF_FN
+#undef HLOG
+#undef VERY_FAST
+#undef ULTRA_FAST
+#undef CHAIN
+
+static const char *lzf_level_names[LZF_LEVELS] = { "ultra", "fast", "best" };
 
 unsigned int
 lzf_compress (const void *const in_data, unsigned int in_len,
-	      void *out_data, unsigned int out_len
-#if LZF_STATE_ARG
-              , LZF_STATE htab
-#endif
-              )
+	      void *out_data, unsigned int out_len)
 {
-#if !LZF_STATE_ARG
-  LZF_STATE htab;
-#endif
-  const u8 **hslot;
-  const u8 *ip = (const u8 *)in_data;
-        u8 *op = (u8 *)out_data;
-  const u8 *in_end  = ip + in_len;
-        u8 *out_end = op + out_len;
-  const u8 *ref;
-
-  /* off requires a type wide enough to hold a general pointer difference.
-   * ISO C doesn't have that (size_t might not be enough and ptrdiff_t only
-   * works for differences within a single object). We also assume that no
-   * no bit pattern traps. Since the only platform that is both non-POSIX
-   * and fails to support both assumptions is windows 64 bit, we make a
-   * special workaround for it.
-   */
-#if defined (WIN32) && defined (_M_X64)
-  unsigned _int64 off; /* workaround for missing POSIX compliance */
-#else
-  unsigned long off;
-#endif
-  unsigned int hval;
-  int lit;
-
-  if (!in_len || !out_len)
-    return 0;
-
-#if INIT_HTAB
-  memset (htab, 0, sizeof (htab));
-# if 0
-  for (hslot = htab; hslot < htab + HSIZE; hslot++)
-    *hslot++ = ip;
-# endif
-#endif
-
-  lit = 0; op++; /* start run */
+  return lzf_compress_fast (in_data, in_len, out_data, out_len);
+}
 
-  hval = FRST (ip);
-  while (ip < in_end - 2)
+unsigned int
+lzf_compress_level (int level,
+                    const void *const in_data, unsigned int in_len,
+                    void *out_data, unsigned int out_len)
+{
+  switch (level)
     {
-      hval = NEXT (hval, ip);
-      hslot = htab + IDX (hval);
-      ref = *hslot; *hslot = ip;
-
-      if (1
-#if INIT_HTAB
-          && ref < ip /* the next test will actually take care of this, but this is faster */
-#endif
-          && (off = ip - ref - 1) < MAX_OFF
-          && ip + 4 < in_end
-          && ref > (u8 *)in_data
-#if STRICT_ALIGN
-          && ref[0] == ip[0]
-          && ref[1] == ip[1]
-          && ref[2] == ip[2]
-#else
-          && *(u16 *)ref == *(u16 *)ip
-          && ref[2] == ip[2]
-#endif
-        )
-        {
-          /* match found at *ref++ */
-          unsigned int len = 2;
-          unsigned int maxlen = in_end - ip - len;
-          maxlen = maxlen > MAX_REF ? MAX_REF : maxlen;
-
-          op [- lit - 1] = lit - 1; /* stop run */
-          op -= !lit; /* undo run if length is zero */
-
-          if (expect_false (op + 3 + 1 >= out_end))
-            return 0;
-
-          for (;;)
-            {
-              if (expect_true (maxlen > 16))
-                {
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                }
-
-              do
-                len++;
-              while (len < maxlen && ref[len] == ip[len]);
-
-              break;
-            }
-
-          len -= 2; /* len is now #octets - 1 */
-          ip++;
-
-          if (len < 7)
-            {
-              *op++ = (off >> 8) + (len << 5);
-            }
-          else
-            {
-              *op++ = (off >> 8) + (  7 << 5);
-              *op++ = len - 7;
-            }
-
-          *op++ = off;
-          lit = 0; op++; /* start run */
-
-          ip += len + 1;
-
-          if (expect_false (ip >= in_end - 2))
-            break;
-
-#if ULTRA_FAST || VERY_FAST
-          --ip;
-# if VERY_FAST && !ULTRA_FAST
-          --ip;
-# endif
-          hval = FRST (ip);
-
-          hval = NEXT (hval, ip);
-          htab[IDX (hval)] = ip;
-          ip++;
-
-# if VERY_FAST && !ULTRA_FAST
-          hval = NEXT (hval, ip);
-          htab[IDX (hval)] = ip;
-          ip++;
-# endif
-#else
-          ip -= len + 1;
-
-          do
-            {
-              hval = NEXT (hval, ip);
-              htab[IDX (hval)] = ip;
-              ip++;
-            }
-          while (len--);
-#endif
-        }
-      else
-        {
-          /* one more literal byte we must copy */
-          if (expect_false (op >= out_end))
-            return 0;
-
-          lit++; *op++ = *ip++;
-
-          if (expect_false (lit == MAX_LIT))
-            {
-              op [- lit - 1] = lit - 1; /* stop run */
-              lit = 0; op++; /* start run */
-            }
-        }
+      case LZF_LEVEL_ULTRA: return lzf_compress_ultra (in_data, in_len, out_data, out_len);
+      case LZF_LEVEL_BEST : return lzf_compress_best  (in_data, in_len, out_data, out_len);
+      default             : return lzf_compress_fast  (in_data, in_len, out_data, out_len);
     }
+}
 
-  if (op + 3 > out_end) /* at most 3 bytes can be missing here */
-    return 0;
-
-  while (ip < in_end)
-    {
-      lit++; *op++ = *ip++;
+const char *
+lzf_level_name (int level)
+{
+  return level >= 0 && level < LZF_LEVELS ? lzf_level_names[level] : "???";
+}
 
-      if (expect_false (lit == MAX_LIT))
-        {
-          op [- lit - 1] = lit - 1; /* stop run */
-          lit = 0; op++; /* start run */
-        }
-    }
+int
+lzf_level_parse (const char *name)
+{
+  int level;
 
-  op [- lit - 1] = lit - 1; /* end run */
-  op -= !lit; /* undo run if length is zero */
+  for (level = 0; level < LZF_LEVELS; ++level)
+    if (strcmp (name, lzf_level_names[level]) == 0)
+      return level;
 
-  return op - (u8 *)out_data;
+  return -1;
 }
-
@@ -35,6 +35,7 @@
  */
 
 #include "lzfP.h"
+#include <string.h>
 
 #if AVOID_ERRNO
 # define SET_ERRNO(n)
@@ -43,18 +44,50 @@
 # define SET_ERRNO(n) errno = (n)
 #endif
 
-/*
-#if (__i386 || __amd64) && __GNUC__ >= 3
-# define lzf_movsb(dst, src, len)                \
-   asm ("rep movsb"                              \
-        : "=D" (dst), "=S" (src), "=c" (len)     \
-        :  "0" (dst),  "1" (src),  "2" (len));
+#if __GNUC__ >= 3
+# define lzf_expect(expr,value)  __builtin_expect ((expr),(value))
+# define lzf_inline              inline __attribute__ ((always_inline))
+#else
+# define lzf_expect(expr,value)  (expr)
+# define lzf_inline              inline
 #endif
-*/
 
-unsigned int 
-lzf_decompress (const void *const in_data,  unsigned int in_len,
-                void             *out_data, unsigned int out_len)
+#if __GNUC__ >= 5 && (__x86_64__ || __i386__)
+# define LZF_HAVE_AVX2 1
+#else
+# define LZF_HAVE_AVX2 0
+#endif
+
+/*
+ * Literals and back references are copied with fixed size (wide) moves
+ * which may write up to LZF_WILD bytes past the end of the current run.
+ * They are only used when there's at least that much room left in the
+ * output (and input) buffer, so the last bytes of every stream are always
+ * copied exactly and nothing is ever written beyond out_len.
+ */
+#define LZF_WILD 32
+
+static lzf_inline void
+lzf_copy8 (u8 *dst, const u8 *src)
+{
+  memcpy (dst, src, 8);
+}
+
+static lzf_inline void
+lzf_copy16 (u8 *dst, const u8 *src)
+{
+  memcpy (dst, src, 16);
+}
+
+static lzf_inline void
+lzf_copy32 (u8 *dst, const u8 *src)
+{
+  memcpy (dst, src, 32);
+}
+
+static lzf_inline unsigned int
+lzf_decompress_body (const void *const in_data,  unsigned int in_len,
+                     void             *out_data, unsigned int out_len)
 {
   u8 const *ip = (const u8 *)in_data;
   u8       *op = (u8 *)out_data;
@@ -83,13 +116,14 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
             }
 #endif
 
-#ifdef lzf_movsb
-          lzf_movsb (op, ip, ctrl);
-#else
-          do
-            *op++ = *ip++;
-          while (--ctrl);
-#endif
+          /* a literal run is at most 32 bytes long, move it at once */
+          if (lzf_expect (op + LZF_WILD <= out_end && ip + LZF_WILD <= in_end, 1))
+            lzf_copy32 (op, ip);
+          else
+            memcpy (op, ip, ctrl);
+
+          op += ctrl;
+          ip += ctrl;
         }
       else /* back reference */
         {
@@ -117,8 +151,9 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
             }
 
           ref -= *ip++;
+          len += 2;
 
-          if (op + len + 2 > out_end)
+          if (op + len > out_end)
             {
               SET_ERRNO (E2BIG);
               return 0;
@@ -130,17 +165,65 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
               return 0;
             }
 
-#ifdef lzf_movsb
-          len += 2;
-          lzf_movsb (op, ref, len);
-#else
-          *op++ = *ref++;
-          *op++ = *ref++;
+          if (lzf_expect (op + len + LZF_WILD <= out_end, 1))
+            {
+              u8 *const end = op + len;
+              unsigned int dist = op - ref;
 
-          do
-            *op++ = *ref++;
-          while (--len);
-#endif
+              if (dist >= 16)
+                {
+                  /* source and destination of every move never overlap */
+                  do
+                    {
+                      lzf_copy16 (op, ref);
+                      op  += 16;
+                      ref += 16;
+                    }
+                  while (op < end);
+                }
+              else if (dist >= 8)
+                {
+                  do
+                    {
+                      lzf_copy8 (op, ref);
+                      op  += 8;
+                      ref += 8;
+                    }
+                  while (op < end);
+                }
+              else if (dist == 1)
+                {
+                  memset (op, *ref, len);
+                }
+              else
+                {
+                  /*
+                   * Short offset, the output is periodic with period dist.
+                   * Expand the pattern byte by byte until a whole number of
+                   * periods at least 8 bytes long is behind op, then move
+                   * 8 bytes at a time from that distance.
+                   */
+                  unsigned int step = dist * ((8 + dist - 1) / dist);
+                  unsigned int pre  = step - dist;
+
+                  while (pre-- && op < end)
+                    *op++ = *ref++;
+
+                  while (op < end)
+                    {
+                      lzf_copy8 (op, op - step);
+                      op += 8;
+                    }
+                }
+
+              op = end;
+            }
+          else
+            {
+              do
+                *op++ = *ref++;
+              while (--len);
+            }
         }
     }
   while (ip < in_end);
@@ -148,3 +231,46 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
   return op - (u8 *)out_data;
 }
 
+typedef unsigned int (*lzf_decompress_fn) (const void *const, unsigned int, void *, unsigned int);
+
+static unsigned int
+lzf_decompress_generic (const void *const in_data,  unsigned int in_len,
+                        void             *out_data, unsigned int out_len)
+{
+  return lzf_decompress_body (in_data, in_len, out_data, out_len);
+}
+
+#if LZF_HAVE_AVX2
+/* same decoder, but wide moves are compiled to 256 bit loads and stores */
+__attribute__ ((target ("avx2"))) static unsigned int
+lzf_decompress_avx2 (const void *const in_data,  unsigned int in_len,
+                     void             *out_data, unsigned int out_len)
+{
+  return lzf_decompress_body (in_data, in_len, out_data, out_len);
+}
+#endif
+
+static lzf_decompress_fn
+lzf_decompress_select (void)
+{
+#if LZF_HAVE_AVX2
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2"))
+    return lzf_decompress_avx2;
+#endif
+
+  return lzf_decompress_generic;
+}
+
+static lzf_decompress_fn lzf_decompress_impl = NULL;
+
+unsigned int 
+lzf_decompress (const void *const in_data,  unsigned int in_len,
+                void             *out_data, unsigned int out_len)
+{
+  if (lzf_expect (lzf_decompress_impl == NULL, 0))
+    lzf_decompress_impl = lzf_decompress_select ();
+
+  return lzf_decompress_impl (in_data, in_len, out_data, out_len);
+}
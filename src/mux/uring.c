@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#if HAVE_IO_URING
+
+/*
+ * io_uring backend.
+ *
+ * Listeners, eventfds and anything else registered with the event loop are
+ * mapped to one shot IORING_OP_POLL_ADD requests which are re-armed after
+ * they fire. Every change to the interest set ( new clients, writable on and
+ * off, ... ) is queued in the submission ring and submitted together with the
+ * wait for completions, so a loop iteration costs a single io_uring_enter
+ * instead of an epoll_wait plus one epoll_ctl for every changed descriptor.
+ *
+ * Client sockets attached with aeApiAttachStream are completion based
+ * instead: a multishot IORING_OP_RECV fills buffers picked by the kernel from
+ * a ring of provided buffers, the received data is queued and the fd fires as
+ * readable for as long as something is left, handlers take it with aeApiRecv.
+ * Replies are sent with IORING_OP_SENDMSG by aeApiSend and the callback is
+ * called once the kernel is done with them. Kernels without multishot recv or
+ * provided buffer rings keep receiving in poll mode.
+ *
+ * Kernels without io_uring ( or where it's disabled ) use the epoll backend,
+ * which is compiled in under its own names.
+ */
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#define aeApiState    aeEpollState
+#define aeApiCreate   aeEpollCreate
+#define aeApiResize   aeEpollResize
+#define aeApiFree     aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll     aeEpollPoll
+#define aeApiName     aeEpollName
+
+#include "epoll.c"
+
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+/* this backend implements streams and asynchronous sends */
+#define AE_API_STREAMS 1
+
+// features we rely upon, EXT_ARG ( 5.11 ) is needed to wait with a timeout
+#define AE_URING_FEATURES ( IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG )
+// user_data of requests whose completion is not interesting
+#define AE_URING_IGNORE   0xFFFFFFFFFFFFFFFFULL
+// the two top bits of user_data tell which kind of request completed
+#define AE_URING_POLL     ( 0ULL << 62 )
+#define AE_URING_RECV     ( 1ULL << 62 )
+#define AE_URING_SEND     ( 2ULL << 62 )
+#define AE_URING_TYPE     ( 3ULL << 62 )
+// polls and receives carry the fd and its generation in the bits left
+#define AE_URING_GEN_MASK 0x3FFFFFFFU
+// maximum number of submission queue entries
+#define AE_URING_MAX_ENTRIES 4096
+/* only the loop thread uses the ring, so the kernel can keep the completion
+ * work until we wait instead of interrupting us for it ( 6.1 ), or at least
+ * not signal us ( 5.19 ), older kernels get neither */
+static const unsigned aeUringSetupFlags[] = {
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_COOP_TASKRUN,
+    0
+};
+// provided buffers the receives pick from, the count must be a power of two
+#define AE_URING_BUF_GROUP  0
+#define AE_URING_BUF_COUNT  256
+#define AE_URING_BUF_SIZE   16384
+// a stream holding this many received buffers stops receiving until it's read
+#define AE_URING_BUF_FD_MAX ( AE_URING_BUF_COUNT / 8 )
+// maximum number of iovecs of a single send
+#define AE_URING_IOV_MAX    64
+
+// the fd is a stream, data is received by a multishot recv
+#define AE_URING_STREAM    1
+// the recv is in flight
+#define AE_URING_RECEIVING 2
+// its cancellation too
+#define AE_URING_CANCELLED 4
+// the peer closed the connection
+#define AE_URING_EOF       8
+// the fd is in the rearm list
+#define AE_URING_REARM     16
+// the recv ran out of buffers, the fd is in the starved list
+#define AE_URING_STARVED   32
+
+typedef struct aeUringStream {
+    int      flags;
+    // incremented when the stream is detached, to drop the old recv completions
+    uint32_t gen;
+    // errno the recv failed with, 0 if none
+    int      err;
+    // received buffers, in order, -1 if none
+    int      head;
+    int      tail;
+    int      queued;
+    // position inside the ready list, -1 if not there
+    int      ready;
+    // last poll which fired this fd, and where in the fired array
+    uint32_t round;
+    int      fired;
+} aeUringStream;
+
+typedef struct aeUringSend {
+    struct aeUringSend *next;
+    struct msghdr msg;
+    struct iovec iov[AE_URING_IOV_MAX];
+    gbSendProc *proc;
+    void *clientData;
+    int fd;
+    int res;
+} aeUringSend;
+
+typedef struct aeApiState {
+    int ringfd;
+    // submission ring
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned  sq_entries;
+    unsigned  sq_local_tail;
+    struct io_uring_sqe *sqes;
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // mapped areas
+    void   *ring;
+    size_t  ring_size;
+    size_t  sqes_size;
+    // mask of the poll request in flight for every fd, GB_NONE if none
+    int      *armed;
+    // incremented every time a poll request is cancelled, to drop its completion
+    uint32_t *gen;
+    // number of fds fired by the last poll which have to be re-armed
+    int nfired;
+    // incremented by every poll, to merge the events of the same fd
+    uint32_t round;
+    // receive state of every fd
+    aeUringStream *streams;
+    // ring of provided buffers, NULL if streams are not supported
+    struct io_uring_buf_ring *br;
+    // set once the kernel turned down a multishot recv
+    int      norecv;
+    uint16_t br_tail;
+    char    *bufs;
+    // next received buffer of the same stream, length and bytes already read
+    int      *buf_next;
+    uint32_t *buf_len;
+    uint32_t *buf_off;
+    // streams with received data or an error, they fire for as long as they're readable
+    int *ready;
+    int  nready;
+    // streams whose recv has to be submitted again
+    int *rearm;
+    int  nrearm;
+    // streams waiting for buffers to be given back
+    int *starved;
+    int  nstarved;
+    // unused sends, and completed ones whose callback is yet to be called
+    aeUringSend *free_sends;
+    aeUringSend *done_head;
+    aeUringSend *done_tail;
+} aeApiState;
+
+// set when io_uring could not be initialized and epoll is used instead
+static int aeUringFallback = 0;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+/* with getevents set completions are reaped too, even if there's no wait,
+ * deferred task work only runs then */
+static int aeUringEnter(aeApiState *state, int getevents, unsigned wait, struct __kernel_timespec *ts) {
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0, submit;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(state->sq_tail, state->sq_local_tail, __ATOMIC_RELEASE);
+    submit = state->sq_local_tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+
+    if (getevents) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (wait && ts) {
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp   = &arg;
+            argsz  = sizeof(arg);
+        }
+    }
+    else if (submit == 0) {
+        return 0;
+    }
+
+    return (int)syscall(__NR_io_uring_enter, state->ringfd, submit, wait, flags, argp, argsz);
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE), idx;
+    struct io_uring_sqe *sqe;
+
+    // ring full, submit what we have to make room
+    if (state->sq_local_tail - head >= state->sq_entries) {
+        aeUringEnter(state, 0, 0, NULL);
+        head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+        if (state->sq_local_tail - head >= state->sq_entries) return NULL;
+    }
+
+    idx = state->sq_local_tail & *state->sq_mask;
+    sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    state->sq_local_tail++;
+
+    return sqe;
+}
+
+static __inline__ uint64_t aeUringTag(aeApiState *state, int fd) {
+    return AE_URING_POLL | (uint64_t)(uint32_t)fd | ((uint64_t)(state->gen[fd] & AE_URING_GEN_MASK) << 32);
+}
+
+static __inline__ uint64_t aeUringRecvTag(aeApiState *state, int fd) {
+    return AE_URING_RECV | (uint64_t)(uint32_t)fd | ((uint64_t)(state->streams[fd].gen & AE_URING_GEN_MASK) << 32);
+}
+
+/* streams are read by the recv, their polls only wait for the rest */
+static __inline__ int aeUringPollMask(aeApiState *state, int fd, int mask) {
+    return (state->streams[fd].flags & AE_URING_STREAM) ? (mask & ~GB_READABLE) : mask;
+}
+
+static int aeUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    uint32_t events = 0;
+
+    if (!sqe) return -1;
+    if (mask & GB_READABLE) events |= POLLIN;
+    if (mask & GB_WRITABLE) events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = aeUringTag(state, fd);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+static int aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = aeUringTag(state, fd);
+    sqe->user_data = AE_URING_IGNORE;
+    /* whatever the old request completes with is now stale */
+    state->gen[fd]++;
+    state->armed[fd] = GB_NONE;
+    return 0;
+}
+
+static int aeUringCancel(aeApiState *state, uint64_t tag) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag;
+    sqe->user_data = AE_URING_IGNORE;
+    return 0;
+}
+
+static int aeUringRecv(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BUF_GROUP;
+    sqe->user_data = aeUringRecvTag(state, fd);
+    state->streams[fd].flags |= AE_URING_RECEIVING;
+    return 0;
+}
+
+/* the recv is submitted again at the next poll, if the stream still wants it */
+static void aeUringRearm(aeApiState *state, int fd) {
+    aeUringStream *s = &state->streams[fd];
+
+    if (s->flags & AE_URING_REARM) return;
+    s->flags |= AE_URING_REARM;
+    state->rearm[state->nrearm++] = fd;
+}
+
+static void aeUringReady(aeApiState *state, int fd) {
+    aeUringStream *s = &state->streams[fd];
+
+    if (s->ready != -1) return;
+    s->ready = state->nready;
+    state->ready[state->nready++] = fd;
+}
+
+static void aeUringUnready(aeApiState *state, int fd) {
+    aeUringStream *s = &state->streams[fd];
+    int last;
+
+    if (s->ready == -1) return;
+    last = state->ready[--state->nready];
+    state->ready[s->ready] = last;
+    state->streams[last].ready = s->ready;
+    s->ready = -1;
+}
+
+/* give a buffer back to the kernel, streams which ran out can receive again */
+static void aeUringRecycle(aeApiState *state, int bid) {
+    struct io_uring_buf *buf = &state->br->bufs[state->br_tail & (AE_URING_BUF_COUNT - 1)];
+    int j;
+
+    buf->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid * AE_URING_BUF_SIZE);
+    buf->len = AE_URING_BUF_SIZE;
+    buf->bid = bid;
+    state->br_tail++;
+    __atomic_store_n(&state->br->tail, state->br_tail, __ATOMIC_RELEASE);
+
+    for (j = 0; j < state->nstarved; j++) {
+        state->streams[state->starved[j]].flags &= ~AE_URING_STARVED;
+        aeUringRearm(state, state->starved[j]);
+    }
+    state->nstarved = 0;
+}
+
+static void aeUringStreamInit(aeUringStream *s) {
+    s->flags = 0;
+    s->gen = 0;
+    s->err = 0;
+    s->head = s->tail = -1;
+    s->queued = 0;
+    s->ready = -1;
+    s->round = 0;
+    s->fired = 0;
+}
+
+/* register the ring of provided buffers, without it streams are not supported */
+static int aeUringSetupBuffers(aeApiState *state) {
+    struct io_uring_buf_reg reg;
+    size_t size = AE_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    int j;
+
+    state->br = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->br == MAP_FAILED) {
+        state->br = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->br;
+    reg.ring_entries = AE_URING_BUF_COUNT;
+    reg.bgid = AE_URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        munmap(state->br, size);
+        state->br = NULL;
+        return -1;
+    }
+
+    state->bufs = zmalloc((size_t)AE_URING_BUF_COUNT * AE_URING_BUF_SIZE);
+    state->buf_next = zmalloc(sizeof(int)*AE_URING_BUF_COUNT);
+    state->buf_len = zmalloc(sizeof(uint32_t)*AE_URING_BUF_COUNT);
+    state->buf_off = zmalloc(sizeof(uint32_t)*AE_URING_BUF_COUNT);
+    for (j = 0; j < AE_URING_BUF_COUNT; j++)
+        aeUringRecycle(state, j);
+    return 0;
+}
+
+static void aeUringDestroy(aeApiState *state) {
+    aeUringSend *op;
+
+    if (state->sqes && state->sqes != MAP_FAILED) munmap(state->sqes, state->sqes_size);
+    if (state->ring && state->ring != MAP_FAILED) munmap(state->ring, state->ring_size);
+    if (state->ringfd != -1) close(state->ringfd);
+    if (state->br) munmap(state->br, AE_URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    /* sends still in flight die with the ring */
+    while ((op = state->free_sends)) {
+        state->free_sends = op->next;
+        zfree(op);
+    }
+    while ((op = state->done_head)) {
+        state->done_head = op->next;
+        zfree(op);
+    }
+    zfree(state->bufs);
+    zfree(state->buf_next);
+    zfree(state->buf_len);
+    zfree(state->buf_off);
+    zfree(state->streams);
+    zfree(state->ready);
+    zfree(state->rearm);
+    zfree(state->starved);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state);
+}
+
+static int aeApiCreate(gbEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    unsigned entries = eventLoop->setsize < AE_URING_MAX_ENTRIES ? eventLoop->setsize : AE_URING_MAX_ENTRIES;
+    size_t sq_size, cq_size;
+    char *ring;
+    int j;
+
+    if (!state) return -1;
+    for (j = 0; ; j++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = aeUringSetupFlags[j];
+        state->ringfd = aeUringSetup(entries, &p);
+        if (state->ringfd != -1 || errno != EINVAL || aeUringSetupFlags[j] == 0) break;
+    }
+    if (state->ringfd == -1 || (p.features & AE_URING_FEATURES) != AE_URING_FEATURES) {
+        gbLog( WARNING, "io_uring not available ( %s ), falling back to epoll.",
+               state->ringfd == -1 ? strerror(errno) : "missing features" );
+        aeUringDestroy(state);
+        aeUringFallback = 1;
+        return aeEpollCreate(eventLoop);
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    state->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->ring = mmap(NULL, state->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    state->armed = zcalloc(sizeof(int)*eventLoop->setsize);
+    state->gen = zcalloc(sizeof(uint32_t)*eventLoop->setsize);
+    state->streams = zmalloc(sizeof(aeUringStream)*eventLoop->setsize);
+    state->ready = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->rearm = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->starved = zmalloc(sizeof(int)*eventLoop->setsize);
+    if (state->ring == MAP_FAILED || state->sqes == MAP_FAILED || !state->armed || !state->gen ||
+        !state->streams || !state->ready || !state->rearm || !state->starved) {
+        aeUringDestroy(state);
+        return -1;
+    }
+    for (j = 0; j < eventLoop->setsize; j++)
+        aeUringStreamInit(&state->streams[j]);
+
+    ring = state->ring;
+    state->sq_head = (unsigned *)(ring + p.sq_off.head);
+    state->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    state->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    state->sq_array = (unsigned *)(ring + p.sq_off.array);
+    state->sq_entries = p.sq_entries;
+    state->sq_local_tail = *state->sq_tail;
+    state->cq_head = (unsigned *)(ring + p.cq_off.head);
+    state->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    state->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    if (aeUringSetupBuffers(state) == -1)
+        gbLog( WARNING, "io_uring provided buffers not available ( %s ), receiving in poll mode.", strerror(errno) );
+
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(gbEventLoop *eventLoop, int setsize) {
+    if (aeUringFallback) return aeEpollResize(eventLoop, setsize);
+
+    aeApiState *state = eventLoop->apidata;
+    int i;
+
+    state->armed = zrealloc(state->armed, sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen, sizeof(uint32_t)*setsize);
+    state->streams = zrealloc(state->streams, sizeof(aeUringStream)*setsize);
+    state->ready = zrealloc(state->ready, sizeof(int)*setsize);
+    state->rearm = zrealloc(state->rearm, sizeof(int)*setsize);
+    state->starved = zrealloc(state->starved, sizeof(int)*setsize);
+    for (i = eventLoop->setsize; i < setsize; i++) {
+        state->armed[i] = GB_NONE;
+        state->gen[i] = 0;
+        aeUringStreamInit(&state->streams[i]);
+    }
+    return 0;
+}
+
+static void aeApiFree(gbEventLoop *eventLoop) {
+    if (aeUringFallback) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeUringDestroy(eventLoop->apidata);
+}
+
+static int aeApiAddEvent(gbEventLoop *eventLoop, int fd, int mask) {
+    if (aeUringFallback) return aeEpollAddEvent(eventLoop, fd, mask);
+
+    aeApiState *state = eventLoop->apidata;
+
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if ((mask & GB_READABLE) && (state->streams[fd].flags & AE_URING_STREAM))
+        aeUringRearm(state, fd);
+    mask = aeUringPollMask(state, fd, mask);
+    if (state->armed[fd] == mask) return 0;
+    if (state->armed[fd] != GB_NONE && aeUringDisarm(state, fd) == -1) return -1;
+    return mask == GB_NONE ? 0 : aeUringArm(state, fd, mask);
+}
+
+static void aeApiDelEvent(gbEventLoop *eventLoop, int fd, int delmask) {
+    if (aeUringFallback) {
+        aeEpollDelEvent(eventLoop, fd, delmask);
+        return;
+    }
+
+    aeApiState *state = eventLoop->apidata;
+    aeUringStream *s = &state->streams[fd];
+    int mask = aeUringPollMask(state, fd, eventLoop->events[fd].mask & (~delmask));
+
+    /* stop receiving, what was received already is kept for when reading
+     * resumes and the recv is submitted again */
+    if ((delmask & GB_READABLE) && (s->flags & (AE_URING_RECEIVING|AE_URING_CANCELLED)) == AE_URING_RECEIVING &&
+        aeUringCancel(state, aeUringRecvTag(state, fd)) == 0)
+        s->flags |= AE_URING_CANCELLED;
+
+    /* nothing in flight, if something is left it will be armed after the
+     * fired events are processed */
+    if (state->armed[fd] == GB_NONE || state->armed[fd] == mask) return;
+    if (aeUringDisarm(state, fd) == 0 && mask != GB_NONE)
+        aeUringArm(state, fd, mask);
+}
+
+/* received data for 'fd' is queued by the backend from now on, has to be
+ * called before any file event is registered for it */
+static void aeApiAttachStream(gbEventLoop *eventLoop, int fd) {
+    if (aeUringFallback) return;
+
+    aeApiState *state = eventLoop->apidata;
+    aeUringStream *s = &state->streams[fd];
+
+    if (!state->br || state->norecv) return;
+    /* it could still be listed from its previous life */
+    s->flags = (s->flags & (AE_URING_REARM|AE_URING_STARVED)) | AE_URING_STREAM;
+}
+
+/* drop what was received and stop receiving, before 'fd' is closed */
+static void aeApiDetachStream(gbEventLoop *eventLoop, int fd) {
+    if (aeUringFallback) return;
+
+    aeApiState *state = eventLoop->apidata;
+    aeUringStream *s = &state->streams[fd];
+    int bid;
+
+    if (!(s->flags & AE_URING_STREAM)) return;
+    if ((s->flags & (AE_URING_RECEIVING|AE_URING_CANCELLED)) == AE_URING_RECEIVING)
+        aeUringCancel(state, aeUringRecvTag(state, fd));
+    while ((bid = s->head) != -1) {
+        s->head = state->buf_next[bid];
+        aeUringRecycle(state, bid);
+    }
+    aeUringUnready(state, fd);
+    s->tail = -1;
+    s->queued = 0;
+    s->err = 0;
+    /* whatever the old recv completes with is now stale */
+    s->gen++;
+    s->flags &= AE_URING_REARM|AE_URING_STARVED;
+}
+
+/* read(2) for streams, copies out what was received */
+static ssize_t aeApiRecv(gbEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    if (aeUringFallback) return read(fd, buf, len);
+
+    aeApiState *state = eventLoop->apidata;
+    aeUringStream *s = &state->streams[fd];
+    size_t nread = 0, n;
+    int bid;
+
+    if (!(s->flags & AE_URING_STREAM)) return read(fd, buf, len);
+
+    while (nread < len && (bid = s->head) != -1) {
+        n = state->buf_len[bid] - state->buf_off[bid];
+        if (n > len - nread) n = len - nread;
+        memcpy((char *)buf + nread, state->bufs + (size_t)bid * AE_URING_BUF_SIZE + state->buf_off[bid], n);
+        nread += n;
+        state->buf_off[bid] += n;
+        if (state->buf_off[bid] == state->buf_len[bid]) {
+            s->head = state->buf_next[bid];
+            if (s->head == -1) s->tail = -1;
+            s->queued--;
+            aeUringRecycle(state, bid);
+        }
+    }
+
+    if (s->head == -1 && !s->err && !(s->flags & AE_URING_EOF))
+        aeUringUnready(state, fd);
+    /* it stopped because too much was queued */
+    if (!(s->flags & AE_URING_RECEIVING) && s->queued < AE_URING_BUF_FD_MAX)
+        aeUringRearm(state, fd);
+
+    if (nread > 0) return nread;
+    if (s->err) {
+        errno = s->err;
+        return -1;
+    }
+    if (s->flags & AE_URING_EOF) return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+/* send 'iov' with a single sendmsg, the iovecs are copied but what they point
+ * to must stay valid until 'proc' is called with the result */
+static int aeApiSend(gbEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt, gbSendProc *proc, void *clientData) {
+    if (aeUringFallback) return -1;
+
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_sqe *sqe;
+    aeUringSend *op;
+
+    if ((op = state->free_sends)) state->free_sends = op->next;
+    else if (!(op = zmalloc(sizeof(aeUringSend)))) return -1;
+
+    if (!(sqe = aeUringGetSqe(state))) {
+        op->next = state->free_sends;
+        state->free_sends = op;
+        return -1;
+    }
+
+    if (iovcnt > AE_URING_IOV_MAX) iovcnt = AE_URING_IOV_MAX;
+    memcpy(op->iov, iov, sizeof(struct iovec)*iovcnt);
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = iovcnt;
+    op->proc = proc;
+    op->clientData = clientData;
+    op->fd = fd;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = AE_URING_SEND | (uint64_t)(uintptr_t)op;
+    return 0;
+}
+
+/* call the callbacks of the completed sends, returns how many */
+static int aeApiCompletions(gbEventLoop *eventLoop) {
+    if (aeUringFallback) return 0;
+
+    aeApiState *state = eventLoop->apidata;
+    aeUringSend *op;
+    int processed = 0;
+
+    while ((op = state->done_head)) {
+        state->done_head = op->next;
+        if (!state->done_head) state->done_tail = NULL;
+        /* the callback can send again and reuse it */
+        op->next = state->free_sends;
+        state->free_sends = op;
+        op->proc(eventLoop, op->fd, op->clientData, op->res);
+        processed++;
+    }
+    return processed;
+}
+
+static void aeUringFire(gbEventLoop *eventLoop, aeApiState *state, int fd, int mask, int *numevents) {
+    aeUringStream *s = &state->streams[fd];
+
+    if (s->round == state->round) {
+        eventLoop->fired[s->fired].mask |= mask;
+        return;
+    }
+    s->round = state->round;
+    s->fired = *numevents;
+    eventLoop->fired[*numevents].fd = fd;
+    eventLoop->fired[*numevents].mask = mask;
+    (*numevents)++;
+}
+
+static void aeUringRecvDone(gbEventLoop *eventLoop, aeApiState *state, struct io_uring_cqe *cqe) {
+    int fd = (int)(uint32_t)cqe->user_data, bid = -1;
+    aeUringStream *s;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    /* the stream was detached, the buffer just goes back */
+    if (fd >= eventLoop->setsize || !(state->streams[fd].flags & AE_URING_STREAM) ||
+        (uint32_t)((cqe->user_data >> 32) & AE_URING_GEN_MASK) != (state->streams[fd].gen & AE_URING_GEN_MASK)) {
+        if (bid != -1) aeUringRecycle(state, bid);
+        return;
+    }
+
+    s = &state->streams[fd];
+    if (cqe->res > 0 && bid != -1) {
+        state->buf_len[bid] = cqe->res;
+        state->buf_off[bid] = 0;
+        state->buf_next[bid] = -1;
+        if (s->tail != -1) state->buf_next[s->tail] = bid;
+        else s->head = bid;
+        s->tail = bid;
+        s->queued++;
+        aeUringReady(state, fd);
+        /* the handler is not keeping up, let the socket buffer fill instead */
+        if (s->queued >= AE_URING_BUF_FD_MAX && !(s->flags & AE_URING_CANCELLED) &&
+            (cqe->flags & IORING_CQE_F_MORE) && aeUringCancel(state, aeUringRecvTag(state, fd)) == 0)
+            s->flags |= AE_URING_CANCELLED;
+    }
+    else if (bid != -1) {
+        aeUringRecycle(state, bid);
+    }
+
+    if (cqe->res == 0) {
+        s->flags |= AE_URING_EOF;
+        aeUringReady(state, fd);
+    }
+    else if (cqe->res == -ENOBUFS) {
+        if (!(s->flags & AE_URING_STARVED)) {
+            s->flags |= AE_URING_STARVED;
+            state->starved[state->nstarved++] = fd;
+        }
+    }
+    else if (cqe->res == -EINVAL) {
+        /* no multishot recv, this stream and the next ones are polled */
+        if (!state->norecv)
+            gbLog( WARNING, "io_uring multishot recv not supported, receiving in poll mode." );
+        state->norecv = 1;
+        s->flags &= AE_URING_REARM|AE_URING_STARVED;
+        if (state->armed[fd] != GB_NONE) aeUringDisarm(state, fd);
+        if (eventLoop->events[fd].mask != GB_NONE) aeUringArm(state, fd, eventLoop->events[fd].mask);
+        return;
+    }
+    else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        s->err = -cqe->res;
+        aeUringReady(state, fd);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        s->flags &= ~(AE_URING_RECEIVING|AE_URING_CANCELLED);
+        aeUringRearm(state, fd);
+    }
+}
+
+static int aeApiPoll(gbEventLoop *eventLoop, struct timeval *tvp) {
+    if (aeUringFallback) return aeEpollPoll(eventLoop, tvp);
+
+    aeApiState *state = eventLoop->apidata;
+    struct __kernel_timespec ts, *tsp = NULL;
+    unsigned head, tail, wait = 1;
+    int j, n, fd, mask, numevents = 0;
+
+    /* re-arm the one shot polls fired during the last iteration, handlers
+     * may have changed their masks in the meantime */
+    for (j = 0; j < state->nfired; j++) {
+        fd = eventLoop->fired[j].fd;
+        mask = aeUringPollMask(state, fd, eventLoop->events[fd].mask);
+        if (state->armed[fd] == GB_NONE && mask != GB_NONE)
+            aeUringArm(state, fd, mask);
+    }
+    state->nfired = 0;
+
+    /* and the receives which stopped, if their streams still want to read */
+    for (j = 0, n = state->nrearm, state->nrearm = 0; j < n; j++) {
+        aeUringStream *s = &state->streams[(fd = state->rearm[j])];
+
+        s->flags &= ~AE_URING_REARM;
+        if ((s->flags & (AE_URING_STREAM|AE_URING_RECEIVING|AE_URING_EOF|AE_URING_STARVED)) != AE_URING_STREAM ||
+            s->err || s->queued >= AE_URING_BUF_FD_MAX || !(eventLoop->events[fd].mask & GB_READABLE))
+            continue;
+        if (aeUringRecv(state, fd) == -1)
+            aeUringRearm(state, fd);
+    }
+
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        tsp = &ts;
+        wait = tvp->tv_sec || tvp->tv_usec;
+    }
+
+    /* received data still waiting to be read, don't sleep */
+    for (j = 0; j < state->nready && wait; j++)
+        if (eventLoop->events[state->ready[j]].mask & GB_READABLE) wait = 0;
+
+    /* submit everything and wait, errors like ETIME or EINTR just mean that
+     * nothing completed */
+    aeUringEnter(state, 1, wait, tsp);
+
+    if (++state->round == 0) state->round = 1;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+
+        head++;
+        if (cqe->user_data == AE_URING_IGNORE) continue;
+
+        if ((cqe->user_data & AE_URING_TYPE) == AE_URING_SEND) {
+            aeUringSend *op = (aeUringSend *)(uintptr_t)(cqe->user_data & ~AE_URING_TYPE);
+
+            /* callbacks are called once the fired events are processed */
+            op->res = cqe->res;
+            op->next = NULL;
+            if (state->done_tail) state->done_tail->next = op;
+            else state->done_head = op;
+            state->done_tail = op;
+            continue;
+        }
+        else if ((cqe->user_data & AE_URING_TYPE) == AE_URING_RECV) {
+            aeUringRecvDone(eventLoop, state, cqe);
+            continue;
+        }
+
+        fd = (int)(uint32_t)cqe->user_data;
+        if (fd >= eventLoop->setsize ||
+            (uint32_t)((cqe->user_data >> 32) & AE_URING_GEN_MASK) != (state->gen[fd] & AE_URING_GEN_MASK))
+            continue;
+
+        state->armed[fd] = GB_NONE;
+
+        /* the poll itself failed, report it like epoll does for EPOLLERR so
+         * the handlers find out, otherwise it would never be re-armed */
+        if (cqe->res < 0) {
+            mask = GB_READABLE|GB_WRITABLE;
+        } else {
+            mask = 0;
+            if (cqe->res & POLLIN) mask |= GB_READABLE;
+            if (cqe->res & POLLOUT) mask |= GB_WRITABLE;
+            if (cqe->res & POLLERR) mask |= GB_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= GB_WRITABLE;
+        }
+        aeUringFire(eventLoop, state, fd, mask, &numevents);
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+
+    /* streams fire for as long as they have something to read, like a level
+     * triggered poll would */
+    for (j = 0; j < state->nready; j++) {
+        fd = state->ready[j];
+        if (eventLoop->events[fd].mask & GB_READABLE)
+            aeUringFire(eventLoop, state, fd, GB_READABLE, &numevents);
+    }
+
+    state->nfired = numevents;
+    return numevents;
+}
+
+char *aeApiName(void) {
+    return aeUringFallback ? aeEpollName() : "io_uring";
+}
+#else
+void AVOID_EMPTY_UNIT_WARNING_BY_GCC_URING(){ }
+#endif
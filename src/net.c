@@ -31,11 +31,18 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include "configure.h"
+
+// accept4 is only declared with the GNU extensions enabled
+#if defined(HAVE_ACCEPT4) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "trie.h"
 #include "net.h"
 #include "lzf.h"
 #include "log.h"
 #include "query.h"
+#include "proto.h"
 #include "endianness.h"
 
 #include <stdio.h>
@@ -50,6 +57,7 @@
 #include <string.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -67,6 +75,9 @@
 #ifdef HAVE_EVPORT
 #include "mux/evport.c"
 #else
+#ifdef HAVE_IO_URING
+#include "mux/uring.c"
+#else
 #ifdef HAVE_EPOLL
 #include "mux/epoll.c"
 #else
@@ -77,6 +88,44 @@
 #endif
 #endif
 #endif
+#endif
+
+/* Readiness based backends leave reads and writes to the handlers. */
+#ifndef AE_API_STREAMS
+static void aeApiAttachStream(gbEventLoop *eventLoop, int fd) {
+    GB_NOTUSED(eventLoop);
+    GB_NOTUSED(fd);
+}
+
+static void aeApiDetachStream(gbEventLoop *eventLoop, int fd) {
+    GB_NOTUSED(eventLoop);
+    GB_NOTUSED(fd);
+}
+
+static ssize_t aeApiRecv(gbEventLoop *eventLoop, int fd, void *buf, size_t len) {
+    GB_NOTUSED(eventLoop);
+    return read(fd, buf, len);
+}
+
+static int aeApiSend(gbEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt, gbSendProc *proc, void *clientData) {
+    GB_NOTUSED(eventLoop);
+    GB_NOTUSED(fd);
+    GB_NOTUSED(iov);
+    GB_NOTUSED(iovcnt);
+    GB_NOTUSED(proc);
+    GB_NOTUSED(clientData);
+    return -1;
+}
+
+static int aeApiCompletions(gbEventLoop *eventLoop) {
+    GB_NOTUSED(eventLoop);
+    return 0;
+}
+#endif
+
+static long long gbUpdateTime(gbEventLoop *eventLoop);
+static void gbTimerRemove(gbEventLoop *eventLoop, gbTimeEvent *te);
+static void gbTimerFree(gbEventLoop *eventLoop, gbTimeEvent *te);
 
 gbEventLoop *gbCreateEventLoop(int setsize)
 {
@@ -90,12 +139,19 @@ gbEventLoop *gbCreateEventLoop(int setsize)
     eventLoop->fired = zmalloc(sizeof(gbFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timers = NULL;
+    eventLoop->ntimers = 0;
+    eventLoop->timers_size = 0;
     eventLoop->timeEventNextId = 0;
+    gbUpdateTime(eventLoop);
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->lag_threshold = 0;
+    eventLoop->lagged = 0;
+    gbHistogramReset(&eventLoop->busy_hist);
+    gbHistogramReset(&eventLoop->file_hist);
+    gbHistogramReset(&eventLoop->time_hist);
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == GB_NONE are not set. So let's initialize the
      * vector with it. */
@@ -167,6 +223,14 @@ void gbDeleteEventLoop(gbEventLoop *eventLoop)
     assert( eventLoop->fired != NULL );
 
     aeApiFree(eventLoop);
+    while( eventLoop->ntimers > 0 )
+    {
+        gbTimeEvent *te = eventLoop->timers[0];
+
+        gbTimerRemove( eventLoop, te );
+        gbTimerFree( eventLoop, te );
+    }
+    zfree(eventLoop->timers);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
@@ -232,55 +296,163 @@ int gbGetFileEvents(gbEventLoop *eventLoop, int fd)
     return fe->mask;
 }
 
-static void gbGetTime(long *seconds, long *milliseconds)
+/* 'fd' is a connected socket, completion based backends receive its data on
+ * their own and hand it over with gbEventLoopRecv. Must be called before any
+ * file event is registered for it. */
+void gbEventLoopAttachStream(gbEventLoop *eventLoop, int fd)
 {
-    assert( seconds != NULL );
-    assert( milliseconds != NULL );
+    assert( eventLoop != NULL );
+
+    if (fd < eventLoop->setsize)
+        aeApiAttachStream(eventLoop, fd);
+}
+
+/* Drop whatever was received for 'fd', before closing it. */
+void gbEventLoopDetachStream(gbEventLoop *eventLoop, int fd)
+{
+    assert( eventLoop != NULL );
+
+    if (fd < eventLoop->setsize)
+        aeApiDetachStream(eventLoop, fd);
+}
+
+/* Same as read(2), for readable handlers of streams. */
+ssize_t gbEventLoopRecv(gbEventLoop *eventLoop, int fd, void *buf, size_t len)
+{
+    assert( eventLoop != NULL );
+
+    if (fd >= eventLoop->setsize)
+        return read(fd, buf, len);
+
+    return aeApiRecv(eventLoop, fd, buf, len);
+}
+
+/* Let the backend send 'iov' and call 'proc' with what sendmsg(2) would have
+ * returned, or -errno, once it's done. The data must stay untouched until
+ * then. GB_ERR if the backend can't, the caller has to write on its own. */
+int gbEventLoopSend(gbEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt, gbSendProc *proc, void *clientData)
+{
+    assert( eventLoop != NULL );
+    assert( iovcnt > 0 );
+
+    if (fd >= eventLoop->setsize || aeApiSend(eventLoop, fd, iov, iovcnt, proc, clientData) == -1)
+        return GB_ERR;
+
+    return GB_OK;
+}
+
+/* Refresh the cached monotonic clock of the event loop.
+ * Timers are scheduled against this clock, it is read once per loop
+ * iteration and after every time event callback, so the system clock
+ * being moved back and forth can't delay or anticipate them. */
+static long long gbUpdateTime(gbEventLoop *eventLoop)
+{
+    assert( eventLoop != NULL );
+
+    struct timespec ts;
 
     /*
-     * On FreeBSD calling gettimeofday() causes all the cores on a multicore
-     * system to be synchronized. On a heavily loaded system with a
-     * significantly CPU bound application this can cause a 40% overall
-     * system degradation.
-     *
-     * A better option is to use clock_gettime() and pass in the
-     * CLOCK_REALTIME_FAST clock as the clock to use. This achieves the
-     * same behavior as gettimeofday() on Linux.
+     * On FreeBSD CLOCK_MONOTONIC_FAST avoids the precise (and much more
+     * expensive) time counter read, the millisecond resolution we need
+     * is way above its precision.
      */
 #if defined(__FreeBSD__)
-#include <sys/time.h>
-    struct timespec ts;
-    int r = clock_gettime(CLOCK_REALTIME_FAST, &ts);
-
-    *seconds = ts.tv_sec;
-    *milliseconds = ts.tv_nsec/1000000;
+    clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
 #else
-    struct timeval tv;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
 
-    gettimeofday(&tv, NULL);
+    eventLoop->now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
-#endif
+    return eventLoop->now;
+}
+
+/* Return the cached monotonic clock, handlers can use it as a cheap "now"
+ * to schedule or compare deadlines. */
+long long gbEventLoopTime(gbEventLoop *eventLoop)
+{
+    assert( eventLoop != NULL );
+
+    return eventLoop->now;
+}
+
+/* Time events are kept in a binary min-heap ordered by deadline, so the
+ * nearest timer is always timers[0] and adding, rescheduling or removing
+ * one costs O(log n). Every event knows its own slot inside the heap. */
+#define gbTimerLess(a,b) ( (a)->when < (b)->when || ( (a)->when == (b)->when && (a)->id < (b)->id ) )
+
+static void gbTimerSet(gbEventLoop *eventLoop, int index, gbTimeEvent *te)
+{
+    eventLoop->timers[index] = te;
+    te->index = index;
 }
 
-static void gbAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
+static void gbTimerSiftUp(gbEventLoop *eventLoop, int index)
 {
-    assert( sec != NULL );
-    assert( ms != NULL );
+    gbTimeEvent *te = eventLoop->timers[index];
+
+    while( index > 0 )
+    {
+        int parent = ( index - 1 ) / 2;
+
+        if( !gbTimerLess( te, eventLoop->timers[parent] ) )
+            break;
+
+        gbTimerSet( eventLoop, index, eventLoop->timers[parent] );
+        index = parent;
+    }
 
-    long cur_sec, cur_ms, when_sec, when_ms;
+    gbTimerSet( eventLoop, index, te );
+}
+
+static void gbTimerSiftDown(gbEventLoop *eventLoop, int index)
+{
+    gbTimeEvent *te = eventLoop->timers[index];
+    int ntimers = eventLoop->ntimers;
 
-    gbGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000)
+    while( 1 )
     {
-        ++when_sec;
-        when_ms -= 1000;
+        int child = index * 2 + 1;
+
+        if( child >= ntimers )
+            break;
+
+        if( child + 1 < ntimers && gbTimerLess( eventLoop->timers[child + 1], eventLoop->timers[child] ) )
+            ++child;
+
+        if( !gbTimerLess( eventLoop->timers[child], te ) )
+            break;
+
+        gbTimerSet( eventLoop, index, eventLoop->timers[child] );
+        index = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+
+    gbTimerSet( eventLoop, index, te );
+}
+
+static void gbTimerRemove(gbEventLoop *eventLoop, gbTimeEvent *te)
+{
+    int index = te->index;
+    gbTimeEvent *last = eventLoop->timers[--eventLoop->ntimers];
+
+    assert( eventLoop->timers[index] == te );
+
+    te->index = -1;
+    if( last == te )
+        return;
+
+    gbTimerSet( eventLoop, index, last );
+    if( index > 0 && gbTimerLess( last, eventLoop->timers[( index - 1 ) / 2] ) )
+        gbTimerSiftUp( eventLoop, index );
+    else
+        gbTimerSiftDown( eventLoop, index );
+}
+
+static void gbTimerFree(gbEventLoop *eventLoop, gbTimeEvent *te)
+{
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
 long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,
@@ -288,152 +460,112 @@ long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,
         gbEventFinalizerProc *finalizerProc)
 {
     assert( eventLoop != NULL );
+    assert( proc != NULL );
 
-    long long id = eventLoop->timeEventNextId++;
     gbTimeEvent *te;
 
+    if( eventLoop->ntimers == eventLoop->timers_size )
+    {
+        int size = eventLoop->timers_size ? eventLoop->timers_size * 2 : 8;
+        gbTimeEvent **timers = zrealloc( eventLoop->timers, sizeof(gbTimeEvent *) * size );
+
+        if( timers == NULL ) return GB_ERR;
+
+        eventLoop->timers = timers;
+        eventLoop->timers_size = size;
+    }
+
     te = zmalloc(sizeof(*te));
     if (te == NULL) return GB_ERR;
-    te->id = id;
-    gbAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->id = eventLoop->timeEventNextId++;
+    te->when = gbUpdateTime(eventLoop) + milliseconds;
+    te->running = 0;
+    te->deleted = 0;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+
+    gbTimerSet( eventLoop, eventLoop->ntimers++, te );
+    gbTimerSiftUp( eventLoop, te->index );
+
+    return te->id;
 }
 
 int gbDeleteTimeEvent(gbEventLoop *eventLoop, long long id)
 {
     assert( eventLoop != NULL );
 
-    gbTimeEvent *te, *prev = NULL;
+    int i;
 
-    te = eventLoop->timeEventHead;
-    while(te)
+    // ids are not ordered inside the heap, but a delete is way less
+    // frequent than a fire or reschedule so a linear lookup is fine.
+    for( i = 0; i < eventLoop->ntimers; ++i )
     {
-        if (te->id == id)
+        gbTimeEvent *te = eventLoop->timers[i];
+
+        if( te->id == id && !te->deleted )
         {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
+            // the callback is deleting its own event, processTimeEvents
+            // will take care of it once the callback returns.
+            if( te->running )
+            {
+                te->deleted = 1;
+                return GB_OK;
+            }
+
+            gbTimerRemove( eventLoop, te );
+            gbTimerFree( eventLoop, te );
             return GB_OK;
         }
-        prev = te;
-        te = te->next;
     }
+
     return GB_ERR; /* NO event with the specified ID found */
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- */
-static gbTimeEvent *aeSearchNearestTimer(gbEventLoop *eventLoop)
+/* Process time events */
+static int processTimeEvents(gbEventLoop *eventLoop)
 {
     assert( eventLoop != NULL );
 
-    gbTimeEvent *te = eventLoop->timeEventHead;
-    gbTimeEvent *nearest = te;
+    int processed = 0;
+    long long maxId = eventLoop->timeEventNextId - 1;
 
-    while(te)
-    {
-        if( te->when_sec < nearest->when_sec ||
-                ( te->when_sec == nearest->when_sec && te->when_ms < nearest->when_ms) )
-        {
-            nearest = te;
-        }
+    gbUpdateTime(eventLoop);
 
-        te = te->next;
-    }
+    while( eventLoop->ntimers > 0 )
+    {
+        gbTimeEvent *te = eventLoop->timers[0];
+        int retval;
 
-    return nearest;
-}
+        if( te->when > eventLoop->now )
+            break;
 
-/* Process time events */
-static int processTimeEvents(gbEventLoop *eventLoop)
-{
-    assert( eventLoop != NULL );
+        /* Don't process events registered by the handlers themselves
+         * during this pass, in order to don't loop forever on a zero
+         * milliseconds timer. They will fire on the next iteration. */
+        if( te->id > maxId )
+            break;
 
-    int processed = 0;
-    gbTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime)
-    {
-        te = eventLoop->timeEventHead;
-        while(te)
-        {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
+        te->running = 1;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        te->running = 0;
+        ++processed;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te)
-    {
-        long now_sec, now_ms;
-        long long id;
+        // handlers may take a while, don't reschedule on a stale clock.
+        gbUpdateTime(eventLoop);
 
-        if (te->id > maxId)
-        {
-            te = te->next;
-            continue;
-        }
-        gbGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-                (now_sec == te->when_sec && now_ms >= te->when_ms))
+        if( retval != GB_NOMORE && !te->deleted )
         {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            ++processed;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Gibson uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != GB_NOMORE)
-            {
-                gbAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            }
-            else
-            {
-                gbDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
+            te->when = eventLoop->now + retval;
+            gbTimerSiftDown( eventLoop, te->index );
         }
         else
         {
-            te = te->next;
+            gbTimerRemove( eventLoop, te );
+            gbTimerFree( eventLoop, te );
         }
     }
+
     return processed;
 }
 
@@ -458,7 +590,11 @@ int gbProcessEvents(gbEventLoop *eventLoop, int flags)
         time_events = ( flags & GB_TIME_EVENTS ),
         file_events = ( flags & GB_FILE_EVENTS ),
         dont_wait   = ( flags & GB_DONT_WAIT ),
-        numevents;
+        numevents,
+        completions,
+        timers;
+    /* Time spent serving events, nobody else is served meanwhile. */
+    uint64_t start = 0, mark = 0, now = 0, file_ns = 0, time_ns = 0;
 
     /* Nothing to do? return ASAP */
     if (!time_events && !file_events)
@@ -474,30 +610,19 @@ int gbProcessEvents(gbEventLoop *eventLoop, int flags)
         gbTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if ( time_events && !dont_wait )
-            shortest = aeSearchNearestTimer(eventLoop);
+        if ( time_events && !dont_wait && eventLoop->ntimers > 0 )
+            shortest = eventLoop->timers[0];
 
         if (shortest)
         {
-            long now_sec, now_ms;
-
             // Compute the time missing for the nearest timer to fire.
-            gbGetTime(&now_sec, &now_ms);
-            tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
+            long long ms = shortest->when - gbUpdateTime(eventLoop);
 
-            if (shortest->when_ms < now_ms)
-            {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            }
-            else
-            {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
+            if (ms < 0) ms = 0;
 
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp = &tv;
+            tvp->tv_sec = ms / 1000;
+            tvp->tv_usec = ( ms % 1000 ) * 1000;
         }
         // no time events scheduled
         else
@@ -518,6 +643,13 @@ int gbProcessEvents(gbEventLoop *eventLoop, int flags)
         }
 
         numevents = aeApiPoll(eventLoop, tvp);
+        start = mark = gbHistogramClock();
+
+        /* sends completed by the backend go first, so the handlers of the
+         * fired events don't find replies already sent still queued */
+        completions = aeApiCompletions(eventLoop);
+        processed += completions;
+
         for (j = 0; j < numevents; j++)
         {
             gbFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
@@ -541,10 +673,43 @@ int gbProcessEvents(gbEventLoop *eventLoop, int flags)
 
             ++processed;
         }
+
+        if (numevents + completions > 0)
+        {
+            now = gbHistogramClock();
+            file_ns = now - mark;
+            mark = now;
+            gbHistogramAdd(&eventLoop->file_hist, file_ns);
+        }
     }
     /* Check time events */
     if (flags & GB_TIME_EVENTS)
-        processed += processTimeEvents(eventLoop);
+    {
+        if (start == 0)
+            start = mark = gbHistogramClock();
+
+        if ((timers = processTimeEvents(eventLoop)) > 0)
+        {
+            now = gbHistogramClock();
+            time_ns = now - mark;
+            mark = now;
+            gbHistogramAdd(&eventLoop->time_hist, time_ns);
+        }
+
+        processed += timers;
+    }
+
+    if (processed > 0)
+    {
+        gbHistogramAdd(&eventLoop->busy_hist, mark - start);
+
+        if (eventLoop->lag_threshold && mark - start > eventLoop->lag_threshold)
+        {
+            ++eventLoop->lagged;
+            gbLog( WARNING, "Event loop blocked for %llums, %llums in file events and %llums in time events.",
+                   (unsigned long long)( mark - start ) / 1000000, (unsigned long long)file_ns / 1000000, (unsigned long long)time_ns / 1000000 );
+        }
+    }
 
     return processed; /* return the number of processed file/time events */
 }
@@ -691,6 +856,23 @@ static int gbNetSetTcpNoDelay(char *err, int fd, int val)
     return GBNET_OK;
 }
 
+/* Only wake up the listening socket once the client sent some data, so the
+ * first request can be read right after the connection is accepted. */
+int gbNetDeferAccept(char *err, int fd, int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1)
+    {
+        gbNetSetError(err, "setsockopt TCP_DEFER_ACCEPT: %s", strerror(errno));
+        return GBNET_ERR;
+    }
+    return GBNET_OK;
+#else
+    gbNetSetError(err, "TCP_DEFER_ACCEPT not supported on this system");
+    return GBNET_ERR;
+#endif
+}
+
 int gbNetEnableTcpNoDelay(char *err, int fd)
 {
     return gbNetSetTcpNoDelay(err, fd, 1);
@@ -888,7 +1070,7 @@ int gbNetWrite(int fd, char *buf, int count)
     return totlen;
 }
 
-static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len)
+static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len, int backlog)
 {
     assert( sa != NULL );
 
@@ -899,10 +1081,9 @@ static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len)
         return GBNET_ERR;
     }
 
-    /* Use a backlog of 512 entries. We pass 511 to the listen() call because
-     * the kernel does: backlogsize = roundup_pow_of_two(backlogsize + 1);
-     * which will thus give us a backlog of 512 entries */
-    if (listen(s, 511) == -1)
+    /* Note that the kernel silently caps the backlog to the value of
+     * net.core.somaxconn ( kern.ipc.somaxconn on BSD systems ). */
+    if (listen(s, backlog) == -1)
     {
         gbNetSetError(err, "listen: %s", strerror(errno));
         close(s);
@@ -911,7 +1092,7 @@ static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len)
     return GBNET_OK;
 }
 
-int gbNetTcpServer(char *err, int port, char *bindaddr)
+int gbNetTcpServer(char *err, int port, char *bindaddr, int backlog)
 {
     assert( bindaddr != NULL );
 
@@ -931,12 +1112,12 @@ int gbNetTcpServer(char *err, int port, char *bindaddr)
         close(s);
         return GBNET_ERR;
     }
-    if (gbNetListen(err,s,(struct sockaddr*)&sa,sizeof(sa)) == GBNET_ERR)
+    if (gbNetListen(err,s,(struct sockaddr*)&sa,sizeof(sa),backlog) == GBNET_ERR)
         return GBNET_ERR;
     return s;
 }
 
-int gbNetUnixServer(char *err, char *path, mode_t perm)
+int gbNetUnixServer(char *err, char *path, mode_t perm, int backlog)
 {
     assert( path != NULL );
 
@@ -949,7 +1130,7 @@ int gbNetUnixServer(char *err, char *path, mode_t perm)
     memset(&sa,0,sizeof(sa));
     sa.sun_family = AF_LOCAL;
     strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
-    if (gbNetListen(err,s,(struct sockaddr*)&sa,sizeof(sa)) == GBNET_ERR)
+    if (gbNetListen(err,s,(struct sockaddr*)&sa,sizeof(sa),backlog) == GBNET_ERR)
         return GBNET_ERR;
 
     if (perm){
@@ -971,7 +1152,11 @@ static int gbNetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *
     int fd;
     while(1)
     {
+#ifdef HAVE_ACCEPT4
+        fd = accept4(s,sa,len,SOCK_NONBLOCK);
+#else
         fd = accept(s,sa,len);
+#endif
         if (fd == -1)
         {
             if (errno == EINTR)
@@ -984,6 +1169,14 @@ static int gbNetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *
         }
         break;
     }
+
+#ifndef HAVE_ACCEPT4
+    if (gbNetNonBlock(err,fd) == GBNET_ERR)
+    {
+        close(fd);
+        return GBNET_ERR;
+    }
+#endif
     return fd;
 }
 
@@ -1079,24 +1272,116 @@ void gbServerFormatUptime( gbServer *server, char *s )
     sprintf( s, "%dd %dh %dm %ds", days, hours, minutes, seconds );
 }
 
+static void gbClientIdleLink( gbClient *client )
+{
+    gbServer *server = client->server;
+    gbClient **slot = &server->idle_wheel[ client->seen % server->idle_slots ];
+
+    client->idle_prev = NULL;
+    client->idle_next = *slot;
+    if( *slot != NULL )
+        (*slot)->idle_prev = client;
+    *slot = client;
+}
+
+static void gbClientIdleUnlink( gbClient *client )
+{
+    gbServer *server = client->server;
+
+    if( client->idle_prev != NULL )
+        client->idle_prev->idle_next = client->idle_next;
+    else
+        server->idle_wheel[ client->seen % server->idle_slots ] = client->idle_next;
+
+    if( client->idle_next != NULL )
+        client->idle_next->idle_prev = client->idle_prev;
+
+    client->idle_prev = client->idle_next = NULL;
+}
+
+// disconnect clients not seen in the last max_idletime seconds, every
+// second of the idle wheel is swept only once so the cost is O(1) per
+// client activity plus the number of clients actually reaped.
+unsigned long gbServerReapIdleClients( gbServer *server )
+{
+    assert( server != NULL );
+
+    gbClient *client = NULL, *next = NULL;
+    time_t expired = server->stats.time - server->limits.maxidletime;
+    unsigned long reaped = 0;
+    unsigned int swept = 0;
+
+    if( server->idle_wheel == NULL )
+        return 0;
+
+    for( ; server->idle_sweep < expired && swept < server->idle_slots; ++server->idle_sweep, ++swept )
+    {
+        for( client = server->idle_wheel[ server->idle_sweep % server->idle_slots ]; client; client = next )
+        {
+            next = client->idle_next;
+
+            // slots are shared by seconds 'idle_slots' apart
+            if( client->seen < expired )
+            {
+                gbLog( DEBUG, "Client %d idle since %lds, disconnecting.", client->fd, server->stats.time - client->seen );
+
+                ++reaped;
+                server->stats.reaped_memory += sizeof(gbClient) + client->input_size + client->pending;
+
+                gbClientDestroy( client );
+            }
+        }
+    }
+
+    // the whole wheel was swept, nothing idle is left behind
+    if( server->idle_sweep < expired )
+        server->idle_sweep = expired;
+
+    server->stats.reaped_clients += reaped;
+
+    return reaped;
+}
+
 gbClient* gbClientCreate( int fd, gbServer *server  )
 {
     assert( server != NULL );
 
-    gbClient *client = (gbClient *)zmalloc( sizeof( gbClient ) );
+    gbClient *client = (gbClient *)opool_alloc_object( &server->client_pool );
 
     assert( client != NULL );
 
     client->fd 			= fd;
+    client->input 		= NULL;
+    client->input_size 	= 0;
+    client->input_len 	= 0;
+    client->input_pos 	= 0;
     client->buffer 		= NULL;
     client->buffer_size = 0;
-    client->status		= STATUS_WAITING_SIZE;
-    client->read 		= 0;
-    client->wrote 		= 0;
+    client->corked 		= 0;
+    client->replies 	= NULL;
+    client->replies_tail = NULL;
+    client->pending 	= 0;
     client->server 		= server;
+    client->listener 	= NULL;
     client->shutdown 	= 0;
-
-    ll_append( server->clients, client );
+    client->proto 		= GB_PROTO_V1;
+    client->tagged 		= 0;
+    client->tag 		= 0;
+    client->shm 		= NULL;
+    client->sending 	= 0;
+    client->send_proc 	= NULL;
+    client->seen 		= server->stats.time;
+    client->idle_prev 	= NULL;
+    client->idle_next 	= NULL;
+
+    if( server->idle_wheel != NULL )
+        gbClientIdleLink( client );
+
+    client->prev = NULL;
+    client->next = server->clients;
+    if( server->clients != NULL )
+        server->clients->prev = client;
+    server->clients = client;
 
     ++server->stats.nclients;
 
@@ -1107,17 +1392,55 @@ void gbClientReset( gbClient *client )
 {
     assert( client != NULL );
 
-    if( client->buffer != NULL )
+    // the request buffer belongs to the input one
+    client->buffer      = NULL;
+    client->buffer_size = 0;
+    client->tagged 		= 0;
+}
+
+void gbClientTouch( gbClient *client )
+{
+    assert( client != NULL );
+
+    gbServer *server = client->server;
+
+    if( client->seen == server->stats.time )
+        return;
+
+    if( server->idle_wheel != NULL )
     {
-        zfree( client->buffer );
+        gbClientIdleUnlink( client );
+        client->seen = server->stats.time;
+        gbClientIdleLink( client );
     }
+    else
+        client->seen = server->stats.time;
+}
 
-    client->buffer      = NULL;
-    client->buffer_size = 0;
-    client->status		= STATUS_WAITING_SIZE;
-    client->read 		= 0;
-    client->wrote 		= 0;
-    client->shutdown 	= 0;
+void gbClientDequeueReply( gbClient *client )
+{
+    assert( client != NULL );
+    assert( client->replies != NULL );
+
+    gbReply *reply = client->replies;
+
+    client->replies  = reply->next;
+    client->pending -= reply->size;
+
+    if( client->replies == NULL )
+        client->replies_tail = NULL;
+
+    zfree( reply );
+}
+
+static void gbClientFree( gbClient *client )
+{
+    while( client->replies != NULL )
+    {
+        gbClientDequeueReply( client );
+    }
+
+    opool_free_object( &client->server->client_pool, client );
 }
 
 void gbClientDestroy( gbClient *client )
@@ -1127,10 +1450,17 @@ void gbClientDestroy( gbClient *client )
 
     gbServer *server = client->server;
 
-    if( client->buffer != NULL )
+    if( client->input != NULL )
     {
-        zfree( client->buffer );
-        client->buffer = NULL;
+        zfree( client->input );
+        client->input = NULL;
+    }
+
+    if( client->shm != NULL )
+    {
+        gbDeleteFileEvent( server->events, client->shm->server_efd, GB_READABLE );
+        gbShmDestroy( client->shm );
+        client->shm = NULL;
     }
 
     if (client->fd != -1)
@@ -1139,69 +1469,420 @@ void gbClientDestroy( gbClient *client )
 
         gbDeleteFileEvent( server->events, client->fd, GB_READABLE );
         gbDeleteFileEvent( server->events, client->fd, GB_WRITABLE );
+        gbEventLoopDetachStream( server->events, client->fd );
+
+        // the event loop is still sending, make it give up right away
+        if( client->sending )
+            shutdown( client->fd, SHUT_RDWR );
+
         close(client->fd);
+        client->fd = -1;
     }
 
-    ll_item_t *item = NULL;
-    for( item = server->clients->head; item; item = item->next )
+    if( server->idle_wheel != NULL )
+        gbClientIdleUnlink( client );
+
+    if( client->prev != NULL )
+        client->prev->next = client->next;
+    else
+        server->clients = client->next;
+
+    if( client->next != NULL )
+        client->next->prev = client->prev;
+
+    if( client->listener != NULL )
+        --client->listener->nclients;
+
+    --server->stats.nclients;
+
+    // the replies being sent are freed with the client once the event loop is done
+    if( client->sending == 0 )
+        gbClientFree( client );
+}
+
+// copy queued replies into the shared memory ring, if it gets full the
+// client wakes us up once it made some room
+static int gbClientSendShmReplies( gbClient *client )
+{
+    gbShmHeader *h = client->shm->header;
+    gbReply *reply = NULL;
+    size_t nwrote = 0, used = 0;
+
+    while( ( reply = client->replies ) != NULL )
+    {
+        size_t n = gbShmWriteReplies( client->shm, reply->data + reply->wrote, reply->size - reply->wrote );
+
+        if( n == GB_SHM_CORRUPTED )
+            goto corrupted;
+
+        nwrote       += n;
+        reply->wrote += n;
+
+        if( reply->wrote < reply->size )
+            break;
+        // the shutdown one is kept so the caller knows
+        else if( reply->shutdown )
+            break;
+
+        gbClientDequeueReply( client );
+    }
+
+    if( client->replies != NULL && !gbClientShutdownSent( client ) )
+    {
+        gbShmSetWaiting( &h->replies.producer_waiting, 1 );
+
+        // the client could have consumed everything before seeing the flag
+        if( ( used = gbShmRepliesUsed( client->shm ) ) == GB_SHM_CORRUPTED )
+            goto corrupted;
+        else if( used < client->shm->ring_size )
+            return gbClientSendShmReplies( client );
+    }
+
+    if( nwrote > 0 )
+    {
+        gbClientTouch( client );
+        gbShmNotify( client->shm );
+    }
+
+    return GB_OK;
+
+corrupted:
+
+    gbLog( WARNING, "Client corrupted the shared memory replies ring." );
+
+    return GB_ERR;
+}
+
+// release completely sent replies, the shutdown one is kept so the caller knows
+static void gbClientReleaseReplies( gbClient *client, size_t nwrote )
+{
+    gbReply *reply = NULL;
+    size_t left;
+
+    for( left = nwrote; left > 0; )
     {
-        if( ll_data( gbClient *, item ) == client )
+        reply = client->replies;
+
+        assert( reply != NULL );
+
+        if( left < reply->size - reply->wrote || reply->shutdown )
         {
-            // do not free the list item itself
-            item->data            = NULL;
-            server->clients->free = item;
+            reply->wrote += left;
             break;
         }
+
+        left -= reply->size - reply->wrote;
+
+        gbClientDequeueReply( client );
+    }
+}
+
+// the event loop sent the replies, 'res' is what sendmsg returned or -errno
+static void gbClientSendDone( gbEventLoop *el, int fd, void *privdata, ssize_t res )
+{
+    gbClient *client = privdata;
+
+    client->sending = 0;
+
+    // destroyed while its replies were being sent
+    if( client->fd == -1 )
+    {
+        gbClientFree( client );
+        return;
     }
 
-    --server->stats.nclients;
+    if( res < 0 )
+    {
+        gbLog( DEBUG, "Error writing to client: %s", strerror(-res) );
+        gbClientDestroy( client );
+        return;
+    }
 
-    zfree( client );
+    gbClientTouch( client );
+    gbClientReleaseReplies( client, res );
+
+    // just like the socket became writable, the rest is sent and reading resumes
+    client->send_proc( el, fd, client, GB_WRITABLE );
 }
 
-int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown )
+// point 'iov' to what is left to send of the queued replies, up to 'max' bytes,
+// returns how many
+static int gbClientRepliesIov( gbClient *client, struct iovec *iov, size_t max )
+{
+    gbReply *reply = NULL;
+    int niov = 0;
+
+    for( reply = client->replies; reply && niov < GB_REPLY_IOV_MAX && max > 0; reply = reply->next, ++niov )
+    {
+        iov[niov].iov_base = reply->data + reply->wrote;
+        iov[niov].iov_len  = reply->size - reply->wrote;
+        if( iov[niov].iov_len > max )
+            iov[niov].iov_len = max;
+
+        max -= iov[niov].iov_len;
+    }
+
+    return niov;
+}
+
+int gbClientSendReplies( gbClient *client )
 {
     assert( client != NULL );
-    assert( reply != NULL );
-    assert( size > 0 );
 
-    if( client->fd <= 0 ) return GB_ERR;
+    struct iovec iov[GB_REPLY_IOV_MAX];
+    ssize_t nwrote;
+    int niov = 0;
+
+    if( gbClientShutdownSent( client ) )
+        return GB_OK;
+
+    if( client->shm != NULL )
+        return gbClientSendShmReplies( client );
+
+    // the event loop is sending, the rest goes once it's done
+    if( client->sending )
+        return GB_OK;
+
+    // send as many queued replies as possible with a single syscall
+    if( ( niov = gbClientRepliesIov( client, iov, SIZE_MAX ) ) == 0 )
+        return GB_OK;
+
+    nwrote = writev( client->fd, iov, niov );
+    if( nwrote == -1 && errno != EAGAIN )
+        return GB_ERR;
+    else if( nwrote > 0 )
+    {
+        gbClientTouch( client );
+        gbClientReleaseReplies( client, nwrote );
+    }
+
+    // the socket is full, completion based event loops send the rest as soon
+    // as there's room and call send_proc, the others wait for it to be writable
+    if( client->send_proc != NULL && !gbClientShutdownSent( client ) && ( niov = gbClientRepliesIov( client, iov, GB_REPLY_SEND_MAX ) ) > 0 &&
+        gbEventLoopSend( client->server->events, client->fd, iov, niov, gbClientSendDone, client ) == GB_OK )
+        client->sending = niov;
+
+    return GB_OK;
+}
+
+// try to write the queued replies right away, wait for the socket to be
+// writable only if something is left
+int gbClientFlushReplies( gbClient *client, gbFileProc *proc )
+{
+    gbServer *server = client->server;
+
+    // more requests are being processed, replies will be sent together
+    if( client->corked )
+        return GB_OK;
+
+    // replies that don't fit the ring are sent when the client wakes us up
+    if( client->shm != NULL && client->shutdown == 0 )
+        return gbClientSendReplies( client );
+
+    // the socket is already full or the event loop is sending, keep queueing
+    if( client->sending || gbGetFileEvents( server->events, client->fd ) & GB_WRITABLE )
+        return GB_OK;
+
+    client->send_proc = proc;
+
+    // the client can't be destroyed while its request is being processed, so
+    // shutdown replies and write errors are left to the writable handler
+    if( client->shutdown == 0 && gbClientSendReplies( client ) == GB_OK && client->replies == NULL )
+        return GB_OK;
+
+    ++server->stats.deferred_writes;
+
+    // the event loop sends the rest on its own
+    if( client->sending )
+        return GB_OK;
+
+    return gbCreateFileEvent( server->events, client->fd, GB_WRITABLE, proc, client );
+}
+
+// send the first queued reply right away with 'fds' attached, used to hand
+// over the shared memory transport, nothing else must be queued before it
+int gbClientSendFds( gbClient *client, int *fds, int nfds )
+{
+    assert( client != NULL );
+    assert( client->replies != NULL );
+    assert( nfds > 0 && nfds <= 4 );
+
+    gbReply *reply = client->replies;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+
+    memset( &msg, 0x00, sizeof(msg) );
+    memset( control, 0x00, sizeof(control) );
+
+    iov.iov_base = reply->data;
+    iov.iov_len  = reply->size;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+
+    memcpy( CMSG_DATA(cmsg), fds, sizeof(int) * nfds );
+
+    // the socket is empty, a few bytes reply can't be partially sent
+    if( sendmsg( client->fd, &msg, 0 ) != reply->size )
+        return GB_ERR;
+
+    gbClientDequeueReply( client );
+
+    return GB_OK;
+}
+
+// queue the reply, tagged small replies go before the first bigger reply
+// that is not being sent yet, everything else keeps the requests order
+static void gbClientQueueReply( gbClient *client, gbReply *reply )
+{
+    gbReply *prev = NULL, *next = client->replies;
+    int i;
+
+    if( reply->tagged && reply->size <= GB_REPLY_SMALL_SIZE )
+    {
+        // the event loop is sending these ones
+        for( i = 0; next && i < client->sending; ++i )
+        {
+            prev = next;
+            next = next->next;
+        }
+
+        while( next && ( next->wrote > 0 || next->size <= GB_REPLY_SMALL_SIZE ) )
+        {
+            prev = next;
+            next = next->next;
+        }
+    }
+    else
+    {
+        prev = client->replies_tail;
+        next = NULL;
+    }
+
+    reply->next = next;
+
+    if( prev )
+        prev->next = reply;
+    else
+        client->replies = reply;
+
+    if( next == NULL )
+        client->replies_tail = reply;
+
+    client->pending += reply->size;
+}
+
+// unlink a reply that was queued but not sent yet and free it
+static void gbClientCancelReply( gbClient *client, gbReply *reply )
+{
+    gbReply *prev = NULL, *next = client->replies;
+
+    assert( reply->wrote == 0 );
+
+    while( next && next != reply )
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    assert( next == reply );
+
+    if( prev )
+        prev->next = reply->next;
+    else
+        client->replies = reply->next;
+
+    if( client->replies_tail == reply )
+        client->replies_tail = prev;
+
+    client->pending -= reply->size;
+
+    zfree( reply );
+}
+
+// allocate and queue a reply of 'size' bytes, write the reply header and
+// return the pointer where the reply data has to be written, the reply
+// itself is stored in 'reserved' if given so it can be cancelled
+static byte_t *gbClientReserveReply( gbClient *client, short code, gbItemEncoding encoding, uint32_t size, short shutdown, gbReply **reserved )
+{
+    assert( client != NULL );
+    assert( size > 0 );
 
     uint32_t rsize = sizeof( short )  + // reply opcode
+        ( client->tagged ? sizeof( uint32_t ) : 0 ) + // request tag
         sizeof( gbItemEncoding ) +      // data type
         sizeof( uint32_t ) + 	        // data length
         size;			  		        // data
 
-    // realloc only if needed
-    if( rsize > client->buffer_size )
+    gbReply *reply = (gbReply *)zmalloc( sizeof( gbReply ) + rsize );
+    byte_t  *p = reply->data;
+
+    assert( reply != NULL );
+
+    reply->size     = rsize;
+    reply->wrote    = 0;
+    reply->shutdown = shutdown;
+    reply->tagged   = client->tagged;
+
+    client->reply_code = code;
+    client->reply_size = rsize;
+
+    if( client->tagged )
+        code |= REPL_TAGGED;
+
+    memcpy( p, memrev16ifbe(&code), sizeof( short ) );
+    p += sizeof( short );
+
+    // the tag is echoed exactly as the client sent it
+    if( client->tagged )
     {
-        client->buffer = (byte_t *)zrealloc( client->buffer, rsize );
+        memcpy( p, &client->tag, sizeof( uint32_t ) );
+        p += sizeof( uint32_t );
     }
 
-    assert( client->buffer != NULL );
+    memcpy( p, &encoding, sizeof( gbItemEncoding ) );
+    p += sizeof( gbItemEncoding );
 
-    client->buffer_size = rsize;
-    client->read  		= 0;
-    client->wrote 		= 0;
-    client->shutdown 	= shutdown;
+    memcpy( p, memrev32ifbe(&size), sizeof( uint32_t ) );
+    p += sizeof( uint32_t );
 
-    memcpy( client->buffer,
-            memrev16ifbe(&code),
-            sizeof( short ) );
+    gbClientQueueReply( client, reply );
 
-    memcpy( client->buffer + sizeof( short ),
-            &encoding,
-            sizeof( gbItemEncoding ) );
+    if( reserved )
+        *reserved = reply;
 
-    memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ),
-            memrev32ifbe(&size),
-            sizeof( uint32_t ) );
+    // no more requests will be processed for this client
+    if( shutdown )
+    {
+        client->shutdown = 1;
+        gbDeleteFileEvent( client->server->events, client->fd, GB_READABLE );
+    }
 
-    memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ) + sizeof( uint32_t ),
-            reply,
-            size );
+    return p;
+}
 
-    return gbCreateFileEvent( client->server->events, client->fd, GB_WRITABLE, proc, client );
+int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown )
+{
+    assert( client != NULL );
+    assert( reply != NULL );
+    assert( size > 0 );
+
+    if( client->fd <= 0 ) return GB_ERR;
+
+    byte_t *p = gbClientReserveReply( client, code, encoding, size, shutdown, NULL );
+
+    memcpy( p, reply, size );
+
+    return gbClientFlushReplies( client, proc );
 }
 
 int gbClientEnqueueCode( gbClient *client, short code, gbFileProc proc, short shutdown )
@@ -1226,17 +1907,30 @@ int gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc
     }
     else if( item->encoding == GB_ENC_LZF )
     {
+        if( client->fd <= 0 ) return GB_ERR;
+
+        uint32_t plainsize = gbItemLzfPlainSize(item);
+        gbReply *reply = NULL;
+        // decompress straight into the reply buffer
+        byte_t *p = gbClientReserveReply( client, code, GB_ENC_PLAIN, plainsize, shutdown, &reply );
         size_t declen = lzf_decompress
         (
-            item->data,
-            item->size,
-            client->server->lzf_buffer,
-            client->server->limits.maxrequestsize
+            gbItemLzfStream(item),
+            gbItemLzfStreamSize(item),
+            p,
+            plainsize
         );
 
-        assert( declen > item->size );
+        if( declen != plainsize )
+        {
+            gbLog( ERROR, "Could not decompress item, %zu bytes out of %u.", declen, plainsize );
+
+            gbClientCancelReply( client, reply );
+
+            return gbClientEnqueueCode( client, REPL_ERR, proc, shutdown );
+        }
 
-        return gbClientEnqueueData( client, code, GB_ENC_PLAIN, client->server->lzf_buffer, declen, proc, shutdown );
+        return gbClientFlushReplies( client, proc );
     }
     else if( item->encoding == GB_ENC_NUMBER )
     {
@@ -1258,30 +1952,48 @@ int gbClientEnqueueKeyValueSet( gbClient *client, uint32_t elements, gbFileProc
     assert( client != NULL );
     assert( client->server != NULL );
     assert( elements > 0 );
-    assert( client->server->m_buffer != NULL );
 
     gbServer *server = client->server;
     gbItem *item = NULL;
-    uint32_t sz = sizeof(uint32_t),
+    uint32_t sz = 0,
              vsize = 0,
-             space = server->limits.maxresponsesize;
-    byte_t *data = server->m_buffer,
-           *p = data,
-           *v = NULL;
+             total = sizeof(uint32_t);
+    byte_t *p = NULL,
+           *v = NULL,
+           *data = NULL;
+    gbReply *reply = NULL;
     gbItemEncoding encoding;
     long num;
 
-#define CHECK_SPACE(needed) if( needed > space ) \
-    { \
-        gbLog( WARNING, "Max response size reached, asked for %u more bytes.", needed ); \
-            return GBNET_ERR; \
+    if( client->fd <= 0 ) return GB_ERR;
+
+    // first pass, compute the size of the response so the reply buffer
+    // is allocated only once and values are written straight into it
+    ll_foreach_2( server->engine.m_keys, server->engine.m_values, sk, sv )
+    {
+        // handle expired/nulled items
+        if( sv->data != NULL )
+        {
+            item  = sv->data;
+            vsize = item->encoding == GB_ENC_LZF ? gbItemLzfPlainSize(item) : item->size;
+
+            total += sizeof(uint32_t) + gbEngineResultKeySize( sk->data ) + sizeof(gbItemEncoding) + sizeof(uint32_t) + vsize;
+        }
     }
 
-#define SAFE_MEMCPY( p, data, size ) CHECK_SPACE(size); memcpy( p, data, size ); p += size; space -= size
+    if( total > server->limits.maxresponsesize )
+    {
+        gbLog( WARNING, "Max response size reached, asked for %u bytes.", total );
+        return GBNET_ERR;
+    }
+
+#define WRITE_DATA( p, data, size ) memcpy( p, data, size ); p += size
 
-    SAFE_MEMCPY( p, memrev32ifbe(&elements), sz );
+    p = data = gbClientReserveReply( client, REPL_KVAL, GB_ENC_PLAIN, total, shutdown, &reply );
 
-    ll_foreach_2( server->m_keys, server->m_values, ki, vi )
+    WRITE_DATA( p, memrev32ifbe(&elements), sizeof(uint32_t) );
+
+    ll_foreach_2( server->engine.m_keys, server->engine.m_values, ki, vi )
     {
         // handle expired/nulled items
         if( vi->data != NULL )
@@ -1290,33 +2002,50 @@ int gbClientEnqueueKeyValueSet( gbClient *client, uint32_t elements, gbFileProc
             encoding = item->encoding;
 
             // write key size + key
-            sz = strlen( ki->data );
+            sz = gbEngineResultKeySize( ki->data );
 
             assert( sz > 0 );
 
-            SAFE_MEMCPY( p, memrev32ifbe(&sz), sizeof(uint32_t) );
-            SAFE_MEMCPY( p, ki->data, sz );
+            WRITE_DATA( p, memrev32ifbe(&sz), sizeof(uint32_t) );
+            WRITE_DATA( p, ki->data, sz );
 
             // write value size + value
-            if( encoding == GB_ENC_PLAIN )
-            {
-                vsize = item->size;
-                v	  = item->data;
-            }
-            else if( encoding == GB_ENC_LZF )
+            if( encoding == GB_ENC_LZF )
             {
                 encoding = GB_ENC_PLAIN;
-                vsize = lzf_decompress
+                vsize    =
+                sz       = gbItemLzfPlainSize(item);
+
+                WRITE_DATA( p, &encoding,         sizeof( gbItemEncoding ) );
+                WRITE_DATA( p, memrev32ifbe(&sz), sizeof( uint32_t ) );
+
+                // decompress straight into the reply buffer
+                sz = lzf_decompress
                     (
-                     item->data,
-                     item->size,
-                     client->server->lzf_buffer,
-                     client->server->limits.maxrequestsize
+                     gbItemLzfStream(item),
+                     gbItemLzfStreamSize(item),
+                     p,
+                     vsize
                     );
 
-                v = server->lzf_buffer;
+                if( sz != vsize )
+                {
+                    gbLog( ERROR, "Could not decompress item, %u bytes out of %u.", sz, vsize );
+
+                    gbClientCancelReply( client, reply );
+
+                    return gbClientEnqueueCode( client, REPL_ERR, proc, shutdown );
+                }
+
+                p += vsize;
+                continue;
+            }
+            else if( encoding == GB_ENC_PLAIN )
+            {
+                vsize = item->size;
+                v	  = item->data;
             }
-            else if( item->encoding == GB_ENC_NUMBER )
+            else if( encoding == GB_ENC_NUMBER )
             {
                 num = (long)item->data;
 #if __x86_64__ || __ppc64__
@@ -1330,13 +2059,15 @@ int gbClientEnqueueKeyValueSet( gbClient *client, uint32_t elements, gbFileProc
             assert( v != NULL );
             assert( vsize > 0 );
 
-            SAFE_MEMCPY( p, &encoding,            sizeof( gbItemEncoding ) );
-            SAFE_MEMCPY( p, memrev32ifbe(&vsize), sizeof( uint32_t ) );
-            SAFE_MEMCPY( p, v, 		              vsize );
+            WRITE_DATA( p, &encoding,            sizeof( gbItemEncoding ) );
+            WRITE_DATA( p, memrev32ifbe(&vsize), sizeof( uint32_t ) );
+            WRITE_DATA( p, v, 		             vsize );
         }
     }
 
-    int ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, data, p - data, proc, shutdown );
+#undef WRITE_DATA
+
+    assert( p == data + total );
 
-    return ret;
+    return gbClientFlushReplies( client, proc );
 }
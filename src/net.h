@@ -36,9 +36,12 @@
 #include <stdint.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "obpool.h"
-#include "trie.h"
-#include "llist.h"
+#include "engine.h"
+#include "shm.h"
+#include "hist.h"
+#include "slowlog.h"
 #include "default.h"
 
 #if defined(__sun)
@@ -66,8 +69,6 @@
 #define GBNET_ERR -1
 #define GBNET_ERR_LEN 256
 
-typedef unsigned char byte_t;
-
 struct gbEventLoop;
 
 /* Types and data structures */
@@ -75,6 +76,7 @@ typedef void gbFileProc(struct gbEventLoop *eventLoop, int fd, void *clientData,
 typedef int  gbTimeProc(struct gbEventLoop *eventLoop, long long id, void *clientData);
 typedef void gbEventFinalizerProc(struct gbEventLoop *eventLoop, void *clientData);
 typedef void gbBeforeSleepProc(struct gbEventLoop *eventLoop);
+typedef void gbSendProc(struct gbEventLoop *eventLoop, int fd, void *clientData, ssize_t res);
 
 /* File event structure */
 typedef struct gbFileEvent
@@ -90,12 +92,13 @@ gbFileEvent;
 typedef struct gbTimeEvent
 {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* deadline, monotonic milliseconds */
+    int index; /* slot inside the event loop timers heap */
+    int running; /* the callback is being executed */
+    int deleted; /* deleted by its own callback */
     gbTimeProc *timeProc;
     gbEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct gbTimeEvent *next;
 }
 gbTimeEvent;
 
@@ -113,13 +116,20 @@ typedef struct gbEventLoop
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    long long now;       /* Cached monotonic clock, in milliseconds */
     gbFileEvent *events; /* Registered events */
     gbFiredEvent *fired; /* Fired events */
-    gbTimeEvent *timeEventHead;
+    gbTimeEvent **timers; /* Time events min-heap, nearest first */
+    int ntimers;
+    int timers_size;
     int stop;
     void *apidata; /* This is used for polling API specific data */
     gbBeforeSleepProc *beforesleep;
+    unsigned long long lag_threshold; /* iterations busy for longer than this many nanoseconds are logged, 0 to disable */
+    unsigned long lagged; /* number of iterations above lag_threshold */
+    gbHistogram busy_hist; /* nanoseconds spent processing events, per iteration */
+    gbHistogram file_hist; /* nanoseconds spent processing file events, per iteration */
+    gbHistogram time_hist; /* nanoseconds spent processing time events, per iteration */
 }
 gbEventLoop;
 
@@ -138,93 +148,127 @@ typedef struct
 	time_t 	 maxidletime;
 	// maximum size of a request
 	size_t	 maxrequestsize;
-	// maximum number of seconds of an item TTL
-	size_t   maxitemttl;
-	// maximum size of an item key
-	unsigned long maxkeysize;
-	// maximum size of an item value
-	unsigned long maxvaluesize;
 	// maximum size of a response
 	unsigned long maxresponsesize;
-	// maximum size of used memory
-	unsigned long maxmem;
 }
 gbServerLimits;
 
+// opcodes are tracked up to this value, OP_END excluded
+#define GB_MAX_OPCODES 32
+// reply error codes tracked for every opcode, from REPL_ERR to REPL_ERR_LOCKED
+#define GB_OP_ERRORS   5
+
+typedef struct
+{
+	// number of requests with this opcode
+	unsigned long calls;
+	// number of error replies, by error code
+	unsigned long errors[GB_OP_ERRORS];
+	// number of malformed requests, the client has been disconnected
+	unsigned long failed;
+	// time spent processing the requests, reply flush included
+	gbHistogram   latency;
+}
+gbOpStats;
+
 typedef struct
 {
 	// time the server was started
 	time_t   started;
 	// server time updated every cron loop
 	time_t 	 time;
-	// time of the first created object
-	time_t   firstin;
-	// time of the last created object
-	time_t	 lastin;
     // total requests received
     unsigned long requests;
     // total connections received
     unsigned long connections;
-	// number total of items stored in the container
-	unsigned int nitems;
-	// number of compressed items
-	unsigned int ncompressed;
+    // replies which could not be written right away and waited for the socket to be writable
+    unsigned long deferred_writes;
+    // number of clients disconnected because idle for more than max_idletime
+    unsigned long reaped_clients;
+    // buffer memory released by disconnecting idle clients
+    unsigned long reaped_memory;
 	// number of currently connected clients
 	unsigned int nclients;
 	// number of cron loops performed
 	unsigned int crondone;
 	// total system available memory
 	unsigned long memavail;
-	// currently used memory
-	unsigned long memused;
-	// maximum memory peak
-	unsigned long mempeak;
-	// average object size
-	double sizeavg;
-    // average compression rate
-    double compravg;
+	// time the per opcode stats were last reset
+	time_t   ops_since;
+	// per opcode stats, indexed by opcode
+	gbOpStats ops[GB_MAX_OPCODES];
+	// duration of the whole cron and of each of its phases, when they run
+	gbHistogram cron_total;
+	gbHistogram cron_expire;
+	gbHistogram cron_reap;
+	gbHistogram cron_gc;
+	gbHistogram cron_log;
 }
 gbServerStats;
 
+// maximum number of listen directives
+#define GB_MAX_LISTENERS 16
+
+typedef struct gbListener
+{
+	// TCP or UNIX
+	gbServerType type;
+	// listening socket
+	int 	 fd;
+	// tcp port, 0 for unix sockets
+	int 	 port;
+	// tcp address or unix socket path
+	char     address[0xFF];
+	// number of accepted connections
+	unsigned long connections;
+	// number of connections dropped because max_clients was reached
+	unsigned long rejected;
+	// number of currently connected clients
+	unsigned int  nclients;
+	// pointer to the main server structure
+	struct gbServer *server;
+}
+gbListener;
+
 typedef struct gbServer
 {
 	// the main event loop structure
 	gbEventLoop *events;
 	// error buffer
 	char 	 error[0xFFFF];
-	// tcp port to use
-	int 	 port;
-	// tcp address or unix socket path to use
-	char     address[0xFF];
-	// TCP or UNIX
-	gbServerType type;
+	// tcp and unix server sockets
+	gbListener listeners[GB_MAX_LISTENERS];
+	// number of listeners in use
+	int 	 nlisteners;
 	// 1 if we're running in daemon mode, otherwise 0
 	byte_t	 daemon;
 	// path of the pidfile
 	const char *pidfile;
-	// the main object container
-	trie_t  tree;
-	// server main file descriptor
-	int 	 fd;
-	// list of currently connected clients
-	llist_t *clients;
+	// the keyspace
+	gbEngine engine;
+	// list of currently connected clients, linked through gbClient prev and next
+	struct gbClient *clients;
+	// gbClient object pool allocator
+	opool_t  client_pool;
 	// period in milliseconds of the cron loop
 	unsigned int cronperiod;
-	// number of milliseconds to check for dead idle clients
-	time_t   idlecron;
-	// data bigger then this is going to be compressed
-	unsigned long compression;
-	// buffer used for lzf (de)compression, alloc'd only once
-	byte_t *lzf_buffer;
-	// static lists used for multi-* operands
-	llist_t *m_keys;
-	llist_t *m_values;
-	// buffer used to send multi get responses
-	byte_t *m_buffer;
-    // gbItem object pool allocator
-    opool_t item_pool;
+	// idle clients timing wheel, every client is linked in the slot of its 'seen' second
+	struct gbClient **idle_wheel;
+	// number of slots of the idle wheel, 0 if idle clients are never disconnected
+	unsigned int idle_slots;
+	// next 'seen' second the idle wheel has to be swept for
+	time_t   idle_sweep;
+	// size of each ring of a shared memory transport
+	uint32_t shm_ring_size;
 	// cron timed event id
 	long long cron_id;
+	// requests slower than the threshold
+	gbSlowLog slowlog;
+	// arguments of the batch request being processed, reused across requests
+	byte_t **batch_args;
+	size_t  *batch_lens;
+	// number of slots allocated for batch arguments
+	size_t   batch_size;
 	// data that is not being accessed in the last 'gc_ratio' seconds get deleted if the server needs memory.
     time_t	 gc_ratio;
     // check for expired items every 'expired_cron' seconds.
@@ -241,60 +285,96 @@ typedef struct gbServer
 }
 gbServer;
 
-#define STATUS_WAITING_SIZE   0x00
-#define STATUS_WAITING_BUFFER 0x01
-#define STATUS_SENDING_REPLY  0x02
+// the idle wheel never has more slots than this, clients sharing a slot are told apart by 'seen'
+#define GB_IDLE_WHEEL_MAX_SLOTS 3600
+
+// tagged replies up to this size can be sent before bigger ones still queued
+#define GB_REPLY_SMALL_SIZE 4096
+// maximum number of queued replies sent with a single writev
+#define GB_REPLY_IOV_MAX    64
+// maximum number of bytes handed to the event loop with a single send, so slow
+// readers are still touched by each completion and not reaped as idle
+#define GB_REPLY_SEND_MAX   262144
+
+typedef struct gbReply
+{
+	// next reply in the client queue
+	struct gbReply *next;
+	// reply size, header included
+	uint32_t size;
+	// number of bytes already sent
+	uint32_t wrote;
+	// disconnect the client once this reply is sent
+	byte_t   shutdown;
+	// the reply is for a tagged request and may be sent out of order
+	byte_t   tagged;
+	// reply header and data
+	byte_t   data[];
+}
+gbReply;
 
 typedef struct gbClient
 {
 	// main client file descriptor
 	int		  fd;
-	// client request/response buffer
+	// input buffer, requests are read ahead and parsed from here
+	byte_t   *input;
+	// input buffer capacity
+	size_t    input_size;
+	// number of bytes read into the input buffer
+	size_t    input_len;
+	// offset of the first byte not parsed yet
+	size_t    input_pos;
+	// request being processed, it points inside the input buffer
 	byte_t   *buffer;
-	// client request/response buffer size
+	// size of the request being processed
 	uint32_t  buffer_size;
-	// number of bytes currently read
-	uint32_t  read;
-	// number of bytes currently wrote
-	uint32_t  wrote;
-	// client read status
-	byte_t	  status;
+	// replies are only queued until the pending requests are processed
+	byte_t    corked;
+	// queue of replies waiting to be sent
+	gbReply  *replies;
+	// last reply of the queue
+	gbReply  *replies_tail;
+	// total size of the queued replies
+	size_t    pending;
 	// last time this client was seen alive
 	time_t    seen;
+	// previous client in the same idle wheel slot
+	struct gbClient *idle_prev;
+	// next client in the same idle wheel slot
+	struct gbClient *idle_next;
 	// pointer to the main server structure
 	gbServer *server;
+	// listener which accepted this client
+	gbListener *listener;
+	// previous connected client
+	struct gbClient *prev;
+	// next connected client
+	struct gbClient *next;
 	// flag to make the client disconnect after the next I/O operation
 	byte_t	  shutdown;
+	// request framing in use, GB_PROTO_V1 or GB_PROTO_V2
+	byte_t	  proto;
+	// the request being processed is tagged, its tag is echoed in the reply
+	byte_t    tagged;
+	// tag of the request being processed
+	uint32_t  tag;
+	// code and size of the last reply queued for this client
+	short     reply_code;
+	uint32_t  reply_size;
+	// number of items matched by the request being processed, set by multi key handlers
+	uint32_t  items;
+	// shared memory transport, NULL if requests and replies go through the socket
+	gbShm    *shm;
+	// number of queued replies the event loop is sending, see gbEventLoopSend
+	int       sending;
+	// writable handler, called once the event loop is done sending
+	gbFileProc *send_proc;
 }
 gbClient;
 
-typedef unsigned char gbItemEncoding;
-
-// the item is in plain encoding and data points to its buffer
-#define	GB_ENC_PLAIN  0x00
-// PLAIN but compressed data with lzf
-#define GB_ENC_LZF    0x01
-// the item contains a number and data pointer is actually that number
-#define GB_ENC_NUMBER 0x02
-
-typedef struct
-{
-	// the item buffer
-	void  		  *data;
-	// the item buffer size
-	uint32_t 	   size;
-	// the item encoding
-	gbItemEncoding encoding;
-	// time the item was last accessed
-	time_t	       last_access_time;
-	// time the item was created
-	time_t		   time;
-	// TTL of this item
-	short		   ttl;
-	// flag to lock the item
-	time_t		   lock;
-}
-__attribute__((packed)) gbItem;
+// true once the reply which closes the connection has been completely sent
+#define gbClientShutdownSent( c ) ( (c)->replies && (c)->replies->shutdown && (c)->replies->wrote == (c)->replies->size )
 
 gbEventLoop *gbCreateEventLoop(int setsize);
 void gbDeleteEventLoop(gbEventLoop *eventLoop);
@@ -302,8 +382,13 @@ void gbStopEventLoop(gbEventLoop *eventLoop);
 int gbCreateFileEvent(gbEventLoop *eventLoop, int fd, int mask,gbFileProc *proc, void *clientData);
 void gbDeleteFileEvent(gbEventLoop *eventLoop, int fd, int mask);
 int gbGetFileEvents(gbEventLoop *eventLoop, int fd);
+void gbEventLoopAttachStream(gbEventLoop *eventLoop, int fd);
+void gbEventLoopDetachStream(gbEventLoop *eventLoop, int fd);
+ssize_t gbEventLoopRecv(gbEventLoop *eventLoop, int fd, void *buf, size_t len);
+int gbEventLoopSend(gbEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt, gbSendProc *proc, void *clientData);
 long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,gbTimeProc *proc, void *clientData,gbEventFinalizerProc *finalizerProc);
 int gbDeleteTimeEvent(gbEventLoop *eventLoop, long long id);
+long long gbEventLoopTime(gbEventLoop *eventLoop);
 int gbProcessEvents(gbEventLoop *eventLoop, int flags);
 int gbWaitEvents(int fd, int mask, long long milliseconds);
 void gbEventLoopMain(gbEventLoop *eventLoop);
@@ -318,8 +403,8 @@ int gbNetUnixConnect(char *err, char *path);
 int gbNetUnixNonBlockConnect(char *err, char *path);
 int gbNetRead(int fd, char *buf, int count);
 int gbNetResolve(char *err, char *host, char *ipbuf);
-int gbNetTcpServer(char *err, int port, char *bindaddr);
-int gbNetUnixServer(char *err, char *path, mode_t perm);
+int gbNetTcpServer(char *err, int port, char *bindaddr, int backlog);
+int gbNetUnixServer(char *err, char *path, mode_t perm, int backlog);
 int gbNetTcpAccept(char *err, int serversock, char *ip, int *port);
 int gbNetUnixAccept(char *err, int serversock);
 int gbNetWrite(int fd, char *buf, int count);
@@ -329,11 +414,18 @@ int gbNetDisableTcpNoDelay(char *err, int fd);
 int gbNetTcpKeepAlive(char *err, int fd);
 int gbNetPeerToString(int fd, char *ip, int *port);
 int gbNetKeepAlive(char *err, int fd, int interval);
+int gbNetDeferAccept(char *err, int fd, int seconds);
 
 void gbServerFormatUptime( gbServer *server, char *s );
+unsigned long gbServerReapIdleClients( gbServer *server );
 
 gbClient *gbClientCreate( int fd, gbServer *server );
 void      gbClientReset( gbClient *client );
+void      gbClientTouch( gbClient *client );
+void      gbClientDequeueReply( gbClient *client );
+int       gbClientSendReplies( gbClient *client );
+int       gbClientFlushReplies( gbClient *client, gbFileProc *proc );
+int       gbClientSendFds( gbClient *client, int *fds, int nfds );
 int 	  gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown );
 int       gbClientEnqueueCode( gbClient *client, short code, gbFileProc, short shutdown );
 int		  gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc *proc, short shutdown );
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "proto.h"
+#include "scan.h"
+#include <assert.h>
+
+#define min(a,b) ( a < b ? a : b )
+
+size_t gbProtoWriteVarint( byte_t *buffer, uint32_t value )
+{
+    assert( buffer != NULL );
+
+    register byte_t *p = buffer;
+
+    while( value >= 0x80 )
+    {
+        *p++ = (byte_t)( value | 0x80 );
+        value >>= 7;
+    }
+
+    *p++ = (byte_t)value;
+
+    return p - buffer;
+}
+
+// read a varint from *p, never going past end.
+static __inline__ int gbProtoReadVarint( byte_t **p, byte_t *end, size_t *value )
+{
+    register byte_t *b = *p;
+    register size_t v = 0;
+    register int shift = 0;
+
+    while( b < end && shift < GB_PROTO_VARINT_MAX * 7 )
+    {
+        v |= (size_t)( *b & 0x7F ) << shift;
+
+        if( ( *b++ & 0x80 ) == 0 )
+        {
+            *p     = b;
+            *value = v;
+
+            return 1;
+        }
+
+        shift += 7;
+    }
+
+    // truncated or too long
+    return 0;
+}
+
+// slice the next v2 argument, checking it is fully contained in the payload.
+static __inline__ int gbProtoNextArg( byte_t **p, byte_t *end, byte_t **arg, size_t *len )
+{
+    if( gbProtoReadVarint( p, end, len ) == 0 || *len > (size_t)( end - *p ) )
+        return 0;
+
+    *arg = *p;
+    *p  += *len;
+
+    return 1;
+}
+
+static int gbParseKeyAndOptionalValueV2( gbEngineLimits *limits, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
+{
+    byte_t *p = buffer, *end = buffer + size;
+
+    if( gbProtoNextArg( &p, end, key, klen ) == 0 || *klen == 0 || *klen > limits->maxkeysize )
+        return 0;
+
+    if( value )
+    {
+        assert( vlen != NULL );
+
+        *value = NULL;
+        *vlen  = 0;
+
+        // the value is there only if something is left
+        if( p < end && ( gbProtoNextArg( &p, end, value, vlen ) == 0 || *vlen == 0 || *vlen > limits->maxvaluesize ) )
+            return 0;
+    }
+
+    return 1;
+}
+
+static int gbParseKeyValueV2( gbEngineLimits *limits, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
+{
+    byte_t *p = buffer, *end = buffer + size;
+
+    if( gbProtoNextArg( &p, end, key, klen ) == 0 || *klen == 0 || *klen > limits->maxkeysize )
+        return 0;
+
+    if( value )
+    {
+        assert( vlen != NULL );
+
+        if( gbProtoNextArg( &p, end, value, vlen ) == 0 || *vlen == 0 || *vlen > limits->maxvaluesize )
+            return 0;
+    }
+
+    return 1;
+}
+
+static int gbParseTtlKeyValueV2( gbEngineLimits *limits, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen )
+{
+    byte_t *p = buffer, *end = buffer + size;
+
+    if( gbProtoNextArg( &p, end, ttl, ttllen ) == 0 || *ttllen == 0 )
+        return 0;
+
+    return gbParseKeyValueV2( limits, p, end - p, key, value, klen, vlen );
+}
+
+int gbParseKeyAndOptionalValue( gbClient *client, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
+{
+    assert( client != NULL );
+    assert( buffer != NULL );
+    assert( klen != NULL );
+    assert( key != NULL );
+
+    gbServer *server = client->server;
+
+    if( client->proto == GB_PROTO_V2 )
+        return gbParseKeyAndOptionalValueV2( &server->engine.limits, buffer, size, key, value, klen, vlen );
+
+    register byte_t *p = buffer;
+
+    // parse the key, the end data is the minimum among total request size and maxkeysize
+    *key  = p;
+    *klen = gbScanDelimiter( p, min( size, server->engine.limits.maxkeysize ), ' ' );
+    p    += *klen + 1;
+
+    // if the value should be optionally parsed ...
+    if( value )
+    {
+        assert( vlen != NULL );
+
+        size_t left = size - *klen;
+
+        if( left > 0 )
+        {
+            *value = p;
+            *vlen  = left - 1; // white space
+
+            *vlen  = min( *vlen, server->engine.limits.maxvaluesize );
+        }
+        else
+        {
+            *value = NULL;
+            *vlen  = 0;
+        }
+    }
+
+    // check if length conditions are verified
+    if( *klen <= 0 )
+        return 0;
+
+    else if( value && *value && *vlen <= 0 )
+        return 0;
+
+    else
+        return 1;
+}
+
+int gbParseKeyValue( gbClient *client, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
+{
+    assert( client != NULL );
+    assert( buffer != NULL );
+    assert( klen != NULL );
+    assert( key != NULL );
+
+    gbServer *server = client->server;
+
+    if( client->proto == GB_PROTO_V2 )
+        return gbParseKeyValueV2( &server->engine.limits, buffer, size, key, value, klen, vlen );
+
+    register byte_t *p = buffer;
+
+    // parse the key, the end data is the minimum among total request size and maxkeysize
+    *key  = p;
+    *klen = gbScanDelimiter( p, min( size, server->engine.limits.maxkeysize ), ' ' );
+    p    += *klen + 1;
+
+    // if the value should be parsed ...
+    if( value )
+    {
+        assert( vlen != NULL );
+
+        *value = p;
+        *vlen  = size > *klen + 1 ? size - *klen - 1 : 0;
+        *vlen  = min( *vlen, server->engine.limits.maxvaluesize );
+    }
+
+    // check if length conditions are verified
+    if( *klen <= 0 )
+        return 0;
+
+    else if( value && *value && *vlen <= 0 )
+        return 0;
+
+    else
+        return 1;
+}
+
+int gbParseTtlKeyValue( gbClient *client, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen )
+{
+    assert( client != NULL );
+    assert( buffer != NULL );
+    assert( size > 0 );
+    assert( klen != NULL );
+    assert( key != NULL );
+
+    gbServer *server = client->server;
+
+    if( client->proto == GB_PROTO_V2 )
+        return gbParseTtlKeyValueV2( &server->engine.limits, buffer, size, ttl, key, value, ttllen, klen, vlen );
+
+    register byte_t *p = buffer;
+    register size_t end;
+
+    // parse the ttl value
+    *ttl    = p;
+    end     = min( size, server->engine.limits.maxkeysize );
+    *ttllen = gbScanDelimiter( p, end, ' ' );
+    p      += *ttllen + 1;
+
+    // parse the key, ttl and key together can't exceed the end boundary
+    *key  = p;
+    *klen = end > *ttllen + 1 ? gbScanDelimiter( p, end - *ttllen - 1, ' ' ) : 0;
+    p    += *klen + 1;
+
+    // finally parse the value if needed
+    if( value )
+    {
+        assert( vlen != NULL );
+
+        *value = p;
+        *vlen  = size > *ttllen + *klen + 2 ? size - *ttllen - *klen - 2 : 0;
+        *vlen  = min( *vlen, server->engine.limits.maxvaluesize );
+    }
+
+    // check length conditions
+    if( *ttllen <= 0 )
+        return 0;
+
+    else if( *klen <= 0 )
+        return 0;
+
+    else if( value && *value && *vlen <= 0 )
+        return 0;
+
+    else
+        return 1;
+}
+
+int gbParseNextArg( gbClient *client, byte_t **buffer, size_t *size, byte_t **arg, size_t *arglen, size_t maxlen )
+{
+    assert( client != NULL );
+    assert( buffer != NULL );
+    assert( size != NULL );
+    assert( arg != NULL );
+    assert( arglen != NULL );
+
+    byte_t *p = *buffer, *end = *buffer + *size;
+
+    if( client->proto == GB_PROTO_V2 )
+    {
+        if( gbProtoNextArg( &p, end, arg, arglen ) == 0 )
+            return 0;
+    }
+    else
+    {
+        *arg    = p;
+        *arglen = gbScanDelimiter( p, *size, ' ' );
+        p      += *arglen;
+
+        // skip the separator
+        if( p < end )
+            ++p;
+    }
+
+    if( *arglen == 0 || *arglen > maxlen )
+        return 0;
+
+    *buffer = p;
+    *size   = end - p;
+
+    return 1;
+}
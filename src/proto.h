@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include "net.h"
+
+/*
+ * Request payload framings, the 4 bytes size and 2 bytes opcode header
+ * is the same for both of them.
+ *
+ * v1 : arguments are separated by a single space and the last one takes
+ *      whatever is left of the payload, so keys can't contain spaces.
+ * v2 : every argument is prefixed by its length encoded as an unsigned
+ *      LEB128 varint, arguments are sliced without scanning the payload.
+ *
+ * Every connection starts with v1, clients switch with OP_PROTO.
+ */
+#define GB_PROTO_V1  1
+#define GB_PROTO_V2  2
+#define GB_PROTO_MAX GB_PROTO_V2
+
+// maximum number of bytes of a varint encoded argument size
+#define GB_PROTO_VARINT_MAX 5
+
+int gbParseKeyValue( gbClient *client, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen );
+int gbParseKeyAndOptionalValue( gbClient *client, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen );
+int gbParseTtlKeyValue( gbClient *client, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen );
+// slice the next argument of a variable length request and move buffer and size past it,
+// arguments that are empty or longer than maxlen are rejected.
+int gbParseNextArg( gbClient *client, byte_t **buffer, size_t *size, byte_t **arg, size_t *arglen, size_t maxlen );
+
+// write 'value' as a varint in 'buffer' and return the number of bytes used
+size_t gbProtoWriteVarint( byte_t *buffer, uint32_t value );
+
+#endif
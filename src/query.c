@@ -30,11 +30,14 @@
 #include "log.h"
 #include "trie.h"
 #include "lzf.h"
+#include "proto.h"
 #include "configure.h"
+#include <errno.h>
 
 #define min(a,b) ( a < b ? a : b )
 
 extern void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
+extern void gbShmWakeupHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 
 __inline__ __attribute__((always_inline)) unsigned int gbQueryParseLong( byte_t *v, size_t vlen, long *l )
 {
@@ -79,7 +82,7 @@ static gbItem *gbCreateVolatileItem( gbServer *server, void *data, size_t size,
 {
     assert( server != NULL );
 
-    gbItem *item = ( gbItem * )opool_alloc_object( &server->item_pool );
+    gbItem *item = ( gbItem * )opool_alloc_object( &server->engine.item_pool );
 
     assert( item != NULL );
 
@@ -107,324 +110,10 @@ static void gbDestroyVolatileItem( gbServer *server, gbItem *item )
         item->data = NULL;
     }
 
-    opool_free_object( &server->item_pool, item );
+    opool_free_object( &server->engine.item_pool, item );
 }
 
-static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEncoding encoding, int ttl )
-{
-    assert( server != NULL );
-    assert( size == 0 || data != NULL );
-
-    gbItem *item = ( gbItem * )opool_alloc_object( &server->item_pool );
-
-    assert( item != NULL );
-
-    item->data 	           = data;
-    item->size 	           = size;
-    item->encoding         = encoding;
-    item->time             =
-    item->last_access_time = server->stats.time;
-    item->ttl	           = ttl;
-    item->lock	           = 0;
-
-    if( encoding == GB_ENC_LZF )
-    {
-        ++server->stats.ncompressed;
-    }
-
-    if( server->stats.firstin == 0 )
-        server->stats.firstin = server->stats.time;
-
-    server->stats.lastin  = server->stats.time;
-    server->stats.memused = zmem_used();
-    server->stats.sizeavg = server->stats.memused / ++server->stats.nitems;
-
-    if( server->stats.memused > server->stats.mempeak )
-        server->stats.mempeak = server->stats.memused;
-
-    return item;
-}
-
-void gbDestroyItem( gbServer *server, gbItem *item )
-{
-    assert( server != NULL );
-    assert( item != NULL );
-
-    if( item->encoding == GB_ENC_LZF )
-    {
-        --server->stats.ncompressed;
-    }
-
-    if( item->encoding != GB_ENC_NUMBER && item->data != NULL )
-    {
-        zfree( item->data );
-        item->data = NULL;
-    }
-
-    opool_free_object( &server->item_pool, item );
-
-    server->stats.memused = zmem_used();
-    server->stats.nitems -= 1;
-    server->stats.sizeavg = server->stats.nitems == 0 ? 0 : server->stats.memused / server->stats.nitems;
-}
-
-static int gbItemIsLocked( gbItem *item, gbServer *server, time_t eta )
-{
-    assert( item != NULL );
-    assert( server != NULL );
-
-    eta = eta == 0 ? server->stats.time - item->time : eta;
-    return ( item->lock == -1 || eta < item->lock );
-}
-
-static int gbIsNodeStillValid( tnode_t *node, gbItem *item, gbServer *server, int remove )
-{
-    assert( node != NULL );
-    assert( item != NULL );
-    assert( server != NULL );
-
-    register time_t eta = server->stats.time - item->time,
-             ttl = item->ttl;
-
-    if( ttl > 0 && eta >= ttl )
-    {
-        gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
-
-        if( remove )
-            node->data = NULL;
-
-        gbDestroyItem( server, item );
-
-        return 0;
-    }
-
-    return 1;
-}
-
-static int gbIsItemStillValid( gbItem *item, gbServer *server, unsigned char *key, size_t klen, int remove )
-{
-    assert( item != NULL );
-    assert( server != NULL );
-    assert( key != NULL );
-    assert( klen > 0 );
-
-    register time_t eta = server->stats.time - item->time,
-             ttl = item->ttl;
-
-    if( ttl > 0 && eta >= ttl )
-    {
-        gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
-
-        if( remove )
-            tr_remove( &server->tree, key, klen );
-
-        gbDestroyItem( server, item );
-
-        return 0;
-    }
-
-    return 1;
-}
-
-static int gbParseKeyAndOptionalValue( gbServer *server, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
-{
-    assert( server != NULL );
-    assert( buffer != NULL );
-    assert( klen != NULL );
-    assert( key != NULL );
-
-    register byte_t *p = buffer;
-    register size_t i = 0, end;
-
-    // parse the key, the end data is the minimum among total request size and maxkeysize
-    *key = p;
-    end  = min( size, server->limits.maxkeysize );
-    while( i++ < end && *p != ' ' ){
-        ++p;
-    }
-
-    *klen = p++ - *key;
-
-    // if the value should be optionally parsed ...
-    if( value )
-    {
-        assert( vlen != NULL );
-
-        size_t left = size - *klen;
-
-        if( left > 0 )
-        {
-            *value = p;
-            *vlen  = left - 1; // white space
-
-            *vlen  = min( *vlen, server->limits.maxvaluesize );
-        }
-        else
-        {
-            *value = NULL;
-            *vlen  = 0;
-        }
-    }
-
-    // check if length conditions are verified
-    if( *klen <= 0 )
-        return 0;
-
-    else if( value && *value && *vlen <= 0 )
-        return 0;
-
-    else
-        return 1;
-}
-
-static int gbParseKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen )
-{
-    assert( server != NULL );
-    assert( buffer != NULL );
-    assert( klen != NULL );
-    assert( key != NULL );
-
-    register byte_t *p = buffer;
-    register size_t i = 0, end;
-
-    // parse the key, the end data is the minimum among total request size and maxkeysize
-    *key = p;
-    end  = min( size, server->limits.maxkeysize );
-    while( i++ < end && *p != ' ' ){
-        ++p;
-    }
-
-    *klen = p++ - *key;
-
-    // if the value should be parsed ...
-    if( value )
-    {
-        assert( vlen != NULL );
-
-        *value = p;
-        *vlen  = size - *klen - 1;
-        *vlen  = min( *vlen, server->limits.maxvaluesize );
-    }
-
-    // check if length conditions are verified
-    if( *klen <= 0 )
-        return 0;
-
-    else if( value && *value && *vlen <= 0 )
-        return 0;
-
-    else
-        return 1;
-}
-
-static int gbParseTtlKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen )
-{
-    assert( server != NULL );
-    assert( buffer != NULL );
-    assert( size > 0 );
-    assert( klen != NULL );
-    assert( key != NULL );
-
-    register byte_t *p = buffer;
-    register size_t i = 0, end;
-
-    // parse the ttl value
-    *ttl = p;
-    end = min( size, server->limits.maxkeysize );
-    while( i++ < end && *p != ' ' )
-    {
-        ++p;
-    }
-
-    *ttllen = p++ - *ttl;
-
-    // parse the key
-    *key = p;
-    end = min( size, server->limits.maxkeysize );
-    while( i++ < end && *p != ' ' )
-    {
-        ++p;
-    }
-
-    *klen = p++ - *key;
-
-    // finally parse the value if needed
-    if( value )
-    {
-        assert( vlen != NULL );
-
-        *value = p;
-        *vlen  = size - *ttllen - *klen - 2;
-        *vlen  = min( *vlen, server->limits.maxvaluesize );
-    }
-
-    // check length conditions
-    if( *ttllen <= 0 )
-        return 0;
-
-    else if( *klen <= 0 )
-        return 0;
-
-    else if( value && *value && *vlen <= 0 )
-        return 0;
-
-    else
-        return 1;
-}
-
-static gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbServer *server )
-{
-    assert( v != NULL );
-    assert( vlen > 0 );
-    assert( k != NULL );
-    assert( klen > 0 );
-    assert( server != NULL );
-
-    gbItemEncoding encoding = GB_ENC_PLAIN;
-    void *data = v;
-    size_t comprlen = vlen, needcompr = vlen - 4; // compress at least of 4 bytes
-    gbItem *item, *old;
-
-    // should we compress ?
-    if( vlen > server->compression )
-    {
-        comprlen = lzf_compress( v, vlen, server->lzf_buffer, needcompr );
-        // not enough compression
-        if( comprlen == 0 )
-        {
-            encoding = GB_ENC_PLAIN;
-            data	 = zmemdup( v, vlen );
-        }
-        // succesfully compressed
-        else {
-            double rate = 100.0 - ( ( comprlen * 100.0 ) / vlen );
-
-            if( server->stats.compravg == 0 )
-                server->stats.compravg = rate;
-            else
-                server->stats.compravg = ( server->stats.compravg + rate ) / 2.0;
-
-            encoding = GB_ENC_LZF;
-            vlen 	 = comprlen;
-            data 	 = zmemdup( server->lzf_buffer, comprlen );
-        }
-    }
-    else {
-        encoding = GB_ENC_PLAIN;
-        data = zmemdup( v, vlen );
-    }
-
-    item = gbCreateItem( server, data, vlen, encoding, -1 );
-    old = tr_insert( &server->tree, k, klen, item );
-    if( old )
-    {
-        gbDestroyItem( server, old );
-    }
-
-    return item;
-}
-
-static int gbQuerySetHandler( gbClient *client, byte_t *p )
+static int gbQuerySetHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -436,73 +125,56 @@ static int gbQuerySetHandler( gbClient *client, byte_t *p )
     gbServer *server = client->server;
     gbItem *item = NULL;
     long ttl;
+    int ret;
 
-    if( server->stats.memused <= server->limits.maxmem )
+    if( gbParseTtlKeyValue( client, p, size, &t, &k, &v, &ttllen, &klen, &vlen ) )
     {
-        if( gbParseTtlKeyValue( server, p, client->buffer_size - sizeof(short), &t, &k, &v, &ttllen, &klen, &vlen ) )
+        if( gbQueryParseLong( t, ttllen, &ttl ) )
         {
-            if( gbQueryParseLong( t, ttllen, &ttl ) )
-            {
-                item = tr_find( &server->tree, k, klen );
-                // locked item
-                if( item && gbItemIsLocked( item, server, 0 ) )
-                {
-                    return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
-                }
-
-                item = gbSingleSet( v, vlen, k, klen, server );
-                if( ttl > 0 )
-                {
-                    item->time = server->stats.time;
-                    item->ttl  = min( server->limits.maxitemttl, ttl );
-                }
-
+            if( ( ret = gbEngineSet( &server->engine, k, klen, v, vlen, ttl, &item ) ) == GB_ENGINE_OK )
                 return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
-            }
             else
-                return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
+                return gbClientEnqueueCode( client, ret, gbWriteReplyHandler, 0 );
         }
         else
-            return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+            return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
     }
     else
-        return gbClientEnqueueCode( client, REPL_ERR_MEM, gbWriteReplyHandler, 0 );
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
 typedef struct {
-    gbServer *server;
+    gbEngine *engine;
     byte_t *value;
     size_t vlen;
 }
 multi_set_ctx_t;
 
-static int gbMultiSetCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiSetCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
     assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+    assert( node != NULL );
 
     multi_set_ctx_t *setctx = (multi_set_ctx_t *)ctx;
 
-    gbServer *server = setctx->server;
-    gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
+    gbEngine *engine = setctx->engine;
+    gbItem *item = (gbItem *)node->data;
 
     if( !item ){
         return 0;
     }
-    else if( gbItemIsLocked( item, server, 0 ) ){
+    else if( gbItemIsLocked( item, engine, 0 ) ){
         return 0;
     }
-    else if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ){
+    else if( gbIsNodeStillValid( node, item, engine, 1 ) == 0 ){
         return 0;
     }
 
-    gbSingleSet( setctx->value, setctx->vlen, key, keylen, server );
+    gbNodeSet( setctx->value, setctx->vlen, node, engine );
 
     return 1;
 }
 
-static int gbQueryMultiSetHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiSetHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -513,17 +185,18 @@ static int gbQueryMultiSetHandler( gbClient *client, byte_t *p )
     gbServer *server = client->server;
     gbItem *item = NULL;
 
-    if( server->stats.memused <= server->limits.maxmem )
+    if( server->engine.stats.memused <= server->engine.limits.maxmem )
     {
-        if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
+        if( gbParseKeyValue( client, p, size, &expr, &v, &exprlen, &vlen ) )
         {
             multi_set_ctx_t ctx = {0};
 
-            ctx.server = server;
+            ctx.engine = &server->engine;
             ctx.value  = v;
             ctx.vlen   = vlen;
 
-            size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiSetCallback, &ctx );
+            size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbMultiSetCallback, &ctx );
+            client->items = found;
             if( found )
                 return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
             else
@@ -536,7 +209,7 @@ static int gbQueryMultiSetHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR_MEM, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryTtlHandler( gbClient *client, byte_t *p )
+static int gbQueryTtlHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -545,61 +218,51 @@ static int gbQueryTtlHandler( gbClient *client, byte_t *p )
            *v = NULL;
     size_t klen = 0, vlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
     long ttl;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &v, &klen, &vlen ) )
+    if( gbParseKeyValue( client, p, size, &k, &v, &klen, &vlen ) )
     {
-        item = tr_find( &server->tree, k, klen );
-        if( item && gbIsItemStillValid( item, server, k, klen, 1 ) )
+        if( gbQueryParseLong( v, vlen, &ttl ) )
         {
-            if( gbQueryParseLong( v, vlen, &ttl ) )
-            {
-                item->last_access_time =
-                item->time = server->stats.time;
-                item->ttl  = min( server->limits.maxitemttl, ttl );
-
+            if( gbEngineTtl( &server->engine, k, klen, ttl ) == GB_ENGINE_OK )
                 return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
-            }
             else
-                return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
+                return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
         }
         else
-            return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+            return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
 typedef struct {
-    gbServer *server;
+    gbEngine *engine;
     long ttl;
 }
 multi_ttl_ctx_t;
 
-static int gbMultiTtlCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiTtlCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
     assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+    assert( node != NULL );
 
     multi_ttl_ctx_t *ttlctx = (multi_ttl_ctx_t *)ctx;
 
-    gbServer *server = (gbServer *)ttlctx->server;
-    gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
+    gbEngine *engine = ttlctx->engine;
+    gbItem *item = (gbItem *)node->data;
 
-    if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ) {
+    if( gbIsNodeStillValid( node, item, engine, 1 ) == 0 ) {
         return 0;
     }
 
     item->last_access_time =
-    item->time = server->stats.time;
-    item->ttl  = min( server->limits.maxitemttl, ttlctx->ttl );
+    item->time = engine->time;
+    item->ttl  = min( engine->limits.maxitemttl, ttlctx->ttl );
 
     return 1;
 }
 
-static int gbQueryMultiTtlHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiTtlHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -611,13 +274,14 @@ static int gbQueryMultiTtlHandler( gbClient *client, byte_t *p )
     gbItem *item = NULL;
     long ttl;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
+    if( gbParseKeyValue( client, p, size, &expr, &v, &exprlen, &vlen ) )
     {
         if( gbQueryParseLong( v, vlen, &ttl ) )
         {
-            multi_ttl_ctx_t ctx = { server, ttl };
+            multi_ttl_ctx_t ctx = { &server->engine, ttl };
 
-            size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiTtlCallback, &ctx );
+            size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbMultiTtlCallback, &ctx );
+            client->items = found;
             if( found )
                 return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 
@@ -631,7 +295,7 @@ static int gbQueryMultiTtlHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryGetHandler( gbClient *client, byte_t *p )
+static int gbQueryGetHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -639,30 +303,20 @@ static int gbQueryGetHandler( gbClient *client, byte_t *p )
     byte_t *k = NULL;
     size_t klen = 0;
     gbServer *server = client->server;
-    tnode_t *node = NULL;
     gbItem *item = NULL;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &k, NULL, &klen, NULL ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
-        if( node &&                                               // key exists
-                ( item = node->data ) &&                            // value exists
-                gbIsNodeStillValid( node, node->data, server, 1 ) ) // item is not expired
-        {
-            item = node->data;
-            item->last_access_time = server->stats.time;
-
+        if( gbEngineGet( &server->engine, k, klen, &item ) == GB_ENGINE_OK )
             return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
-        }
         else
             return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
-
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiGetHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -670,10 +324,10 @@ static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
     byte_t *expr = NULL, *v = NULL;
     size_t exprlen = 0, vlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
     long limit = -1;
+    int ret;
 
-    if( gbParseKeyAndOptionalValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
+    if( gbParseKeyAndOptionalValue( client, p, size, &expr, &v, &exprlen, &vlen ) )
     {
         // check if a limit was given
         if( v && vlen )
@@ -684,61 +338,22 @@ static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
             }
         }
 
-        size_t found = tr_search( &server->tree, expr, exprlen, limit, server->limits.maxkeysize, &server->m_keys, &server->m_values );
+        size_t found = gbEngineMGet( &server->engine, expr, exprlen, limit );
+        client->items = found;
         if( found )
-        {
-            ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-            {
-                item = vi->data;
-
-                if( !item || gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 )
-                {
-                    --found;
-                    vi->data = NULL;
-                }
-                else
-                    item->last_access_time = server->stats.time;
-            }
-
-            if( found )
-            {
-
-                int ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
-
-                ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-                {
-                    // free allocated key
-                    zfree( ki->data );
-                    ki->data = NULL;
-                }
-
-                ll_reset( server->m_keys );
-                ll_reset( server->m_values );
-
-                return ret;
-            }
-            else {
-                ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-                {
-                    // free allocated key
-                    zfree( ki->data );
-                    ki->data = NULL;
-                }
+            ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
+        else
+            ret = gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 
-                ll_reset( server->m_keys );
-                ll_reset( server->m_values );
+        gbEngineReleaseResults( &server->engine );
 
-                return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
-            }
-        }
-        else
-            return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+        return ret;
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryDelHandler( gbClient *client, byte_t *p )
+static int gbQueryDelHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -746,60 +361,20 @@ static int gbQueryDelHandler( gbClient *client, byte_t *p )
     byte_t *k = NULL;
     size_t klen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
+    int ret;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &k, NULL, &klen, NULL ) )
     {
-        tnode_t *node = tr_find_node( &server->tree, k, klen );
-        if( node && node->data )
-        {
-            item = node->data;
-
-            if( gbItemIsLocked( item, server, 0 ) )
-                return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
-
-            else if( gbIsNodeStillValid( node, item, server, 1 ) )
-            {
-                gbDestroyItem( server, item );
-
-                // Remove item from tree
-                node->data = NULL;
-
-                return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
-            }
-        }
-
-        return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
-    }
-    else
-        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
-}
-
-static int gbMultiDelCallback( void *ctx, unsigned char *key, void *data ) {
-    assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
-
-    gbServer *server = (gbServer *)ctx;
-    tnode_t *node = (tnode_t *)data;
-    gbItem *item = (gbItem *)node->data;
-    size_t keylen = strlen(key);
-
-    // locked item
-    if( !item || gbItemIsLocked( item, server, 0 ) ){
-        return 0;
-    }
-    else if( gbIsNodeStillValid( node, item, server, 1 ) ){
-        node->data = NULL;
-        gbDestroyItem( server, item );
-
-        return 1;
+        if( ( ret = gbEngineDel( &server->engine, k, klen ) ) == GB_ENGINE_OK )
+            return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+        else
+            return gbClientEnqueueCode( client, ret, gbWriteReplyHandler, 0 );
     }
-
-    return 0;
+    else
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryMultiDelHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiDelHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -807,14 +382,13 @@ static int gbQueryMultiDelHandler( gbClient *client, byte_t *p )
     byte_t *expr = NULL;
     size_t exprlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &expr, NULL, &exprlen, NULL ) )
     {
-        size_t found = tr_search_nodes_callback( &server->tree, expr, exprlen, server->limits.maxkeysize, gbMultiDelCallback, server );
+        size_t found = gbEngineMDel( &server->engine, expr, exprlen );
+        client->items = found;
         if( found )
             return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
-        
         else
             return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
     }
@@ -822,7 +396,7 @@ static int gbQueryMultiDelHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
+static int gbQueryIncDecHandler( gbClient *client, byte_t *p, size_t size, short delta )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -834,31 +408,31 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
     gbItem *item = NULL;
     long num = 0;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &k, NULL, &klen, NULL ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
+        node = tr_find_node( &server->engine.tree, k, klen );
 
         item = node ? node->data : NULL;
         if( item == NULL )
         {
-            item = gbCreateItem( server, (void *)1, sizeof( long ), GB_ENC_NUMBER, -1 );
+            item = gbCreateItem( &server->engine, (void *)1, sizeof( long ), GB_ENC_NUMBER, -1 );
             // just reuse the node
             if( node )
                 node->data = item;
             else
-                tr_insert( &server->tree, k, klen, item );
+                tr_insert( &server->engine.tree, k, klen, item );
 
             return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
         }
-        else if( gbIsNodeStillValid( node, item, server, 1 ) == 0 )
+        else if( gbIsNodeStillValid( node, item, &server->engine, 1 ) == 0 )
         {
             return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
         }
         else {
-            if( gbItemIsLocked( item, server, 0 ) )
+            if( gbItemIsLocked( item, &server->engine, 0 ) )
                 return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
 
-            item->last_access_time = server->stats.time;
+            item->last_access_time = server->engine.time;
 
             if( item->encoding == GB_ENC_NUMBER )
             {
@@ -873,7 +447,7 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
                 zfree( item->data );
                 item->data = NULL;
 
-                server->stats.memused = zmem_used();
+                server->engine.stats.memused = zmem_used();
 
                 item->encoding = GB_ENC_NUMBER;
                 item->data	   = (void *)num;
@@ -890,31 +464,29 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
 }
 
 typedef struct {
-    gbServer *server;
+    gbEngine *engine;
     short delta;
 }
 multi_inc_ctx_t;
 
-static int gbMultiIncDecCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiIncDecCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
     assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+    assert( node != NULL );
 
     multi_inc_ctx_t *incctx = (multi_inc_ctx_t *)ctx;
 
-    gbServer *server = (gbServer *)incctx->server;
-    gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
+    gbEngine *engine = incctx->engine;
+    gbItem *item = (gbItem *)node->data;
     long num = 0;
 
-    if( !item || gbItemIsLocked( item, server, 0 ) ){
+    if( !item || gbItemIsLocked( item, engine, 0 ) ){
         return 0;
     }
-    if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ) {
+    if( gbIsNodeStillValid( node, item, engine, 1 ) == 0 ) {
         return 0;
     }
 
-    item->last_access_time = server->stats.time;
+    item->last_access_time = engine->time;
 
     if( item->encoding == GB_ENC_NUMBER ) {
         item->data = (void *)( (long)item->data + incctx->delta );
@@ -926,7 +498,7 @@ static int gbMultiIncDecCallback( void *ctx, unsigned char *key, void *data ) {
             zfree( item->data );
             item->data = NULL;
 
-            server->stats.memused = zmem_used();
+            engine->stats.memused = zmem_used();
 
             item->encoding = GB_ENC_NUMBER;
             item->data	   = (void *)num;
@@ -939,7 +511,7 @@ static int gbMultiIncDecCallback( void *ctx, unsigned char *key, void *data ) {
     return 1;
 }
 
-static int gbQueryMultiIncDecHandler( gbClient *client, byte_t *p, short delta )
+static int gbQueryMultiIncDecHandler( gbClient *client, byte_t *p, size_t size, short delta )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -950,11 +522,12 @@ static int gbQueryMultiIncDecHandler( gbClient *client, byte_t *p, short delta )
     gbItem *item = NULL;
     long num = 0;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &expr, NULL, &exprlen, NULL ) )
     {
-        multi_inc_ctx_t ctx = { server, delta };
+        multi_inc_ctx_t ctx = { &server->engine, delta };
 
-        size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiIncDecCallback, &ctx );
+        size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbMultiIncDecCallback, &ctx );
+        client->items = found;
         if( found )
             return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
         else
@@ -964,7 +537,7 @@ static int gbQueryMultiIncDecHandler( gbClient *client, byte_t *p, short delta )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryLockHandler( gbClient *client, byte_t *p )
+static int gbQueryLockHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -977,18 +550,18 @@ static int gbQueryLockHandler( gbClient *client, byte_t *p )
     gbItem *item = NULL;
     long locktime;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &v, &klen, &vlen ) )
+    if( gbParseKeyValue( client, p, size, &k, &v, &klen, &vlen ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
-        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, server, 1 ) )
+        node = tr_find_node( &server->engine.tree, k, klen );
+        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, &server->engine, 1 ) )
         {
             if( gbQueryParseLong( v, vlen, &locktime ) )
             {
-                item->last_access_time = server->stats.time;
+                item->last_access_time = server->engine.time;
 
-                if( gbItemIsLocked( item, server, 0 ) == 0 )
+                if( gbItemIsLocked( item, &server->engine, 0 ) == 0 )
                 {
-                    item->time = server->stats.time;
+                    item->time = server->engine.time;
                     item->lock = locktime;
 
                     return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
@@ -1007,26 +580,24 @@ static int gbQueryLockHandler( gbClient *client, byte_t *p )
 }
 
 typedef struct {
-    gbServer *server;
+    gbEngine *engine;
     long locktime;
 }
 multi_lock_ctx_t;
 
-static int gbMultiLockCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiLockCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
     assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+    assert( node != NULL );
 
     multi_lock_ctx_t *mlockctx = (multi_lock_ctx_t *)ctx;
 
-    gbServer *server = (gbServer *)mlockctx->server;
-    gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
+    gbEngine *engine = mlockctx->engine;
+    gbItem *item = (gbItem *)node->data;
 
-    if( gbIsItemStillValid( item, server, key, keylen, 1 ) && gbItemIsLocked( item, server, 0 ) == 0 )
+    if( gbIsNodeStillValid( node, item, engine, 1 ) && gbItemIsLocked( item, engine, 0 ) == 0 )
     {
         item->last_access_time =
-        item->time = server->stats.time;
+        item->time = engine->time;
         item->lock = mlockctx->locktime;
 
         return 1;
@@ -1035,7 +606,7 @@ static int gbMultiLockCallback( void *ctx, unsigned char *key, void *data ) {
     return 0;
 }
 
-static int gbQueryMultiLockHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiLockHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1047,13 +618,14 @@ static int gbQueryMultiLockHandler( gbClient *client, byte_t *p )
     gbItem *item = NULL;
     long locktime;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
+    if( gbParseKeyValue( client, p, size, &expr, &v, &exprlen, &vlen ) )
     {
         if( gbQueryParseLong( v, vlen, &locktime ) )
         {
-            multi_lock_ctx_t ctx = { server, locktime };
+            multi_lock_ctx_t ctx = { &server->engine, locktime };
 
-            size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiLockCallback, &ctx );
+            size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbMultiLockCallback, &ctx );
+            client->items = found;
             if( found )
                 return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
             else
@@ -1066,7 +638,7 @@ static int gbQueryMultiLockHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryUnlockHandler( gbClient *client, byte_t *p )
+static int gbQueryUnlockHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1077,13 +649,13 @@ static int gbQueryUnlockHandler( gbClient *client, byte_t *p )
     tnode_t *node = NULL;
     gbItem *item = NULL;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &k, NULL, &klen, NULL ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
-        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, server, 1 ) )
+        node = tr_find_node( &server->engine.tree, k, klen );
+        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, &server->engine, 1 ) )
         {
             item->lock = 0;
-            item->last_access_time = server->stats.time;
+            item->last_access_time = server->engine.time;
 
             return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
         }
@@ -1094,18 +666,17 @@ static int gbQueryUnlockHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbMultiUnlockCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiUnlockCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
     assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+    assert( node != NULL );
 
-    gbServer *server = (gbServer *)ctx;
-    gbItem *item = (gbItem *)data;
+    gbEngine *engine = (gbEngine *)ctx;
+    gbItem *item = (gbItem *)node->data;
 
-    if( item && gbIsItemStillValid( item, server, key, strlen(key), 1 ) )
+    if( item && gbIsNodeStillValid( node, item, engine, 1 ) )
     {
         item->lock = 0;
-        item->last_access_time = server->stats.time;
+        item->last_access_time = engine->time;
 
         return 1;
     }
@@ -1113,7 +684,7 @@ static int gbMultiUnlockCallback( void *ctx, unsigned char *key, void *data ) {
     return 0;
 }
 
-static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p )
+static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1123,9 +694,10 @@ static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p )
     gbServer *server = client->server;
     gbItem *item = NULL;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &expr, NULL, &exprlen, NULL ) )
     {
-        size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiUnlockCallback, server );
+        size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbMultiUnlockCallback, &server->engine );
+        client->items = found;
 
         if( found )
             return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
@@ -1136,62 +708,175 @@ static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbCountCallback( void *ctx, unsigned char *key, void *data ) {
-    assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
+static int gbQueryCountHandler( gbClient *client, byte_t *p, size_t size )
+{
+    assert( client != NULL );
+    assert( p != NULL );
 
-    gbServer *server = (gbServer *)ctx;
-    gbItem *item = (gbItem *)data;
+    byte_t *expr = NULL;
+    size_t exprlen = 0;
+    gbServer *server = client->server;
 
-    if( !item || !gbIsItemStillValid( item, server, key, strlen(key), 1 ) ){
-        return 0;
+    if( gbParseKeyValue( client, p, size, &expr, NULL, &exprlen, NULL ) )
+    {
+        size_t found = gbEngineCount( &server->engine, expr, exprlen );
+        client->items = found;
+
+        return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
     }
-    else {
-        item->last_access_time = server->stats.time;
+    else
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+}
 
-        return 1;
+// split a batch request into server->batch_args and return the number of arguments,
+// when 'pairs' is set arguments alternate between keys and values. Returns -1 if the
+// request is malformed.
+static long gbQueryParseBatch( gbClient *client, byte_t *p, size_t size, int pairs )
+{
+    gbServer *server = client->server;
+    gbEngineLimits *limits = &server->engine.limits;
+    size_t n = 0, maxlen;
+
+    while( size > 0 )
+    {
+        if( n == server->batch_size )
+        {
+            server->batch_size = server->batch_size ? server->batch_size * 2 : 64;
+            server->batch_args = zrealloc( server->batch_args, sizeof(byte_t *) * server->batch_size );
+            server->batch_lens = zrealloc( server->batch_lens, sizeof(size_t) * server->batch_size );
+        }
+
+        maxlen = pairs && ( n & 1 ) ? limits->maxvaluesize : limits->maxkeysize;
+
+        if( gbParseNextArg( client, &p, &size, &server->batch_args[n], &server->batch_lens[n], maxlen ) == 0 )
+            return -1;
+
+        ++n;
     }
 
-    return 1;
+    if( n == 0 || ( pairs && ( n & 1 ) ) )
+        return -1;
+
+    return n;
 }
 
-static int gbQueryCountHandler( gbClient *client, byte_t *p )
+static int gbQueryBatchGetHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
 
-    byte_t *expr = NULL;
-    size_t exprlen = 0;
+    gbServer *server = client->server;
+    long nkeys = gbQueryParseBatch( client, p, size, 0 );
+    int ret;
+
+    if( nkeys > 0 )
+    {
+        size_t found = gbEngineBGet( &server->engine, server->batch_args, server->batch_lens, nkeys );
+        client->items = found;
+        if( found )
+            ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
+        else
+            ret = gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+
+        gbEngineReleaseResults( &server->engine );
+
+        return ret;
+    }
+    else
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryBatchSetHandler( gbClient *client, byte_t *p, size_t size )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    byte_t *t = NULL;
+    size_t ttllen = 0, found = 0;
     gbServer *server = client->server;
     gbItem *item = NULL;
+    long ttl, nargs, i;
+    int ret = REPL_ERR;
+
+    if( gbParseNextArg( client, &p, &size, &t, &ttllen, server->engine.limits.maxkeysize ) == 0 ||
+        ( nargs = gbQueryParseBatch( client, p, size, 1 ) ) <= 0 )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    else if( !gbQueryParseLong( t, ttllen, &ttl ) )
+        return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
+    for( i = 0; i < nargs; i += 2 )
     {
-        size_t found = tr_count( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbCountCallback, server );
+        ret = gbEngineSet( &server->engine, server->batch_args[i], server->batch_lens[i],
+                           server->batch_args[i + 1], server->batch_lens[i + 1], ttl, &item );
+        if( ret == GB_ENGINE_OK )
+            ++found;
+    }
 
+    client->items = found;
+    if( found )
         return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+    else
+        return gbClientEnqueueCode( client, ret, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryBatchDelHandler( gbClient *client, byte_t *p, size_t size )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    gbServer *server = client->server;
+    long nkeys = gbQueryParseBatch( client, p, size, 0 ), i;
+    size_t found = 0;
+
+    if( nkeys > 0 )
+    {
+        for( i = 0; i < nkeys; ++i )
+        {
+            if( gbEngineDel( &server->engine, server->batch_args[i], server->batch_lens[i] ) == GB_ENGINE_OK )
+                ++found;
+        }
+
+        client->items = found;
+        if( found )
+            return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+        else
+            return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryStatsHandler( gbClient *client, byte_t *p )
+// names used for the per opcode stats
+static const char *gbOpcodeNames[GB_MAX_OPCODES] =
+{
+    [OP_SET]   = "set",   [OP_TTL]    = "ttl",    [OP_GET]     = "get",     [OP_DEL]    = "del",
+    [OP_INC]   = "inc",   [OP_DEC]    = "dec",    [OP_LOCK]    = "lock",    [OP_UNLOCK] = "unlock",
+    [OP_MSET]  = "mset",  [OP_MTTL]   = "mttl",   [OP_MGET]    = "mget",    [OP_MDEL]   = "mdel",
+    [OP_MINC]  = "minc",  [OP_MDEC]   = "mdec",   [OP_MLOCK]   = "mlock",   [OP_MUNLOCK] = "munlock",
+    [OP_COUNT] = "count", [OP_STATS]  = "stats",  [OP_PING]    = "ping",    [OP_META]   = "meta",
+    [OP_KEYS]  = "keys",  [OP_PROTO]  = "proto",  [OP_SHM]     = "shm",     [OP_RESETSTATS] = "resetstats",
+    [OP_SLOWLOG] = "slowlog", [OP_BGET] = "bget", [OP_BSET]  = "bset", [OP_BDEL]  = "bdel"
+};
+
+static int gbQueryStatsHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
 
     gbServer *server = client->server;
-    size_t elems = 0;
-    char s[0xFF] = {0};
+    size_t elems = 0, i;
+    char s[0xFF] = {0},
+         // per compression level, listener and opcode stat names, copied by gbEngineResultKey
+         k[0xFF] = {0};
 
 #define APPEND_LONG_STAT( key, value ) ++elems; \
-    ll_append( server->m_keys, key ); \
-    ll_append( server->m_values, gbCreateVolatileItem( server, (void *)(long)value, sizeof(long), GB_ENC_NUMBER ) )
+    ll_append( server->engine.m_keys, gbEngineResultKey( &server->engine, (byte_t *)(key), strlen(key) ) ); \
+    ll_append( server->engine.m_values, gbCreateVolatileItem( server, (void *)(long)value, sizeof(long), GB_ENC_NUMBER ) )
 
 #define APPEND_STRING_STAT( key, value ) ++elems; \
-    ll_append( server->m_keys, key ); \
-    ll_append( server->m_values, gbCreateVolatileItem( server, zstrdup(value), strlen(value), GB_ENC_PLAIN ) )
+    ll_append( server->engine.m_keys, gbEngineResultKey( &server->engine, (byte_t *)(key), strlen(key) ) ); \
+    ll_append( server->engine.m_values, gbCreateVolatileItem( server, zstrdup(value), strlen(value), GB_ENC_PLAIN ) )
 
 #define APPEND_FLOAT_STAT( key, value ) memset( s, 0x00, 0xFF ); \
     sprintf( s, "%f", (value) ); \
@@ -1208,46 +893,138 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p )
     APPEND_STRING_STAT( "server_arch", (sizeof(long) == 8) ? "64" : "32" );
     APPEND_LONG_STAT( "server_started",             server->stats.started );
     APPEND_LONG_STAT( "server_time",                server->stats.time );
-    APPEND_LONG_STAT( "first_item_seen",            server->stats.firstin );
-    APPEND_LONG_STAT( "last_item_seen",             server->stats.lastin );
-    APPEND_LONG_STAT( "total_items",                server->stats.nitems );
-    APPEND_LONG_STAT( "total_compressed_items",     server->stats.ncompressed );
+    APPEND_LONG_STAT( "first_item_seen",            server->engine.stats.firstin );
+    APPEND_LONG_STAT( "last_item_seen",             server->engine.stats.lastin );
+    APPEND_LONG_STAT( "total_items",                server->engine.stats.nitems );
+    APPEND_LONG_STAT( "total_compressed_items",     server->engine.stats.ncompressed );
     APPEND_LONG_STAT( "total_clients",              server->stats.nclients );
     APPEND_LONG_STAT( "total_cron_done",            server->stats.crondone );
     APPEND_LONG_STAT( "total_connections",          server->stats.connections );
     APPEND_LONG_STAT( "total_requests",             server->stats.requests );
-    APPEND_LONG_STAT( "item_pool_current_used",     server->item_pool.used );
-    APPEND_LONG_STAT( "item_pool_current_capacity", server->item_pool.capacity );
-    APPEND_LONG_STAT( "item_pool_total_capacity",   server->item_pool.total_capacity );
-    APPEND_LONG_STAT( "item_pool_object_size",      server->item_pool.object_size );
-    APPEND_LONG_STAT( "item_pool_max_block_size",   server->item_pool.max_block_size );
+    APPEND_LONG_STAT( "total_deferred_writes",      server->stats.deferred_writes );
+    APPEND_LONG_STAT( "total_reaped_clients",       server->stats.reaped_clients );
+    APPEND_LONG_STAT( "total_reaped_memory",        server->stats.reaped_memory );
+    APPEND_LONG_STAT( "total_log_dropped",          gbLogDropped() );
+    APPEND_LONG_STAT( "item_pool_current_used",     server->engine.item_pool.used );
+    APPEND_LONG_STAT( "item_pool_current_capacity", server->engine.item_pool.capacity );
+    APPEND_LONG_STAT( "item_pool_total_capacity",   server->engine.item_pool.total_capacity );
+    APPEND_LONG_STAT( "item_pool_object_size",      server->engine.item_pool.object_size );
+    APPEND_LONG_STAT( "item_pool_max_block_size",   server->engine.item_pool.max_block_size );
     APPEND_LONG_STAT( "memory_available",           server->stats.memavail );
-    APPEND_LONG_STAT( "memory_usable",              server->limits.maxmem );
-    APPEND_LONG_STAT( "memory_used",                server->stats.memused );
-    APPEND_LONG_STAT( "memory_peak", 			    server->stats.mempeak );
+    APPEND_LONG_STAT( "memory_usable",              server->engine.limits.maxmem );
+    APPEND_LONG_STAT( "memory_used",                server->engine.stats.memused );
+    APPEND_LONG_STAT( "memory_peak", 			    server->engine.stats.mempeak );
     APPEND_FLOAT_STAT( "memory_fragmentation",      zmem_fragmentation_ratio() );
-    APPEND_LONG_STAT( "item_size_avg",              server->stats.sizeavg );
-    APPEND_LONG_STAT( "compr_rate_avg",             server->stats.compravg );
+    APPEND_LONG_STAT( "item_size_avg",              server->engine.stats.sizeavg );
+    APPEND_LONG_STAT( "compr_rate_avg",             server->engine.stats.compravg );
+
+    for( i = 0; i < LZF_LEVELS; ++i )
+    {
+        gbCompressionStats *cstats = &server->engine.stats.compression[i];
+
+#define APPEND_COMPR_STAT( field ) snprintf( k, 0xFF, "compr_%s_" #field, lzf_level_name(i) ); \
+    APPEND_LONG_STAT( k, cstats->field )
+
+        APPEND_COMPR_STAT( calls );
+        APPEND_COMPR_STAT( failed );
+        APPEND_COMPR_STAT( bytes_in );
+        APPEND_COMPR_STAT( bytes_out );
+
+#undef APPEND_COMPR_STAT
+    }
+
+    for( i = 0; i < server->nlisteners; ++i )
+    {
+        gbListener *listener = &server->listeners[i];
+
+        snprintf( k, 0xFF, "listener_%zu_address", i );
+        if( listener->type == TCP )
+            snprintf( s, 0xFF, "%s:%d", listener->address, listener->port );
+        else
+            snprintf( s, 0xFF, "unix:%s", listener->address );
+        APPEND_STRING_STAT( k, s );
+
+#define APPEND_LISTENER_STAT( field ) snprintf( k, 0xFF, "listener_%zu_" #field, i ); \
+    APPEND_LONG_STAT( k, listener->field )
+
+        APPEND_LISTENER_STAT( connections );
+        APPEND_LISTENER_STAT( rejected );
+        APPEND_LISTENER_STAT( nclients );
+
+#undef APPEND_LISTENER_STAT
+    }
+
     APPEND_FLOAT_STAT( "reqs_per_client_avg",       server->stats.requests / (double)server->stats.connections );
+#define APPEND_HISTOGRAM_STAT( prefix, hist ) \
+    APPEND_LONG_STAT( prefix "_count",   (hist)->count ); \
+    APPEND_FLOAT_STAT( prefix "_avg_us",  (hist)->count ? (double)(hist)->sum / (hist)->count / 1e3 : 0.0 ); \
+    APPEND_FLOAT_STAT( prefix "_p50_us",  gbHistogramPercentile( hist, 0.50 ) / 1e3 ); \
+    APPEND_FLOAT_STAT( prefix "_p99_us",  gbHistogramPercentile( hist, 0.99 ) / 1e3 ); \
+    APPEND_FLOAT_STAT( prefix "_p999_us", gbHistogramPercentile( hist, 0.999 ) / 1e3 ); \
+    APPEND_FLOAT_STAT( prefix "_max_us",  (hist)->max / 1e3 )
+
+    APPEND_LONG_STAT( "loop_lagged",                server->events->lagged );
+    APPEND_HISTOGRAM_STAT( "loop_busy",             &server->events->busy_hist );
+    APPEND_HISTOGRAM_STAT( "loop_file_events",      &server->events->file_hist );
+    APPEND_HISTOGRAM_STAT( "loop_time_events",      &server->events->time_hist );
+    APPEND_HISTOGRAM_STAT( "cron_total",            &server->stats.cron_total );
+    APPEND_HISTOGRAM_STAT( "cron_expire",           &server->stats.cron_expire );
+    APPEND_HISTOGRAM_STAT( "cron_reap",             &server->stats.cron_reap );
+    APPEND_HISTOGRAM_STAT( "cron_gc",               &server->stats.cron_gc );
+    APPEND_HISTOGRAM_STAT( "cron_log",              &server->stats.cron_log );
+
+#undef APPEND_HISTOGRAM_STAT
+
+    APPEND_LONG_STAT( "op_stats_since",             server->stats.ops_since );
+
+    // only opcodes which have been used since the last reset
+    for( i = 0; i < GB_MAX_OPCODES; ++i )
+    {
+        gbOpStats *ostats = &server->stats.ops[i];
+        const char *name = gbOpcodeNames[i];
+
+        if( name == NULL || ostats->calls == 0 )
+            continue;
+
+#define APPEND_OP_STAT( field, value ) snprintf( k, 0xFF, "op_%s_" field, name ); \
+    APPEND_LONG_STAT( k, value )
+
+#define APPEND_OP_LATENCY( field, value ) snprintf( k, 0xFF, "op_%s_" field, name ); \
+    APPEND_FLOAT_STAT( k, (value) / 1e3 )
+
+        APPEND_OP_STAT( "calls",         ostats->calls );
+        APPEND_OP_STAT( "failed",        ostats->failed );
+        APPEND_OP_STAT( "err",           ostats->errors[REPL_ERR] );
+        APPEND_OP_STAT( "err_not_found", ostats->errors[REPL_ERR_NOT_FOUND] );
+        APPEND_OP_STAT( "err_nan",       ostats->errors[REPL_ERR_NAN] );
+        APPEND_OP_STAT( "err_mem",       ostats->errors[REPL_ERR_MEM] );
+        APPEND_OP_STAT( "err_locked",    ostats->errors[REPL_ERR_LOCKED] );
+
+        APPEND_OP_LATENCY( "avg_us",  (double)ostats->latency.sum / ostats->latency.count );
+        APPEND_OP_LATENCY( "p50_us",  gbHistogramPercentile( &ostats->latency, 0.50 ) );
+        APPEND_OP_LATENCY( "p99_us",  gbHistogramPercentile( &ostats->latency, 0.99 ) );
+        APPEND_OP_LATENCY( "p999_us", gbHistogramPercentile( &ostats->latency, 0.999 ) );
+        APPEND_OP_LATENCY( "max_us",  ostats->latency.max );
+
+#undef APPEND_OP_STAT
+#undef APPEND_OP_LATENCY
+    }
 
 #undef APPEND_LONG_STAT
 #undef APPEND_STRING_STAT
 
     int ret = gbClientEnqueueKeyValueSet( client, elems, gbWriteReplyHandler, 0 );
 
-    ll_foreach_2( server->m_keys, server->m_values, ki, vi )
+    ll_foreach_2( server->engine.m_keys, server->engine.m_values, ki, vi )
     {
         if( vi->data != NULL )
         {
             gbDestroyVolatileItem( server, vi->data );
             vi->data = NULL;
         }
-
-        // no need to free ki->data since it's static
     }
 
-    ll_reset( server->m_keys );
-    ll_reset( server->m_values );
+    gbEngineReleaseResults( &server->engine );
 
     return ret;
 }
@@ -1287,7 +1064,7 @@ static int gbGetItemMeta( gbServer *server, gbItem *item, byte_t *m, size_t mlen
     }
     else if( strncmp( (char *)m, "left", min( mlen, 4 ) ) == 0 )
     {
-        *v = item->ttl <= 0 ? -1 : item->ttl - ( server->stats.time - item->time );
+        *v = item->ttl <= 0 ? -1 : item->ttl - ( server->engine.time - item->time );
         return 1;
     }
     else if( strncmp( (char *)m, "lock", min( mlen, 4 ) ) == 0 )
@@ -1299,7 +1076,7 @@ static int gbGetItemMeta( gbServer *server, gbItem *item, byte_t *m, size_t mlen
     return 0;
 }
 
-static int gbQueryMetaHandler( gbClient *client, byte_t *p )
+static int gbQueryMetaHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1312,10 +1089,10 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
     long v = 0;
     int ret = 0;
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &m, &klen, &mlen ) )
+    if( gbParseKeyValue( client, p, size, &k, &m, &klen, &mlen ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
-        if(node && node->data && gbIsNodeStillValid( node, node->data, server, 1 ) )
+        node = tr_find_node( &server->engine.tree, k, klen );
+        if(node && node->data && gbIsNodeStillValid( node, node->data, &server->engine, 1 ) )
         {
             item = node->data;
 
@@ -1327,7 +1104,7 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
                 ret = gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
             }
 
-            item->last_access_time = server->stats.time;
+            item->last_access_time = server->engine.time;
 
             return ret;
         }
@@ -1338,7 +1115,30 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
     return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryKeysHandler( gbClient *client, byte_t *p )
+typedef struct {
+    gbServer *server;
+    unsigned long index;
+}
+keys_ctx_t;
+
+static int gbKeysCallback( void *ctx, tnode_t *node, unsigned char *key, size_t keylen ) {
+    assert( ctx != NULL );
+    assert( node != NULL );
+    assert( key != NULL );
+
+    keys_ctx_t *keysctx = (keys_ctx_t *)ctx;
+    gbServer *server = keysctx->server;
+    char index[0xFF] = {0};
+    size_t ilen = sprintf( index, "%lu", keysctx->index++ );
+
+    // the matching key is the value of its index, both live in the results key blocks
+    ll_append( server->engine.m_keys, gbEngineResultKey( &server->engine, (byte_t *)index, ilen ) );
+    ll_append( server->engine.m_values, gbCreateVolatileItem( server, gbEngineResultKey( &server->engine, key, keylen ), keylen, GB_ENC_PLAIN ) );
+
+    return 1;
+}
+
+static int gbQueryKeysHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1346,40 +1146,28 @@ static int gbQueryKeysHandler( gbClient *client, byte_t *p )
     byte_t *expr = NULL;
     size_t exprlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
+    keys_ctx_t ctx = { server, 0 };
 
-    if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
+    if( gbParseKeyValue( client, p, size, &expr, NULL, &exprlen, NULL ) )
     {
-        size_t found = tr_search( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, &server->m_values, NULL );
-        long unsigned int i;
+        size_t found = tr_search_callback( &server->engine.tree, expr, exprlen, -1, server->engine.limits.maxkeysize, gbKeysCallback, &ctx );
+
+        client->items = found;
 
         if( found )
         {
-            char index[0xFF] = {0};
-            ll_item_t *key = NULL;
-
-            ll_reset( server->m_keys );
-            for( i = 0, key = server->m_values->head; i < found && key; key = key->next, ++i )
-            {
-                sprintf( index, "%lu", i );
-                ll_append( server->m_keys, zstrdup(index) );
-                // convert strings to gbItems
-                key->data = gbCreateVolatileItem( server, key->data, strlen(key->data), GB_ENC_PLAIN );
-            }
-
             int ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
 
-            ll_foreach_2( server->m_keys, server->m_values, ki, vi )
+            ll_foreach_2( server->engine.m_keys, server->engine.m_values, ki, vi )
             {
-                // free volatile item
-                gbDestroyVolatileItem( server, vi->data );
-                // free zstrdup'ed key
-                zfree( ki->data );
-                ki->data = NULL;
+                gbItem *item = vi->data;
+
+                // data belongs to the key blocks
+                item->data = NULL;
+                gbDestroyVolatileItem( server, item );
             }
 
-            ll_reset( server->m_keys );
-            ll_reset( server->m_values );
+            gbEngineReleaseResults( &server->engine );
 
             return ret;
         }
@@ -1390,79 +1178,291 @@ static int gbQueryKeysHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-int gbProcessQuery( gbClient *client )
+static int gbQueryProtoHandler( gbClient *client, byte_t *p, size_t size )
+{
+    byte_t proto;
+
+    // the payload is a single byte whatever the framing currently in use
+    if( size != 1 )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    proto = *p;
+    if( proto < GB_PROTO_V1 || proto > GB_PROTO_MAX )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    gbLog( DEBUG, "Client %d switched from protocol v%d to v%d.", client->fd, client->proto, proto );
+
+    client->proto = proto;
+
+    return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryShmHandler( gbClient *client, byte_t *p, size_t size )
+{
+    gbServer *server = client->server;
+    gbShm *shm = NULL;
+    char err[0xFF] = {0};
+    int fds[3];
+
+    // descriptors can only be passed over unix sockets, and the reply which
+    // carries them must be the only one on the wire
+    if( client->shm != NULL || client->listener == NULL || client->listener->type != UNIX || client->replies != NULL )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    if( ( shm = gbShmCreate( server->shm_ring_size, err ) ) == NULL )
+    {
+        gbLog( WARNING, "Unable to create shared memory transport: %s", err );
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+    }
+
+    if( gbCreateFileEvent( server->events, shm->server_efd, GB_READABLE, gbShmWakeupHandler, client ) == GB_ERR )
+    {
+        gbLog( WARNING, "Unable to wait for shared memory wakeups." );
+        gbShmDestroy( shm );
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+    }
+
+    fds[0] = shm->memfd;
+    fds[1] = shm->server_efd;
+    fds[2] = shm->client_efd;
+
+    // requests are being processed so the reply is only queued
+    gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+
+    if( gbClientSendFds( client, fds, 3 ) != GB_OK )
+    {
+        gbLog( WARNING, "Unable to send shared memory descriptors: %s", strerror(errno) );
+        gbDeleteFileEvent( server->events, shm->server_efd, GB_READABLE );
+        gbShmDestroy( shm );
+        return GB_ERR;
+    }
+
+    // the client has its own copy, the mapping is enough for us
+    close( shm->memfd );
+    shm->memfd = -1;
+
+    gbLog( DEBUG, "Client %d switched to the shared memory transport.", client->fd );
+
+    client->shm = shm;
+
+    return GB_OK;
+}
+
+static int gbQueryResetStatsHandler( gbClient *client, byte_t *p, size_t size )
 {
     assert( client != NULL );
-    assert( client->buffer_size >= sizeof(short) );
 
-    short  op = *(short *)&client->buffer[0];
-    byte_t *p =  client->buffer + sizeof(short);
+    gbServer *server = client->server;
 
-    ++client->server->stats.requests;
+    memset( server->stats.ops, 0x00, sizeof(server->stats.ops) );
+
+    server->events->lagged = 0;
+    gbHistogramReset( &server->events->busy_hist );
+    gbHistogramReset( &server->events->file_hist );
+    gbHistogramReset( &server->events->time_hist );
+    gbHistogramReset( &server->stats.cron_total );
+    gbHistogramReset( &server->stats.cron_expire );
+    gbHistogramReset( &server->stats.cron_reap );
+    gbHistogramReset( &server->stats.cron_gc );
+    gbHistogramReset( &server->stats.cron_log );
+
+    server->stats.ops_since = server->stats.time;
+
+    return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+}
+
+static int gbQuerySlowLogHandler( gbClient *client, byte_t *p, size_t size )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    gbServer *server = client->server;
+    gbSlowLog *log = &server->slowlog;
+    long limit = gbSlowLogLength( log );
+    size_t elems = 0, i;
+    char key[0xFF] = {0};
+    int ret;
+
+    if( size == 5 && strncasecmp( (char *)p, "reset", 5 ) == 0 )
+    {
+        gbSlowLogReset( log );
+
+        return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+    }
+    else if( size && ( !gbQueryParseLong( p, size, &limit ) || limit <= 0 ) )
+        return gbClientEnqueueCode( client, REPL_ERR_NAN, gbWriteReplyHandler, 0 );
+
+    if( limit > gbSlowLogLength( log ) )
+        limit = gbSlowLogLength( log );
+
+    if( limit == 0 )
+        return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+
+#define APPEND_SLOWOP( field, item ) do { \
+    ++elems; \
+    sprintf( key, "%lu_" field, op->id ); \
+    ll_append( server->engine.m_keys, gbEngineResultKey( &server->engine, (byte_t *)key, strlen(key) ) ); \
+    ll_append( server->engine.m_values, item ); \
+} while(0)
+
+#define APPEND_SLOWOP_LONG( field, value ) do { \
+    APPEND_SLOWOP( field, gbCreateVolatileItem( server, (void *)(long)(value), sizeof(long), GB_ENC_NUMBER ) ); \
+} while(0)
+
+#define APPEND_SLOWOP_STRING( field, value, len ) do { \
+    APPEND_SLOWOP( field, gbCreateVolatileItem( server, memcpy( zmalloc(len), value, len ), len, GB_ENC_PLAIN ) ); \
+} while(0)
+
+    // most recent first
+    for( i = 0; i < limit; ++i )
+    {
+        gbSlowOp *op = gbSlowLogGet( log, i );
+        const char *name = op->opcode > 0 && op->opcode < GB_MAX_OPCODES ? gbOpcodeNames[op->opcode] : NULL;
+
+        APPEND_SLOWOP_LONG( "time",        op->time );
+        APPEND_SLOWOP_LONG( "duration_us", op->duration / 1000 );
+        if( name )
+            APPEND_SLOWOP_STRING( "op", name, strlen(name) );
+        APPEND_SLOWOP_LONG( "code",        op->code );
+        if( op->keylen )
+        {
+            APPEND_SLOWOP_STRING( "key", op->key, min( op->keylen, GB_SLOWLOG_KEY_SIZE ) );
+            APPEND_SLOWOP_LONG( "key_size", op->keylen );
+        }
+        APPEND_SLOWOP_LONG( "items",       op->items );
+        APPEND_SLOWOP_LONG( "bytes",       op->bytes );
+        APPEND_SLOWOP_STRING( "client", op->client, strlen(op->client) );
+    }
+
+#undef APPEND_SLOWOP_STRING
+#undef APPEND_SLOWOP_LONG
+#undef APPEND_SLOWOP
 
+    ret = gbClientEnqueueKeyValueSet( client, elems, gbWriteReplyHandler, 0 );
+
+    ll_foreach_2( server->engine.m_keys, server->engine.m_values, ki, vi )
+    {
+        gbDestroyVolatileItem( server, vi->data );
+    }
+
+    gbEngineReleaseResults( &server->engine );
+
+    return ret;
+}
+
+// fill a slow log entry for the request just processed
+static void gbSlowLogRecord( gbClient *client, short op, byte_t *p, size_t size, uint64_t duration )
+{
+    gbServer *server = client->server;
+    gbSlowOp *slow = gbSlowLogAdd( &server->slowlog );
+    byte_t *t = NULL, *k = NULL, *v = NULL;
+    size_t tlen = 0, klen = 0, vlen = 0;
+    char ip[0xFF] = {0};
+    int port = 0;
+
+    slow->time     = server->stats.time;
+    slow->duration = duration;
+    slow->opcode   = op;
+    slow->code     = client->reply_code;
+    slow->bytes    = client->reply_size;
+    slow->items    = client->items;
+
+    // key or prefix, every request but SET and BSET has it as first argument,
+    // batch requests record their first key
+    if( size > 0 && ( ( op <= OP_KEYS && op != OP_STATS && op != OP_PING ) || ( op >= OP_BGET && op <= OP_BDEL ) ) )
+    {
+        if( op == OP_SET || op == OP_BSET )
+            gbParseTtlKeyValue( client, p, size, &t, &k, &v, &tlen, &klen, &vlen );
+        else
+            gbParseKeyValue( client, p, size, &k, NULL, &klen, NULL );
+
+        if( k && klen )
+        {
+            slow->keylen = klen;
+            memcpy( slow->key, k, min( klen, GB_SLOWLOG_KEY_SIZE ) );
+
+            // single key operations touch one item when they succeed
+            if( slow->items == 0 && ( client->reply_code == REPL_OK || client->reply_code == REPL_VAL ) )
+                slow->items = 1;
+        }
+    }
+
+    if( client->listener && client->listener->type == UNIX )
+        snprintf( slow->client, GB_SLOWLOG_CLIENT_SIZE, "unix:%d", client->fd );
+    else
+    {
+        gbNetPeerToString( client->fd, ip, &port );
+        snprintf( slow->client, GB_SLOWLOG_CLIENT_SIZE, "%s:%d", ip, port );
+    }
+
+    gbLog( DEBUG, "Slow %s request from %s took %lluus.", gbOpcodeNames[op] ? gbOpcodeNames[op] : "?", slow->client, (unsigned long long)( duration / 1000 ) );
+}
+
+static int gbDispatchQuery( gbClient *client, short op, byte_t *p, size_t size )
+{
     if( op == OP_GET )
     {
-        return gbQueryGetHandler( client, p );
+        return gbQueryGetHandler( client, p, size );
     }
     else if( op == OP_SET )
     {
-        return gbQuerySetHandler( client, p );
+        return gbQuerySetHandler( client, p, size );
     }
     else if( op == OP_TTL )
     {
-        return gbQueryTtlHandler( client, p );
+        return gbQueryTtlHandler( client, p, size );
     }
     else if( op == OP_MSET )
     {
-        return gbQueryMultiSetHandler( client, p );
+        return gbQueryMultiSetHandler( client, p, size );
     }
     else if( op == OP_MTTL )
     {
-        return gbQueryMultiTtlHandler( client, p );
+        return gbQueryMultiTtlHandler( client, p, size );
     }
     else if( op == OP_MGET )
     {
-        return gbQueryMultiGetHandler( client, p );
+        return gbQueryMultiGetHandler( client, p, size );
     }
     else if( op == OP_DEL )
     {
-        return gbQueryDelHandler( client, p );
+        return gbQueryDelHandler( client, p, size );
     }
     else if( op == OP_MDEL )
     {
-        return gbQueryMultiDelHandler( client, p );
+        return gbQueryMultiDelHandler( client, p, size );
     }
     else if( op == OP_INC || op == OP_DEC )
     {
-        return gbQueryIncDecHandler( client, p, op == OP_INC ? +1 : -1 );
+        return gbQueryIncDecHandler( client, p, size, op == OP_INC ? +1 : -1 );
     }
     else if( op == OP_MINC || op == OP_MDEC )
     {
-        return gbQueryMultiIncDecHandler( client, p, op == OP_MINC ? +1 : -1 );
+        return gbQueryMultiIncDecHandler( client, p, size, op == OP_MINC ? +1 : -1 );
     }
     else if( op == OP_LOCK )
     {
-        return gbQueryLockHandler( client, p );
+        return gbQueryLockHandler( client, p, size );
     }
     else if( op == OP_MLOCK )
     {
-        return gbQueryMultiLockHandler( client, p );
+        return gbQueryMultiLockHandler( client, p, size );
     }
     else if( op == OP_UNLOCK )
     {
-        return gbQueryUnlockHandler( client, p );
+        return gbQueryUnlockHandler( client, p, size );
     }
     else if( op == OP_MUNLOCK )
     {
-        return gbQueryMultiUnlockHandler( client, p );
+        return gbQueryMultiUnlockHandler( client, p, size );
     }
     else if( op == OP_COUNT )
     {
-        return gbQueryCountHandler( client, p );
+        return gbQueryCountHandler( client, p, size );
     }
     else if( op == OP_STATS )
     {
-        return gbQueryStatsHandler( client, p );
+        return gbQueryStatsHandler( client, p, size );
     }
     else if( op == OP_PING )
     {
@@ -1470,11 +1470,39 @@ int gbProcessQuery( gbClient *client )
     }
     else if( op == OP_META )
     {
-        return gbQueryMetaHandler( client, p );
+        return gbQueryMetaHandler( client, p, size );
     }
     else if( op == OP_KEYS )
     {
-        return gbQueryKeysHandler( client, p );
+        return gbQueryKeysHandler( client, p, size );
+    }
+    else if( op == OP_PROTO )
+    {
+        return gbQueryProtoHandler( client, p, size );
+    }
+    else if( op == OP_SHM )
+    {
+        return gbQueryShmHandler( client, p, size );
+    }
+    else if( op == OP_RESETSTATS )
+    {
+        return gbQueryResetStatsHandler( client, p, size );
+    }
+    else if( op == OP_SLOWLOG )
+    {
+        return gbQuerySlowLogHandler( client, p, size );
+    }
+    else if( op == OP_BGET )
+    {
+        return gbQueryBatchGetHandler( client, p, size );
+    }
+    else if( op == OP_BSET )
+    {
+        return gbQueryBatchSetHandler( client, p, size );
+    }
+    else if( op == OP_BDEL )
+    {
+        return gbQueryBatchDelHandler( client, p, size );
     }
     else if( op == OP_END )
     {
@@ -1483,3 +1511,63 @@ int gbProcessQuery( gbClient *client )
     else
         return GB_ERR;
 }
+
+int gbProcessQuery( gbClient *client )
+{
+    assert( client != NULL );
+    assert( client->buffer_size >= sizeof(short) );
+
+    byte_t *p =  client->buffer + sizeof(short);
+    size_t size = client->buffer_size - sizeof(short);
+    gbOpStats *stats = NULL;
+    uint64_t start = 0, elapsed = 0;
+    short  op;
+    int    ret;
+
+    // requests are not aligned inside the client input buffer
+    memcpy( &op, client->buffer, sizeof(short) );
+
+    // tagged request, the tag is right after the opcode
+    if( op & OP_TAGGED )
+    {
+        if( size < sizeof(uint32_t) )
+            return GB_ERR;
+
+        memcpy( &client->tag, p, sizeof(uint32_t) );
+
+        client->tagged = 1;
+        op   &= ~OP_TAGGED;
+        p    += sizeof(uint32_t);
+        size -= sizeof(uint32_t);
+    }
+
+    ++client->server->stats.requests;
+
+    // unknown opcodes have no stats slot and are never logged as slow
+    if( op <= 0 || op >= GB_MAX_OPCODES || gbOpcodeNames[op] == NULL )
+        return gbDispatchQuery( client, op, p, size );
+
+    stats = &client->server->stats.ops[op];
+
+    client->reply_code = REPL_OK;
+    client->reply_size = 0;
+    client->items      = 0;
+
+    // only the dispatch is measured, not the parsing nor the bookkeeping below
+    start   = gbHistogramClock();
+    ret     = gbDispatchQuery( client, op, p, size );
+    elapsed = gbHistogramClock() - start;
+
+    gbHistogramAdd( &stats->latency, elapsed );
+
+    if( elapsed >= client->server->slowlog.threshold && gbSlowLogEnabled( &client->server->slowlog ) )
+        gbSlowLogRecord( client, op, p, size, elapsed );
+
+    ++stats->calls;
+    if( ret != GB_OK )
+        ++stats->failed;
+    else if( client->reply_code >= REPL_ERR && client->reply_code <= REPL_ERR_LOCKED )
+        ++stats->errors[ client->reply_code ];
+
+    return ret;
+}
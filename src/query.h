@@ -56,8 +56,22 @@
 #define OP_PING    19
 #define OP_META    20
 #define OP_KEYS    21
+#define OP_PROTO   22
+#define OP_SHM     23
+#define OP_RESETSTATS 24
+#define OP_SLOWLOG 25
+#define OP_BGET    26
+#define OP_BSET    27
+#define OP_BDEL    28
 #define OP_END    0xFF
 
+/*
+ * When set in the opcode, a 4 bytes tag chosen by the client follows it
+ * and the reply carries the same tag right after its code, which has the
+ * REPL_TAGGED bit set. Replies to tagged requests may be sent out of order.
+ */
+#define OP_TAGGED  0x4000
+
 /*
  * Reply
  */
@@ -70,7 +84,8 @@
 #define REPL_VAL 		   6
 #define REPL_KVAL		   7
 
-void gbDestroyItem( gbServer *server, gbItem *item );
+#define REPL_TAGGED        0x4000
+
 int  gbProcessQuery( gbClient *client );
 
 #endif
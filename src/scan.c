@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "scan.h"
+#include <assert.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#   define HAVE_SCAN_SSE2 1
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 5 && ( defined(__x86_64__) || defined(__i386__) )
+#   include <immintrin.h>
+#   define HAVE_SCAN_AVX2 1
+#endif
+
+typedef size_t (*gbScanProc)( const unsigned char *, size_t, unsigned char );
+
+static size_t gbScanDelimiterScalar( const unsigned char *buffer, size_t len, unsigned char delim )
+{
+    register size_t i;
+
+    for( i = 0; i < len; ++i )
+    {
+        if( buffer[i] == delim )
+            return i;
+    }
+
+    return len;
+}
+
+#ifdef HAVE_SCAN_SSE2
+static size_t gbScanDelimiterSSE2( const unsigned char *buffer, size_t len, unsigned char delim )
+{
+    const __m128i needle = _mm_set1_epi8( delim );
+    register size_t i = 0;
+    int mask;
+
+    // compare 16 bytes at a time, the movemask has a bit set for every match
+    for( ; i + 16 <= len; i += 16 )
+    {
+        mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( buffer + i ) ), needle ) );
+        if( mask )
+            return i + __builtin_ctz( mask );
+    }
+
+    return i + gbScanDelimiterScalar( buffer + i, len - i, delim );
+}
+#endif
+
+#ifdef HAVE_SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t gbScanDelimiterAVX2( const unsigned char *buffer, size_t len, unsigned char delim )
+{
+    const __m256i needle = _mm256_set1_epi8( delim );
+    register size_t i = 0;
+    unsigned int mask;
+
+    for( ; i + 32 <= len; i += 32 )
+    {
+        mask = _mm256_movemask_epi8( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( buffer + i ) ), needle ) );
+        if( mask )
+            return i + __builtin_ctz( mask );
+    }
+
+    return i + gbScanDelimiterScalar( buffer + i, len - i, delim );
+}
+#endif
+
+static gbScanProc gbScanSelect()
+{
+#ifdef HAVE_SCAN_AVX2
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports( "avx2" ) )
+        return gbScanDelimiterAVX2;
+#endif
+
+#ifdef HAVE_SCAN_SSE2
+    return gbScanDelimiterSSE2;
+#else
+    return gbScanDelimiterScalar;
+#endif
+}
+
+static gbScanProc __scan_proc = NULL;
+
+size_t gbScanDelimiter( const unsigned char *buffer, size_t len, unsigned char delim )
+{
+    assert( buffer != NULL || len == 0 );
+
+    if( __builtin_expect( __scan_proc == NULL, 0 ) )
+        __scan_proc = gbScanSelect();
+
+    return __scan_proc( buffer, len, delim );
+}
@@ -54,8 +54,8 @@ void gbOOM(size_t size)
          max[0xFF] = {0},
          uptime[0xFF] = {0};
 
-    gbMemFormat( server.stats.memused, used, 0xFF );
-    gbMemFormat( server.limits.maxmem, max,  0xFF );
+    gbMemFormat( server.engine.stats.memused, used, 0xFF );
+    gbMemFormat( server.engine.limits.maxmem, max,  0xFF );
     gbServerFormatUptime( &server, uptime );
 
     gbLog( CRITICAL, "Out of memory trying to allocate %zu bytes.", size );
@@ -67,7 +67,7 @@ void gbOOM(size_t size)
     gbLog( CRITICAL, "  Version         : %s", VERSION );
     gbLog( CRITICAL, "  Uptime          : %s", uptime );
     gbLog( CRITICAL, "  Memory Used     : %s/%s", used, max );
-    gbLog( CRITICAL, "  Current Items   : %d", server.stats.nitems );
+    gbLog( CRITICAL, "  Current Items   : %d", server.engine.stats.nitems );
     gbLog( CRITICAL, "  Current Clients : %d", server.stats.nclients );
 
     gbLogFinalize();
@@ -75,181 +75,267 @@ void gbOOM(size_t size)
     abort();
 }
 
-void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+// process every complete request buffered in the client input, returns
+// GB_ERR if the client had to be destroyed
+static int gbClientProcessInput( gbEventLoop *el, gbClient *client )
 {
-    assert( el != NULL );
-    assert( privdata != NULL );
+    gbServer *server = client->server;
+    uint32_t size = 0;
+    size_t avail = 0;
 
-    gbClient *client = privdata;
-    ssize_t nwrote;
-    size_t towrite = 0;
+    // replies are sent all together once the buffered requests are processed
+    client->corked = 1;
 
-    if( client->status == STATUS_SENDING_REPLY )
+    // stop when reading is paused or the client is shutting down
+    while( gbGetFileEvents( el, client->fd ) & GB_READABLE )
     {
-        towrite = client->buffer_size - client->wrote;
-
-        assert( towrite >= 0 );
+        avail = client->input_len - client->input_pos;
+        if( avail < sizeof(uint32_t) )
+            break;
 
-        nwrote = write( client->fd, client->buffer + client->wrote, towrite );
+        memcpy( &size, client->input + client->input_pos, sizeof(uint32_t) );
 
-        if(nwrote == -1)
+        // make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
+        if( size > server->limits.maxrequestsize || size < sizeof(short) )
         {
-            if (errno == EAGAIN)
-            {
-                nwrote = 0;
-            }
-            else
-            {
-                gbLog( DEBUG, "Error writing to client: %s",strerror(errno));
-                gbClientDestroy(client);
-                return;
-            }
+            gbLog( WARNING, "Client request size %d invalid.", size );
+            gbClientDestroy(client);
+            return GB_ERR;
         }
-        else if(nwrote == 0)
+        // wait for the rest of the request
+        else if( avail < sizeof(uint32_t) + size )
+            break;
+
+        client->buffer      = client->input + client->input_pos + sizeof(uint32_t);
+        client->buffer_size = size;
+
+        if( gbProcessQuery(client) != GB_OK )
         {
-            gbLog( DEBUG, "Client closed connection.");
+            size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
+            short op;
+
+            memcpy( &op, client->buffer, sizeof(short) );
+
+            gbLog( WARNING, "Malformed query, dropping client." );
+            gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, op, sz );
+            gbLogDumpBuffer( WARNING, client->buffer, sz );
+
             gbClientDestroy(client);
-            return;
+            return GB_ERR;
         }
-        else
+
+        client->input_pos += sizeof(uint32_t) + size;
+
+        gbClientReset(client);
+
+        // stop reading if the client is not reading its replies
+        if( client->shutdown == 0 && client->pending >= server->limits.maxresponsesize )
         {
-            client->wrote += nwrote;
-            client->seen = client->server->stats.time;
+            gbLog( DEBUG, "Client has %lu bytes of pending replies, pausing requests.", client->pending );
+            gbDeleteFileEvent( el, client->fd, GB_READABLE );
+        }
+    }
 
-            if( client->wrote == client->buffer_size )
-            {
-                if( client->shutdown )
-                {
-                    gbLog( DEBUG, "Client shutdown." );
-                    gbClientDestroy(client);
-                }
-                else
-                {
-                    gbClientReset(client);
-                    gbDeleteFileEvent( client->server->events, client->fd, GB_WRITABLE );
-                }
-            }
+    client->corked = 0;
 
+    // keep the leftover bytes at the beginning of the buffer
+    avail = client->input_len - client->input_pos;
+    if( avail == 0 )
+    {
+        // give back the memory used by a big request
+        if( client->input_size > GBNET_DEFAULT_INPUT_BUFFER_SIZE )
+        {
+            zfree( client->input );
+            client->input      = NULL;
+            client->input_size = 0;
         }
     }
-    else
+    else if( client->input_pos > 0 )
     {
-        assert(0);
+        memmove( client->input, client->input + client->input_pos, avail );
+    }
+
+    client->input_len = avail;
+    client->input_pos = 0;
+
+    // make sure a partial request can be read entirely, invalid sizes are
+    // handled once the request is parsed
+    if( avail >= sizeof(uint32_t) )
+    {
+        memcpy( &size, client->input, sizeof(uint32_t) );
 
-        gbLog( WARNING, "Unexpected status %d for client while sending response.", client->status );
+        if( size <= server->limits.maxrequestsize && sizeof(uint32_t) + size > client->input_size )
+        {
+            client->input_size = sizeof(uint32_t) + size;
+            client->input      = zrealloc( client->input, client->input_size );
+        }
+    }
+
+    if( client->replies && gbClientFlushReplies( client, gbWriteReplyHandler ) != GB_OK )
+    {
+        gbLog( WARNING, "Unable to wait for client writable state." );
         gbClientDestroy(client);
+        return GB_ERR;
     }
+
+    return GB_OK;
 }
 
-void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask )
 {
     assert( el != NULL );
     assert( privdata != NULL );
 
-    gbClient *client = ( gbClient * )privdata;
+    gbClient *client = privdata;
     gbServer *server = client->server;
-    byte_t   *p = NULL;
-    int nread = 0, toread = 0;
 
-    assert( server != NULL );
+    if( gbClientSendReplies( client ) != GB_OK )
+    {
+        gbLog( DEBUG, "Error writing to client: %s",strerror(errno));
+        gbClientDestroy(client);
+        return;
+    }
+    else if( gbClientShutdownSent( client ) )
+    {
+        gbLog( DEBUG, "Client shutdown." );
+        gbClientDestroy(client);
+        return;
+    }
 
-    // we're still readying the buffer size from the socket
-    if( client->status == STATUS_WAITING_SIZE )
+    // shared memory clients wake us up when there's room for the rest, the
+    // event loop calls us back once it's done sending
+    if( client->replies == NULL || client->shm != NULL || client->sending )
     {
-        toread = sizeof(uint32_t) - client->read;
-        // keep reading it
-        if( toread > 0 )
+        gbDeleteFileEvent( el, client->fd, GB_WRITABLE );
+    }
+
+    // resume reading requests if they were paused because too much data was pending
+    if( client->shutdown == 0 && client->pending < server->limits.maxresponsesize && ( gbGetFileEvents( el, client->fd ) & GB_READABLE ) == 0 )
+    {
+        if( gbCreateFileEvent( el, client->fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR )
         {
-            p = (byte_t *)( &client->buffer_size + client->read );
+            gbLog( WARNING, "Unable to wait for client readable state." );
+            gbClientDestroy( client );
+            return;
         }
-        // we're done, start reading the buffer
-        else
-        {
-            client->read   = 0;
-            client->status = STATUS_WAITING_BUFFER;
-            // make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
-            if( client->buffer_size > server->limits.maxrequestsize || client->buffer_size < sizeof(short) )
-            {
-                gbLog( WARNING, "Client request size %d invalid.", client->buffer_size );
-                gbClientDestroy(client);
-                return;
-            }
-            // allocate buffer for the incoming request
-            else
-            {
-                client->buffer = zmalloc( client->buffer_size );
 
-                assert( client->buffer != NULL );
-            }
-        }
+        // requests already buffered won't make the socket readable again
+        gbClientProcessInput( el, client );
     }
+}
 
-    // we are reading the buffer ( of client->buffer_size total bytes )
-    if( client->status == STATUS_WAITING_BUFFER )
+// the shared memory client wrote new requests or made room for our replies
+void gbShmWakeupHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+{
+    assert( el != NULL );
+    assert( privdata != NULL );
+
+    gbClient *client = privdata;
+    gbServer *server = client->server;
+    size_t nread = 0;
+
+    assert( client->shm != NULL );
+
+    gbShmClearWakeup( client->shm );
+
+    if( gbClientSendReplies( client ) != GB_OK || gbClientShutdownSent( client ) )
     {
-        toread = client->buffer_size - client->read;
-        if( toread > 0 )
-        {
-            p = client->buffer + client->read;
-        }
-        // nothing left to read
-        else
-        {
-            // we should never have more incoming bytes than specified by the protocol
-            // but since it's handled anyway, just assert this in the debug build
-            assert( toread == 0 );
+        gbLog( DEBUG, "Client shutdown." );
+        gbClientDestroy( client );
+        return;
+    }
 
-            client->read   = 0;
-            client->status = STATUS_SENDING_REPLY;
+    // resume reading requests if they were paused because too much data was pending
+    if( client->shutdown == 0 && client->pending < server->limits.maxresponsesize && ( gbGetFileEvents( el, client->fd ) & GB_READABLE ) == 0 )
+    {
+        if( gbCreateFileEvent( el, client->fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR )
+        {
+            gbLog( WARNING, "Unable to wait for client readable state." );
+            gbClientDestroy( client );
+            return;
         }
     }
 
-    // if we still have something to read
-    if( client->status != STATUS_SENDING_REPLY )
+    // the ring takes the place of the socket, requests are copied into the
+    // input buffer and parsed exactly the same way
+    while( gbGetFileEvents( el, client->fd ) & GB_READABLE )
     {
-        nread = read( fd, p, toread );
-        if (nread == -1)
+        if( client->input == NULL )
         {
-            // try again, operation failed
-            if (errno == EAGAIN)
-            {
-                nread = 0;
-            }
-            else
-            {
-                gbLog( WARNING, "Error reading from client: %s",strerror(errno));
-                gbClientDestroy(client);
-                return;
-            }
-            // bye bye dear client ^_^
+            client->input_size = GBNET_DEFAULT_INPUT_BUFFER_SIZE;
+            client->input      = zmalloc( client->input_size );
+
+            assert( client->input != NULL );
         }
-        else if (nread == 0)
+
+        nread = gbShmReadRequests( client->shm, client->input + client->input_len, client->input_size - client->input_len );
+        if( nread == GB_SHM_CORRUPTED )
         {
-            gbLog( DEBUG, "Client closed connection.");
-            gbClientDestroy(client);
+            gbLog( WARNING, "Client corrupted the shared memory requests ring." );
+            gbClientDestroy( client );
             return;
         }
+        else if( nread == 0 )
+            break;
+
+        client->input_len += nread;
+
+        gbClientTouch( client );
+
+        if( gbClientProcessInput( el, client ) != GB_OK )
+            return;
     }
 
-    client->read += nread;
-    client->seen = client->server->stats.time;
+    // the client could be waiting for room in the requests ring
+    gbShmNotify( client->shm );
+}
 
-    // process the query only if we were reading it and the request is complete
-    if( client->status == STATUS_WAITING_BUFFER && client->read == client->buffer_size )
+void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+{
+    assert( el != NULL );
+    assert( privdata != NULL );
+
+    gbClient *client = ( gbClient * )privdata;
+    ssize_t nread = 0;
+
+    assert( client->server != NULL );
+
+    if( client->input == NULL )
     {
-        client->status = STATUS_SENDING_REPLY;
+        client->input_size = GBNET_DEFAULT_INPUT_BUFFER_SIZE;
+        client->input      = zmalloc( client->input_size );
 
-        if( gbProcessQuery(client) != GB_OK )
-        {
-            size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
+        assert( client->input != NULL );
+    }
 
-            gbLog( WARNING, "Malformed query, dropping client." );
-            gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, *(short *)&client->buffer[0], sz );
-            gbLogDumpBuffer( WARNING, client->buffer, sz );
+    assert( client->input_len < client->input_size );
 
+    // read as much as the socket offers, there could be more requests
+    nread = gbEventLoopRecv( el, fd, client->input + client->input_len, client->input_size - client->input_len );
+    if (nread == -1)
+    {
+        // try again, operation failed
+        if (errno != EAGAIN)
+        {
+            gbLog( WARNING, "Error reading from client: %s",strerror(errno));
             gbClientDestroy(client);
         }
+
+        return;
+    }
+    // bye bye dear client ^_^
+    else if (nread == 0)
+    {
+        gbLog( DEBUG, "Client closed connection.");
+        gbClientDestroy(client);
+        return;
     }
+
+    client->input_len += nread;
+
+    gbClientTouch( client );
+
+    gbClientProcessInput( el, client );
 }
 
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
@@ -257,95 +343,82 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
     assert( e != NULL );
     assert( privdata != NULL );
 
-    int client_port = 0, client_fd;
+    int client_port = 0, client_fd, max = GBNET_MAX_ACCEPTS_PER_CALL;
     char client_ip[128] = {0};
-    gbServer *server = (gbServer *)privdata;
+    gbListener *listener = (gbListener *)privdata;
+    gbServer *server = listener->server;
 
-    if( server->type == TCP )
-        client_fd = gbNetTcpAccept( server->error, fd, client_ip, &client_port );
-    else
-        client_fd = gbNetUnixAccept( server->error, fd );
-
-    if (client_fd == GB_ERR)
+    // drain the backlog, after a reconnect storm we don't want to serve
+    // a single new connection per loop iteration
+    while( max-- )
     {
-        gbLog( WARNING, "Error accepting client connection: %s", server->error );
-        return;
-    }
-    else if( server->stats.nclients >= server->limits.maxclients )
-    {
-        close(client_fd);
-        client_fd = -1;
-        gbLog( WARNING, "Dropping connection, current clients = %d, max = %d.", server->stats.nclients, server->limits.maxclients );
-    }
+        if( listener->type == TCP )
+            client_fd = gbNetTcpAccept( server->error, fd, client_ip, &client_port );
+        else
+            client_fd = gbNetUnixAccept( server->error, fd );
 
-    gbLog( DEBUG, "New connection from %s:%d", *client_ip ? client_ip : server->address, client_port );
+        if (client_fd == GB_ERR)
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+                gbLog( WARNING, "Error accepting client connection: %s", server->error );
 
-    if (client_fd != -1)
-    {
-        gbNetNonBlock(NULL,client_fd);
-        gbNetEnableTcpNoDelay(NULL,client_fd);
-        gbNetKeepAlive(NULL,client_fd,server->limits.maxidletime);
+            return;
+        }
+        else if( server->stats.nclients >= server->limits.maxclients )
+        {
+            close(client_fd);
+            ++listener->rejected;
+            gbLog( WARNING, "Dropping connection, current clients = %d, max = %d.", server->stats.nclients, server->limits.maxclients );
+            continue;
+        }
+
+        gbLog( DEBUG, "New connection from %s:%d", *client_ip ? client_ip : listener->address, client_port );
+
+        // the client socket is already non blocking, on Linux it also
+        // inherits TCP_NODELAY and keepalive from the server socket
+#ifndef __linux__
+        if( listener->type == TCP )
+        {
+            gbNetEnableTcpNoDelay(NULL,client_fd);
+            gbNetKeepAlive(NULL,client_fd,server->limits.maxidletime);
+        }
+#endif
 
         ++server->stats.connections;
+        ++listener->connections;
+        ++listener->nclients;
 
         gbClient *client = gbClientCreate(client_fd,server);
 
         assert( client != NULL );
 
+        client->listener = listener;
+
+        gbEventLoopAttachStream( e, client_fd );
+
         if( gbCreateFileEvent( e, client_fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR )
         {
             gbLog( WARNING, "Unable to wait for client readable state." );
             gbClientDestroy( client );
-            close(client_fd);
-            return;
         }
     }
-    else
-    {
-        gbLog( WARNING, "Accept error: %s ( %d )", server->error, errno );
-    }
 }
 
-#define GB_DEL_ITEM(s,n,i) (n)->data = NULL; gbDestroyItem( (s), (i) )
-
-void gbMemoryFreeHandler( tnode_t *node, size_t level, void *data )
-{
-    assert( node != NULL );
-    assert( data != NULL );
-
-    gbServer *server = data;
-    gbItem	 *item = node->data;
-    time_t	  eta = item ? ( server->stats.time - item->last_access_time ) : 0;
-
-    // item is older enough to be deleted
-    if( eta && eta >= server->gc_ratio )
-    {
-        gbLog( DEBUG, "[OOM] Removing item %p since wasn't accessed from %lus.", item, eta );
-
-        GB_DEL_ITEM( server, node, item );
-    }
-}
+#define CRON_EVERY(_ms_) if ((_ms_ <= server->cronperiod) || !(server->stats.crondone % ((_ms_)/server->cronperiod)))
 
-void gbHandleDeadTTLHandler( tnode_t *node, size_t level, void *data )
+// account the time spent in a cron phase, started at 'start', and return the current time
+static uint64_t gbServerCronPhaseDone( gbServer *server, gbHistogram *hist, const char *phase, uint64_t start )
 {
-    assert( node != NULL );
-    assert( data != NULL );
+    uint64_t now = gbHistogramClock();
 
-    gbServer *server = data;
-    gbItem	 *item = node->data;
-    time_t	  eta = item ? ( server->stats.time - item->time ) : 0;
+    gbHistogramAdd( hist, now - start );
 
-    // item is older enough to be deleted
-    if( item && item->ttl > 0 && eta >= item->ttl )
-    {
-        gbLog( DEBUG, "[CRON] TTL of %ds expired for item at %p.", item->ttl, item );
+    if( server->events->lag_threshold && now - start > server->events->lag_threshold )
+        gbLog( WARNING, "Cron %s phase took %llums.", phase, (unsigned long long)( now - start ) / 1000000 );
 
-        GB_DEL_ITEM( server, node, item );
-    }
+    return now;
 }
 
-#define CRON_EVERY(_ms_) if ((_ms_ <= server->cronperiod) || !(server->stats.crondone % ((_ms_)/server->cronperiod)))
-
 int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
 {
     assert( eventLoop != NULL );
@@ -358,10 +431,12 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
          freed[0xFF] = {0},
          uptime[0xFF] = {0},
          avgsize[0xFF] = {0};
-    unsigned long mem_before = 0, items_before = 0;
+    unsigned long mem_before = 0, reaped = 0;
     long mem_freed = 0, items_freed = 0;
+    uint64_t start = gbHistogramClock(), phase = start;
 
-    server->stats.time = now;
+    server->stats.time  =
+    server->engine.time = now;
 
     // shutdown requested
     if( server->shutdown ){
@@ -371,13 +446,9 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
 
     CRON_EVERY( server->expired_cron )
     {
-        mem_before   = server->stats.memused;
-        items_before = server->stats.nitems;
-
-        tr_recurse( &server->tree, gbHandleDeadTTLHandler, server, 0 );
-
-        mem_freed   = mem_before   - server->stats.memused;
-        items_freed = items_before - server->stats.nitems;
+        mem_before  = server->engine.stats.memused;
+        items_freed = gbEngineExpire( &server->engine );
+        mem_freed   = mem_before - server->engine.stats.memused;
 
         if( mem_freed > 0 && items_freed > 0 )
         {
@@ -396,22 +467,32 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
 
             gbLog( INFO, "Freed %s of expired data.", freed );
         }
+
+        phase = gbServerCronPhaseDone( server, &server->stats.cron_expire, "expire", phase );
     }
 
+    mem_before = server->stats.reaped_memory;
+    reaped     = gbServerReapIdleClients( server );
+    if( reaped > 0 )
+    {
+        gbMemFormat( server->stats.reaped_memory - mem_before, freed, 0xFF );
+
+        gbLog( INFO, "Disconnected %lu idle clients, freed %s of buffers.", reaped, freed );
+    }
+
+    phase = gbServerCronPhaseDone( server, &server->stats.cron_reap, "reap", phase );
+
     CRON_EVERY( server->max_mem_cron )
     {
-        if( server->stats.memused > server->limits.maxmem )
+        if( server->engine.stats.memused > server->engine.limits.maxmem )
         {
 
-            mem_before   = server->stats.memused;
-            items_before = server->stats.nitems;
+            mem_before = server->engine.stats.memused;
 
             gbLog( WARNING, "Max memory exhausted, trying to free data that was accessed not in the last %ds.", server->gc_ratio );
 
-            tr_recurse( &server->tree, gbMemoryFreeHandler, server, 0 );
-
-            mem_freed   = mem_before   - server->stats.memused;
-            items_freed = items_before - server->stats.nitems;
+            items_freed = gbEngineCollect( &server->engine, server->gc_ratio );
+            mem_freed   = mem_before - server->engine.stats.memused;
 
             if( mem_freed > 0 && items_freed > 0 )
             {
@@ -430,14 +511,16 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
 
                 gbLog( INFO, "Freed %s of expired data.", freed );
             }
+
+            phase = gbServerCronPhaseDone( server, &server->stats.cron_gc, "gc", phase );
         }
     }
 
     CRON_EVERY( 15000 )
     {
-        gbMemFormat( server->stats.memused, used, 0xFF );
-        gbMemFormat( server->limits.maxmem, max,  0xFF );
-        gbMemFormat( server->stats.sizeavg, avgsize, 0xFF );
+        gbMemFormat( server->engine.stats.memused, used, 0xFF );
+        gbMemFormat( server->engine.limits.maxmem, max,  0xFF );
+        gbMemFormat( server->engine.stats.sizeavg, avgsize, 0xFF );
 
         gbServerFormatUptime( server, uptime );
 
@@ -448,13 +531,17 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
              used,
              max,
              server->stats.nclients,
-             server->stats.nitems,
-             server->stats.ncompressed,
+             server->engine.stats.nitems,
+             server->engine.stats.ncompressed,
              avgsize,
              uptime
             );
+
+        phase = gbServerCronPhaseDone( server, &server->stats.cron_log, "log", phase );
     }
 
+    gbHistogramAdd( &server->stats.cron_total, gbHistogramClock() - start );
+
     ++server->stats.crondone;
 
     return server->cronperiod;
@@ -496,13 +583,13 @@ static void gbSignalHandler(int sig)
 {
     if( sig == SIGTERM )
     {
-        gbLog( WARNING, "Received SIGTERM, scheduling shutdown..." );
+        gbLogSignal( WARNING, "Received SIGTERM, scheduling shutdown..." );
         server.shutdown = 1;
     }
     else {
-        gbLog( CRITICAL, "" );
-        gbLog( CRITICAL, "********* %s *********", gbSignalDescription(sig) );
-        gbLog( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "********* %s *********", gbSignalDescription(sig) );
+        gbLogSignal( CRITICAL, "" );
 
         void *trace[32];
         size_t size, i;
@@ -515,34 +602,33 @@ static void gbSignalHandler(int sig)
              max[0xFF] = {0},
              uptime[0xFF] = {0};
 
-        gbMemFormat( server.stats.memused, used, 0xFF );
-        gbMemFormat( server.limits.maxmem, max,  0xFF );
+        gbMemFormat( server.engine.stats.memused, used, 0xFF );
+        gbMemFormat( server.engine.limits.maxmem, max,  0xFF );
         gbServerFormatUptime( &server, uptime );
 
-        gbLog( CRITICAL, "INFO:" );
-        gbLog( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "INFO:" );
+        gbLogSignal( CRITICAL, "" );
 
-        gbLog( CRITICAL, "  Version         : %s", VERSION );
-        gbLog( CRITICAL, "  Uptime          : %s", uptime );
-        gbLog( CRITICAL, "  Memory Used     : %s/%s", used, max );
-        gbLog( CRITICAL, "  Current Items   : %d", server.stats.nitems );
-        gbLog( CRITICAL, "  Current Clients : %d", server.stats.nclients );
+        gbLogSignal( CRITICAL, "  Version         : %s", VERSION );
+        gbLogSignal( CRITICAL, "  Uptime          : %s", uptime );
+        gbLogSignal( CRITICAL, "  Memory Used     : %s/%s", used, max );
+        gbLogSignal( CRITICAL, "  Current Items   : %d", server.engine.stats.nitems );
+        gbLogSignal( CRITICAL, "  Current Clients : %d", server.stats.nclients );
 #if HAVE_BACKTRACE
-        gbLog( CRITICAL, "" );
-        gbLog( CRITICAL, "BACKTRACE:" );
-        gbLog( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "BACKTRACE:" );
+        gbLogSignal( CRITICAL, "" );
 
         for( i = 0; i < size; i++ )
         {
-            gbLog( CRITICAL, "  %s", strings[i] );
+            gbLogSignal( CRITICAL, "  %s", strings[i] );
         }
 #endif
-        gbLog( CRITICAL, "" );
-        gbLog( CRITICAL, "***************************************" );
-
-        gbLogFinalize();
+        gbLogSignal( CRITICAL, "" );
+        gbLogSignal( CRITICAL, "***************************************" );
 
-        exit(-1);
+        // the report is already on disk, exit handlers and stdio could deadlock from here
+        _exit(-1);
     }
 }
 
@@ -577,15 +663,6 @@ void gbProcessInit()
         gbLog( WARNING, "Error creating pid file %s.", server.pidfile );
 }
 
-void gbObjectDestroyHandler( tnode_t *elem, size_t level, void *data )
-{
-    assert( elem != NULL );
-
-    gbItem *item = elem->data;
-    if( item )
-        gbDestroyItem( data, item );
-}
-
 void gbConfigDestroyHandler( tnode_t *elem, size_t level, void *data )
 {
     assert( elem != NULL );
@@ -598,40 +675,29 @@ void gbConfigDestroyHandler( tnode_t *elem, size_t level, void *data )
 void gbServerDestroy( gbServer *server )
 {
     assert( server != NULL );
-    assert( server->m_keys != NULL );
-    assert( server->m_values != NULL );
-    assert( server->m_buffer != NULL );
-    assert( server->lzf_buffer != NULL );
     assert( server->events != NULL );
 
-    tr_recurse( &server->tree, gbObjectDestroyHandler,   server, 0 );
     tr_recurse( &server->config, gbConfigDestroyHandler, server, 0 );
 
-    if( server->clients )
+    while( server->clients )
     {
-        ll_foreach( server->clients, citem )
-        {
-            assert( citem != NULL );
-
-            gbClient *client = citem->data;
-            if( client )
-            {
-                gbClientDestroy(client);
-            }
-        }
-
-        ll_destroy( server->clients );
+        gbClientDestroy( server->clients );
     }
 
-    ll_destroy( server->m_keys );
-    ll_destroy( server->m_values );
+    if( server->idle_wheel )
+        zfree( server->idle_wheel );
 
-    zfree( server->m_buffer );
-    zfree( server->lzf_buffer );
+    gbEngineDestroy( &server->engine );
+    gbSlowLogDestroy( &server->slowlog );
+
+    if( server->batch_args )
+    {
+        zfree( server->batch_args );
+        zfree( server->batch_lens );
+    }
 
-    opool_destroy( &server->item_pool );
+    opool_destroy( &server->client_pool );
 
-    tr_free( &server->tree );
     tr_free( &server->config );
 
     gbDeleteTimeEvent( server->events, server->cron_id );
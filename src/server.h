@@ -50,8 +50,8 @@
 void gbMemFormat( unsigned long used, char *buffer, size_t size );
 void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
+void gbShmWakeupHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask);
-void gbMemoryFreeHandler( tnode_t *elem, size_t level, void *data );
 int  gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data);
 void gbDaemonize();
 void gbProcessInit();
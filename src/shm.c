@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "configure.h"
+
+// memfd_create is only declared with the GNU extensions enabled
+#if defined(HAVE_MEMFD_CREATE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "shm.h"
+#include "zmem.h"
+
+#ifdef HAVE_MEMFD_CREATE
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+gbShm *gbShmCreate( uint32_t ring_size, char *err )
+{
+    assert( ring_size > 0 && ( ring_size & ( ring_size - 1 ) ) == 0 );
+
+    gbShm *shm = zcalloc( sizeof(gbShm) );
+    size_t size = gbShmMappingSize( ring_size );
+
+    assert( shm != NULL );
+
+    shm->header     = MAP_FAILED;
+    shm->ring_size  = ring_size;
+    shm->size       = size;
+    shm->server_efd =
+    shm->client_efd = -1;
+
+    if( ( shm->memfd = memfd_create( "gibson-shm", MFD_CLOEXEC ) ) == -1 )
+    {
+        snprintf( err, 0xFF, "memfd_create: %s", strerror(errno) );
+        goto fail;
+    }
+
+    if( ftruncate( shm->memfd, size ) == -1 )
+    {
+        snprintf( err, 0xFF, "ftruncate: %s", strerror(errno) );
+        goto fail;
+    }
+
+    shm->header = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0 );
+    if( shm->header == MAP_FAILED )
+    {
+        snprintf( err, 0xFF, "mmap: %s", strerror(errno) );
+        goto fail;
+    }
+
+    shm->server_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    shm->client_efd = eventfd( 0, EFD_CLOEXEC );
+    if( shm->server_efd == -1 || shm->client_efd == -1 )
+    {
+        snprintf( err, 0xFF, "eventfd: %s", strerror(errno) );
+        goto fail;
+    }
+
+    // the memfd is zero filled, rings start empty
+    shm->header->magic     = GB_SHM_MAGIC;
+    shm->header->version   = GB_SHM_VERSION;
+    shm->header->ring_size = ring_size;
+
+    return shm;
+
+fail:
+
+    gbShmDestroy( shm );
+
+    return NULL;
+}
+
+size_t gbShmReadRequests( gbShm *shm, void *buf, size_t len )
+{
+    gbShmHeader *h = shm->header;
+
+    return gbShmRingRead( &h->requests, gbShmRequestsData(h), shm->ring_size, buf, len );
+}
+
+size_t gbShmWriteReplies( gbShm *shm, const void *buf, size_t len )
+{
+    gbShmHeader *h = shm->header;
+
+    return gbShmRingWrite( &h->replies, gbShmRepliesData( h, shm->ring_size ), shm->ring_size, buf, len );
+}
+
+size_t gbShmRepliesUsed( gbShm *shm )
+{
+    gbShmHeader *h = shm->header;
+
+    return gbShmRingUsed( h->replies.head, __atomic_load_n( &h->replies.tail, __ATOMIC_ACQUIRE ), shm->ring_size );
+}
+
+void gbShmNotify( gbShm *shm )
+{
+    gbShmHeader *h = shm->header;
+    uint64_t one = 1;
+
+    // only pay for the syscall if the client is actually sleeping
+    if( gbShmIsWaiting( &h->replies.consumer_waiting ) || gbShmIsWaiting( &h->requests.producer_waiting ) )
+    {
+        h->replies.consumer_waiting  =
+        h->requests.producer_waiting = 0;
+
+        if( write( shm->client_efd, &one, sizeof(one) ) != sizeof(one) )
+        {
+            // the counter can't overflow in practice, nothing to do
+        }
+    }
+}
+
+void gbShmClearWakeup( gbShm *shm )
+{
+    uint64_t value;
+
+    if( read( shm->server_efd, &value, sizeof(value) ) != sizeof(value) )
+    {
+        // EAGAIN, spurious wakeup
+    }
+}
+
+void gbShmDestroy( gbShm *shm )
+{
+    assert( shm != NULL );
+
+    if( shm->header != MAP_FAILED && shm->header != NULL )
+        munmap( shm->header, shm->size );
+
+    if( shm->memfd != -1 )
+        close( shm->memfd );
+    if( shm->server_efd != -1 )
+        close( shm->server_efd );
+    if( shm->client_efd != -1 )
+        close( shm->client_efd );
+
+    zfree( shm );
+}
+
+#else
+
+gbShm *gbShmCreate( uint32_t ring_size, char *err )
+{
+    snprintf( err, 0xFF, "shared memory transport not supported on this system" );
+
+    return NULL;
+}
+
+size_t gbShmReadRequests( gbShm *shm, void *buf, size_t len )
+{
+    return 0;
+}
+
+size_t gbShmWriteReplies( gbShm *shm, const void *buf, size_t len )
+{
+    return 0;
+}
+
+size_t gbShmRepliesUsed( gbShm *shm )
+{
+    return 0;
+}
+
+void gbShmNotify( gbShm *shm )
+{
+
+}
+
+void gbShmClearWakeup( gbShm *shm )
+{
+
+}
+
+void gbShmDestroy( gbShm *shm )
+{
+    zfree( shm );
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Shared memory transport for clients running on the same host.
+ *
+ * A client connected to a unix socket sends OP_SHM and receives, attached
+ * to the REPL_OK reply, three file descriptors: a memfd holding a gbShmHeader
+ * followed by the requests and the replies rings, the eventfd to write in
+ * order to wake up the server and the eventfd the server writes to wake up
+ * the client. From then on requests are written into the requests ring and
+ * replies read from the replies ring, both with the very same framing used
+ * over sockets. The socket is only used to detect the client going away.
+ *
+ * Each ring is a single producer, single consumer byte stream: head and tail
+ * are the total number of bytes ever written and read, so used space is
+ * head - tail, and a frame can be split across the end of the ring or
+ * across several writes.
+ *
+ * Wakeups:
+ *  - the client writes the server eventfd after each batch of requests.
+ *  - the server writes the client eventfd after writing replies, but only if
+ *    replies.consumer_waiting is set, or after consuming requests if
+ *    requests.producer_waiting is set.
+ *  - the client writes the server eventfd after consuming replies if
+ *    replies.producer_waiting is set.
+ * A party sets its waiting flag, checks the ring again and only then sleeps.
+ *
+ * The whole mapping is writable by the client, so the server never trusts
+ * it: the ring size is kept in the private gbShm and head/tail more than a
+ * ring apart are reported as GB_SHM_CORRUPTED.
+ */
+
+#define GB_SHM_MAGIC   0x48534247 // GBSH
+#define GB_SHM_VERSION 1
+
+// offset of the rings data from the beginning of the mapping
+#define GB_SHM_DATA_OFFSET 4096
+
+typedef struct
+{
+    // total bytes written, only moved by the producer
+    uint64_t head __attribute__((aligned(64)));
+    // the producer is sleeping until there's room in the ring
+    uint32_t producer_waiting;
+    // total bytes read, only moved by the consumer
+    uint64_t tail __attribute__((aligned(64)));
+    // the consumer is sleeping until there's data in the ring
+    uint32_t consumer_waiting;
+}
+gbShmRing;
+
+typedef struct
+{
+    uint32_t  magic;
+    uint32_t  version;
+    // size of each ring, a power of two, only published for the client
+    uint32_t  ring_size;
+    // client -> server
+    gbShmRing requests;
+    // server -> client
+    gbShmRing replies;
+}
+gbShmHeader;
+
+#define gbShmRequestsData(h) ( (uint8_t *)(h) + GB_SHM_DATA_OFFSET )
+#define gbShmRepliesData(h, ring_size)  ( (uint8_t *)(h) + GB_SHM_DATA_OFFSET + (ring_size) )
+#define gbShmMappingSize(ring_size) ( GB_SHM_DATA_OFFSET + 2 * (size_t)(ring_size) )
+
+// returned instead of a size when head and tail are more than a ring apart
+#define GB_SHM_CORRUPTED ((size_t)-1)
+
+// bytes used in the ring, GB_SHM_CORRUPTED if the other party broke it
+static inline size_t gbShmRingUsed( uint64_t head, uint64_t tail, uint32_t ring_size )
+{
+    return head - tail > ring_size ? GB_SHM_CORRUPTED : head - tail;
+}
+
+// write up to 'len' bytes into the ring, returns the number of bytes written
+// or GB_SHM_CORRUPTED
+static inline size_t gbShmRingWrite( gbShmRing *ring, uint8_t *data, uint32_t ring_size, const void *buf, size_t len )
+{
+    uint64_t head = __atomic_load_n( &ring->head, __ATOMIC_RELAXED ),
+             tail = __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+    size_t used = gbShmRingUsed( head, tail, ring_size ), room, off = head & ( ring_size - 1 ), first;
+
+    if( used == GB_SHM_CORRUPTED )
+        return GB_SHM_CORRUPTED;
+
+    room  = ring_size - used;
+    len   = len < room ? len : room;
+    first = len < ring_size - off ? len : ring_size - off;
+
+    memcpy( data + off, buf, first );
+    memcpy( data, (const uint8_t *)buf + first, len - first );
+
+    __atomic_store_n( &ring->head, head + len, __ATOMIC_RELEASE );
+
+    return len;
+}
+
+// read up to 'len' bytes from the ring, returns the number of bytes read
+// or GB_SHM_CORRUPTED
+static inline size_t gbShmRingRead( gbShmRing *ring, const uint8_t *data, uint32_t ring_size, void *buf, size_t len )
+{
+    uint64_t tail = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED ),
+             head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+    size_t avail = gbShmRingUsed( head, tail, ring_size ), off = tail & ( ring_size - 1 ), first;
+
+    if( avail == GB_SHM_CORRUPTED )
+        return GB_SHM_CORRUPTED;
+
+    len   = len < avail ? len : avail;
+    first = len < ring_size - off ? len : ring_size - off;
+
+    memcpy( buf, data + off, first );
+    memcpy( (uint8_t *)buf + first, data, len - first );
+
+    __atomic_store_n( &ring->tail, tail + len, __ATOMIC_RELEASE );
+
+    return len;
+}
+
+// set a waiting flag, a full barrier makes sure the ring is checked again
+// only after the other party can see the flag
+static inline void gbShmSetWaiting( uint32_t *flag, uint32_t value )
+{
+    __atomic_store_n( flag, value, __ATOMIC_SEQ_CST );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+}
+
+static inline uint32_t gbShmIsWaiting( uint32_t *flag )
+{
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    return __atomic_load_n( flag, __ATOMIC_SEQ_CST );
+}
+
+// server side of a shared memory transport
+typedef struct
+{
+    // the shared mapping
+    gbShmHeader *header;
+    // ring and mapping sizes, never read back from the header the client can write
+    uint32_t ring_size;
+    size_t   size;
+    // memfd backing the mapping
+    int memfd;
+    // written by the client to wake up the server
+    int server_efd;
+    // written by the server to wake up the client
+    int client_efd;
+}
+gbShm;
+
+gbShm *gbShmCreate( uint32_t ring_size, char *err );
+// read requests, returns the number of bytes copied into 'buf' or GB_SHM_CORRUPTED
+size_t gbShmReadRequests( gbShm *shm, void *buf, size_t len );
+// write replies, returns the number of bytes copied from 'buf' or GB_SHM_CORRUPTED
+size_t gbShmWriteReplies( gbShm *shm, const void *buf, size_t len );
+// bytes of replies not yet consumed by the client or GB_SHM_CORRUPTED
+size_t gbShmRepliesUsed( gbShm *shm );
+// wake up the client if it is waiting for replies or room for requests
+void   gbShmNotify( gbShm *shm );
+// consume the server eventfd counter
+void   gbShmClearWakeup( gbShm *shm );
+void   gbShmDestroy( gbShm *shm );
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "slowlog.h"
+#include "zmem.h"
+#include <assert.h>
+#include <string.h>
+
+void gbSlowLogInit( gbSlowLog *log, unsigned int size, uint64_t threshold )
+{
+    assert( log != NULL );
+
+    log->entries   = size ? (gbSlowOp *)zcalloc( size * sizeof(gbSlowOp) ) : NULL;
+    log->size      = size;
+    log->next      = 0;
+    log->count     = 0;
+    log->threshold = threshold;
+}
+
+void gbSlowLogDestroy( gbSlowLog *log )
+{
+    assert( log != NULL );
+
+    if( log->entries )
+        zfree( log->entries );
+
+    log->entries = NULL;
+    log->size    = 0;
+}
+
+gbSlowOp *gbSlowLogAdd( gbSlowLog *log )
+{
+    assert( log != NULL );
+    assert( log->entries != NULL );
+
+    gbSlowOp *op = &log->entries[ log->next % log->size ];
+
+    memset( op, 0x00, sizeof(gbSlowOp) );
+
+    op->id = log->next++;
+
+    if( log->count < log->size )
+        ++log->count;
+
+    return op;
+}
+
+unsigned int gbSlowLogLength( gbSlowLog *log )
+{
+    assert( log != NULL );
+
+    return log->count;
+}
+
+gbSlowOp *gbSlowLogGet( gbSlowLog *log, unsigned int i )
+{
+    assert( log != NULL );
+    assert( i < gbSlowLogLength( log ) );
+
+    return &log->entries[ ( log->next - 1 - i ) % log->size ];
+}
+
+void gbSlowLogReset( gbSlowLog *log )
+{
+    assert( log != NULL );
+
+    // ids keep growing so clients can tell new entries from old ones
+    log->count = 0;
+}
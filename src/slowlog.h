@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SLOWLOG_H__
+#define __SLOWLOG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Slow operations log.
+ *
+ * Requests taking longer than the threshold to be processed are recorded
+ * in a fixed size ring, once it is full the oldest entry is overwritten.
+ * Only the first GB_SLOWLOG_KEY_SIZE bytes of the key or prefix are kept.
+ */
+#define GB_SLOWLOG_KEY_SIZE    64
+#define GB_SLOWLOG_CLIENT_SIZE 64
+
+typedef struct
+{
+    // unique and increasing entry id
+    unsigned long id;
+    // unix time the operation was recorded
+    time_t   time;
+    // processing time in nanoseconds
+    uint64_t duration;
+    // request opcode and reply code
+    short    opcode;
+    short    code;
+    // number of items matched by the operation
+    uint32_t items;
+    // size of the reply
+    uint32_t bytes;
+    // client address
+    char     client[GB_SLOWLOG_CLIENT_SIZE];
+    // first bytes of the key or prefix and its full length
+    unsigned char key[GB_SLOWLOG_KEY_SIZE];
+    size_t   keylen;
+}
+gbSlowOp;
+
+typedef struct
+{
+    // ring of 'size' entries, NULL if the log is disabled
+    gbSlowOp *entries;
+    unsigned int size;
+    // number of entries ever recorded, the next entry goes to next % size
+    unsigned long next;
+    // number of entries currently in the ring
+    unsigned int count;
+    // operations taking at least this many nanoseconds are recorded
+    uint64_t threshold;
+}
+gbSlowLog;
+
+void gbSlowLogInit( gbSlowLog *log, unsigned int size, uint64_t threshold );
+void gbSlowLogDestroy( gbSlowLog *log );
+// return the entry to fill for a new slow operation, overwriting the oldest if the log is full
+gbSlowOp *gbSlowLogAdd( gbSlowLog *log );
+// number of entries in the log
+unsigned int gbSlowLogLength( gbSlowLog *log );
+// i-th entry, from the most recent one
+gbSlowOp *gbSlowLogGet( gbSlowLog *log, unsigned int i );
+void gbSlowLogReset( gbSlowLog *log );
+
+#define gbSlowLogEnabled( log ) ( (log)->entries != NULL )
+
+#endif
@@ -138,165 +138,134 @@ void *tr_find( trie_t *trie, unsigned char *key, int len )
 	return ( node ? node->data : NULL );
 }
 
-struct tr_search_data
-{
-    llist_t **keys;
-    llist_t **values;
-    char    *current;
-    size_t   total;
-    long     limit;
-    tr_count_handler  count_callback;
-    tr_search_handler search_callback;
-    tr_search_handler search_nodes_callback;
-    void    *ctx;
-};
+/*
+ * Number of keys tr_find_nodes walks down the trie at the same time.
+ * Every step of a lookup depends on the node loaded by the previous one,
+ * walking several keys in lockstep lets the cache misses of one key overlap
+ * with the work on the others.
+ */
+#define TR_FIND_GROUP 16
 
-void tr_recurse( trie_t *trie, tr_recurse_handler handler, void *data, size_t level )
+size_t tr_find_nodes( trie_t *trie, unsigned char **keys, size_t *lens, size_t n, tnode_t **nodes )
 {
     assert( trie != NULL );
-    assert( handler != NULL );
-
-    struct tr_search_data *search = data;
-
-    // we've reached the limit
-    if( search && search->limit > 0 && search->total == search->limit ){
-        return;
-    }
-
-	size_t i, nnodes = tr_node_children(trie);
-
-    assert( nnodes == 0 || trie->nodes != NULL );
+    assert( keys != NULL );
+    assert( lens != NULL );
+    assert( nodes != NULL );
 
-	handler( trie, level, data );
+    tnode_t *current[TR_FIND_GROUP], *node = NULL;
+    size_t key[TR_FIND_GROUP], depth[TR_FIND_GROUP];
+    size_t active = 0, next = 0, found = 0, i, k;
 
-	for( i = 0; i < nnodes; ++i )
+    for( ; active < TR_FIND_GROUP && next < n; ++active, ++next )
     {
-		tr_recurse( trie->nodes + i, handler, data, level + 1 );
-	}
-}
+        assert( lens[next] > 0 );
 
-static void tr_search_recursive_handler(tnode_t *node, size_t level, void *data)
-{
-    assert( node != NULL );
-    assert( data != NULL );
-
-	struct tr_search_data *search = data;
-
-	search->current[ level ] = node->value;
+        key[active]     = next;
+        depth[active]   = 0;
+        current[active] = trie;
+    }
 
-	// found a value
-	if( node->data != NULL )
+    while( active > 0 )
     {
-		search->current[ level + 1 ] = '\0';
+        for( i = 0; i < active; )
+        {
+            k    = key[i];
+            node = tr_find_next_node( current[i], keys[k][ depth[i] ] );
 
-        // use the count callback
-        if( search->count_callback != NULL ) {
-            search->total += search->count_callback( search->ctx, search->current, node->data );
-        }
-        // use the search callback
-        else if( search->search_callback != NULL ) {
-            search->total += search->search_callback( search->ctx, search->current, node->data );
-        }
-        // append items to provided lists
-        else {
-            ++search->total;
+            if( node && ++depth[i] < lens[k] )
+            {
+                /*
+                 * The children of this node are scanned only on the next round,
+                 * tr_find_next_node starts from the last one so that's the line
+                 * to fetch.
+                 */
+                if( node->nodes )
+                    __builtin_prefetch( node->nodes + node->n_nodes );
+
+                current[i++] = node;
+                continue;
+            }
 
-            ll_append( *search->keys, zstrdup( search->current ) );
+            nodes[k] = node;
+            if( node )
+                ++found;
 
-            if( search->values != NULL )
+            // this slot is done, start the next key or shrink the group
+            if( next < n )
             {
-                assert( *search->values != NULL );
+                assert( lens[next] > 0 );
 
-                ll_append( *search->values, node->data );
+                key[i]     = next++;
+                depth[i]   = 0;
+                current[i] = trie;
+                ++i;
+            }
+            else
+            {
+                --active;
+
+                key[i]     = key[active];
+                depth[i]   = depth[active];
+                current[i] = current[active];
             }
         }
-	}
+    }
+
+    return found;
 }
 
-size_t tr_search( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, llist_t **keys, llist_t **values )
+struct tr_search_data
 {
-    assert( trie != NULL );
-    assert( prefix != NULL );
-    assert( len > 0 );
-    assert( len < maxkeylen );
-    assert( keys != NULL );
-
-	struct tr_search_data searchdata = {0};
-
-	searchdata.keys    = keys;
-	searchdata.values  = values;
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
-    searchdata.limit   = limit;
-
-	tnode_t *start = tr_find_node( trie, prefix, len );
-
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
-	}
-
-	return searchdata.total;
-}
+    char    *current;
+    size_t   total;
+    long     limit;
+    tr_search_handler callback;
+    void    *ctx;
+};
 
-size_t tr_search_callback( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, tr_search_handler callback, void *ctx ) {
+void tr_recurse( trie_t *trie, tr_recurse_handler handler, void *data, size_t level )
+{
     assert( trie != NULL );
-    assert( prefix != NULL );
-    assert( len > 0 );
-    assert( len < maxkeylen );
+    assert( handler != NULL );
 
-    struct tr_search_data searchdata = {0};
+	size_t i, nnodes = tr_node_children(trie);
 
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
-    searchdata.search_callback = callback;
-    searchdata.ctx     = ctx;
-    searchdata.limit   = limit;
+    assert( nnodes == 0 || trie->nodes != NULL );
 
-	tnode_t *start = tr_find_node( trie, prefix, len );
+	handler( trie, level, data );
 
-	if( start )
+	for( i = 0; i < nnodes; ++i )
     {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
+		tr_recurse( trie->nodes + i, handler, data, level + 1 );
 	}
-
-	return searchdata.total;
 }
 
-
-size_t tr_count( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, tr_count_handler callback, void *ctx ) {
+// same as tr_recurse, but stops once the search limit is reached
+static void tr_search_recurse( trie_t *trie, tr_recurse_handler handler, struct tr_search_data *search, size_t level )
+{
     assert( trie != NULL );
-    assert( prefix != NULL );
-    assert( len > 0 );
-    assert( len < maxkeylen );
-
-    struct tr_search_data searchdata = {0};
+    assert( handler != NULL );
+    assert( search != NULL );
 
-    searchdata.keys    = NULL;
-    searchdata.values  = NULL;
-    searchdata.current = alloca( maxkeylen );
-    searchdata.total   = 0;
-    searchdata.limit   = limit;
-    searchdata.count_callback = callback;
-    searchdata.ctx     = ctx;
+    // we've reached the limit
+    if( search->limit > 0 && search->total == search->limit ){
+        return;
+    }
 
-    tnode_t *start = tr_find_node( trie, prefix, len );
+	size_t i, nnodes = tr_node_children(trie);
 
-    if( start )
-    {
-        strncpy( searchdata.current, (char *)prefix, len );
+    assert( nnodes == 0 || trie->nodes != NULL );
 
-        tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
-    }
+	handler( trie, level, search );
 
-    return searchdata.total;
+	for( i = 0; i < nnodes; ++i )
+    {
+		tr_search_recurse( trie->nodes + i, handler, search, level + 1 );
+	}
 }
 
-static void tr_search_nodes_recursive_handler(tnode_t *node, size_t level, void *data)
+static void tr_search_recursive_handler(tnode_t *node, size_t level, void *data)
 {
     assert( node != NULL );
     assert( data != NULL );
@@ -310,73 +279,39 @@ static void tr_search_nodes_recursive_handler(tnode_t *node, size_t level, void
     {
 		search->current[ level + 1 ] = '\0';
 
-        // use the search nodes callback
-        if( search->search_nodes_callback != NULL ) {
-            search->total += search->search_nodes_callback( search->ctx, search->current, node );
-        }
-        else {
-            ++search->total;
-
-            assert( search->keys != NULL );
-            assert( search->values != NULL );
-            assert( *search->keys != NULL );
-            assert( *search->values != NULL );
-
-    		ll_append( *search->keys,   zstrdup( search->current ) );
-    		ll_append( *search->values, node );
-        }
+        search->total += search->callback( search->ctx, node, (unsigned char *)search->current, level + 1 );
 	}
 }
 
-size_t tr_search_nodes( trie_t *trie, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes )
-{
+size_t tr_search_callback( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, tr_search_handler callback, void *ctx ) {
     assert( trie != NULL );
     assert( prefix != NULL );
     assert( len > 0 );
     assert( len < maxkeylen );
+    assert( callback != NULL );
 
-	struct tr_search_data searchdata = {0};
+    struct tr_search_data searchdata = {0};
 
-	searchdata.keys    = keys;
-	searchdata.values  = nodes;
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
+	searchdata.current  = alloca( maxkeylen );
+	searchdata.total    = 0;
+    searchdata.callback = callback;
+    searchdata.ctx      = ctx;
+    searchdata.limit    = limit;
 
 	tnode_t *start = tr_find_node( trie, prefix, len );
 
 	if( start )
     {
-		strncpy( searchdata.current, (char *)prefix, len );
+		memcpy( searchdata.current, prefix, len );
 
-		tr_recurse( start, tr_search_nodes_recursive_handler, &searchdata, len - 1 );
+		tr_search_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
 	}
 
 	return searchdata.total;
 }
 
-size_t tr_search_nodes_callback( trie_t *trie, unsigned char *prefix, int len, int maxkeylen, tr_search_handler callback, void *ctx ) {
-    assert( trie != NULL );
-    assert( prefix != NULL );
-    assert( len > 0 );
-    assert( len < maxkeylen );
-
-	struct tr_search_data searchdata = {0};
-
-	searchdata.search_nodes_callback = callback;
-    searchdata.ctx     = ctx;
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
-
-	tnode_t *start = tr_find_node( trie, prefix, len );
-
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_nodes_recursive_handler, &searchdata, len - 1 );
-	}
-
-	return searchdata.total;
+size_t tr_count( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, tr_count_handler callback, void *ctx ) {
+    return tr_search_callback( trie, prefix, len, limit, maxkeylen, callback, ctx );
 }
 
 void *tr_remove( trie_t *trie, unsigned char *key, int len )
@@ -49,8 +49,13 @@ __attribute__((packed)) trie_t;
 typedef trie_t tnode_t;
 
 typedef void (*tr_recurse_handler)(tnode_t *, size_t, void *);
-typedef int  (*tr_count_handler)(void *,unsigned char *, void *);
-typedef int  (*tr_search_handler)(void *,unsigned char *, void *);
+/*
+ * Search callbacks get the node holding the data and the key leading to it,
+ * the key buffer is only valid during the call. The node can be updated or
+ * emptied in place, the return value is added to the search total.
+ */
+typedef int  (*tr_count_handler)(void *, tnode_t *, unsigned char *, size_t);
+typedef int  (*tr_search_handler)(void *, tnode_t *, unsigned char *, size_t);
 
 #define tr_init_tree( t ) \
     (t).n_nodes = 0; \
@@ -60,16 +65,14 @@ typedef int  (*tr_search_handler)(void *,unsigned char *, void *);
 void   *tr_insert( trie_t *at, unsigned char *key, int len, void *value );
 trie_t *tr_find_node( trie_t *at, unsigned char *key, int len );
 void   *tr_find( trie_t *at, unsigned char *key, int len );
+// look up n keys at once, nodes[i] is set to the node of keys[i] or NULL, returns the number of nodes found
+size_t  tr_find_nodes( trie_t *at, unsigned char **keys, size_t *lens, size_t n, tnode_t **nodes );
 void    tr_recurse( trie_t *at, tr_recurse_handler handler, void *data, size_t level );
 
 size_t  tr_count( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, tr_count_handler callback, void *ctx );
 
-size_t  tr_search( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, llist_t **keys, llist_t **values );
 size_t  tr_search_callback( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, tr_search_handler callback, void *ctx );
 
-size_t  tr_search_nodes( trie_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes );
-size_t  tr_search_nodes_callback( trie_t *at, unsigned char *prefix, int len, int maxkeylen, tr_search_handler callback, void *ctx );
-
 
 void   *tr_remove( trie_t *at, unsigned char *key, int len );
 void    tr_free( trie_t *at );